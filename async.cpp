@@ -0,0 +1,325 @@
+#include <async.h>
+#include <cpu_utils.h>
+#include <kernel.h>
+#include <percpu.h>
+#include <softirq.h>
+#include <thread.h>
+#include <common/kmemory.hpp>
+#include <lib/utils.h>
+#include <mm/slab.h>
+
+// frame size classes 128B .. 4K, larger frames come from kmalloc
+constexpr u64 Log2MinFrameSize = 7;
+constexpr u64 Log2MaxFrameSize = 12;
+constexpr u64 FrameSizeClasses = Log2MaxFrameSize - Log2MinFrameSize + 1;
+// free frames each cpu keeps per size class before returning them to the slab caches
+constexpr u64 FrameCacheSize = 16;
+
+struct FrameCache {
+  void *frames[FrameCacheSize];
+  u64 count;
+};
+
+static const char *frame_cache_names[FrameSizeClasses] = {
+    "async-128", "async-256", "async-512", "async-1K", "async-2K", "async-4K",
+};
+static KmemCache frame_slabs[FrameSizeClasses];
+// only touched by their cpu with interrupts disabled
+static FrameCache frame_caches[MaxCpus][FrameSizeClasses];
+
+static Executor *executors[MaxCpus];
+
+void *async_frame_alloc(size_t size) {
+  auto log2size = log2_ceil(size);
+  if (log2size > Log2MaxFrameSize) {
+    return kmalloc(size);
+  }
+  auto index = log2size < Log2MinFrameSize ? 0 : log2size - Log2MinFrameSize;
+  auto flags = irq_save();
+  auto &cache = frame_caches[this_cpu()->id][index];
+  void *p = cache.count > 0 ? cache.frames[--cache.count] : nullptr;
+  irq_restore(flags);
+  return p ? p : frame_slabs[index].alloc();
+}
+
+void async_frame_free(void *p, size_t size) {
+  auto log2size = log2_ceil(size);
+  if (log2size > Log2MaxFrameSize) {
+    kfree(p);
+    return;
+  }
+  auto index = log2size < Log2MinFrameSize ? 0 : log2size - Log2MinFrameSize;
+  auto flags = irq_save();
+  auto &cache = frame_caches[this_cpu()->id][index];
+  bool cached = cache.count < FrameCacheSize;
+  if (cached) {
+    cache.frames[cache.count++] = p;
+  }
+  irq_restore(flags);
+  if (!cached) {
+    frame_slabs[index].free(p);
+  }
+}
+
+void AsyncPromiseBase::unhandled_exception() {
+  Kernel::k->panic("exception in a coroutine");
+}
+
+Executor *Executor::current() {
+  return executors[this_cpu()->id];
+}
+
+void Executor::ready_locked(AsyncWaiter *w) {
+  w->next = nullptr;
+  if (ready_tail_) {
+    ready_tail_->next = w;
+  } else {
+    ready_head_ = w;
+  }
+  ready_tail_ = w;
+  wq_.wake_one_locked();
+}
+
+void Executor::ready(AsyncWaiter *w) {
+  auto flags = wq_.lock().lock_irqsave();
+  ready_locked(w);
+  wq_.lock().unlock_irqrestore(flags);
+}
+
+void Executor::add_timer(AsyncTimer *t) {
+  auto flags = wq_.lock().lock_irqsave();
+  AsyncTimer *prev = nullptr;
+  auto next = timers_;
+  while (next && next->deadline <= t->deadline) {
+    prev = next;
+    next = next->next;
+  }
+  t->prev = prev;
+  t->next = next;
+  t->pending = true;
+  if (prev) {
+    prev->next = t;
+  } else {
+    timers_ = t;
+    // the executor thread sleeps again with the earlier deadline
+    wq_.wake_one_locked();
+  }
+  if (next) {
+    next->prev = t;
+  }
+  timers++;
+  wq_.lock().unlock_irqrestore(flags);
+}
+
+void Executor::remove_timer_locked(AsyncTimer *t) {
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    timers_ = t->next;
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  t->prev = nullptr;
+  t->next = nullptr;
+  t->pending = false;
+  timers--;
+}
+
+bool Executor::remove_timer(AsyncTimer *t) {
+  auto flags = wq_.lock().lock_irqsave();
+  bool ret = t->pending;
+  if (ret) {
+    remove_timer_locked(t);
+  }
+  wq_.lock().unlock_irqrestore(flags);
+  return ret;
+}
+
+AsyncTimer *Executor::take_expired_locked() {
+  AsyncTimer *expired = nullptr;
+  AsyncTimer **tail = &expired;
+  while (timers_ && timers_->deadline <= timer_ticks) {
+    auto t = timers_;
+    remove_timer_locked(t);
+    *tail = t;
+    tail = &t->next;
+  }
+  return expired;
+}
+
+// Resumes the ready coroutines in batches and expires the timers, the lock is dropped while they run.
+void Executor::run() {
+  auto flags = wq_.lock().lock_irqsave();
+  while (true) {
+    if (auto t = take_expired_locked()) {
+      wq_.lock().unlock_irqrestore(flags);
+      while (t) {
+        auto next = t->next;
+        t->next = nullptr;
+        t->expire(t);
+        t = next;
+      }
+      flags = wq_.lock().lock_irqsave();
+      continue;
+    }
+    auto w = ready_head_;
+    if (!w) {
+      wq_.sleep(timers_ ? timers_->deadline : 0);
+      continue;
+    }
+    ready_head_ = nullptr;
+    ready_tail_ = nullptr;
+    wq_.lock().unlock_irqrestore(flags);
+
+    while (w) {
+      // the waiter lives in the frame, it is gone or queued again after the resume
+      auto next = w->next;
+      resumed++;
+      w->handle.resume();
+      w = next;
+    }
+    flags = wq_.lock().lock_irqsave();
+  }
+}
+
+void Executor::thread_main(void *cookie) {
+  ((Executor*)cookie)->run();
+}
+
+void Executor::print() const {
+  Kernel::sp() << "executor cpu " << SerialPort::IntRadix::Dec << cpu_ << " spawned " << spawned
+               << " resumed " << resumed << " timers " << timers << "\n";
+}
+
+bool spawn(Task<void> task) {
+  if (!task.valid()) {
+    return false;
+  }
+  auto h = task.release();
+  auto &p = h.promise();
+  p.detached = true;
+  p.start.handle = h;
+  auto executor = Executor::current();
+  p.start.executor = executor;
+  __atomic_add_fetch(&executor->spawned, 1, __ATOMIC_RELAXED);
+  executor->ready(&p.start);
+  return true;
+}
+
+void AsyncSleep::await_suspend(std::coroutine_handle<> h) {
+  handle = h;
+  executor = Executor::current();
+  expire = [](AsyncTimer *t) {
+    auto self = static_cast<AsyncSleep*>(t);
+    self->executor->ready(self);
+  };
+  deadline = timer_ticks + ticks;
+  executor->add_timer(this);
+}
+
+void AsyncYield::await_suspend(std::coroutine_handle<> h) {
+  handle = h;
+  executor = Executor::current();
+  executor->ready(this);
+}
+
+// returns false without suspending if a signal is pending
+bool AsyncEvent::Awaiter::await_suspend(std::coroutine_handle<> h) {
+  auto flags = event->lock_.lock_irqsave();
+  if (event->count_ > 0) {
+    event->count_--;
+    event->lock_.unlock_irqrestore(flags);
+    return false;
+  }
+  handle = h;
+  executor = Executor::current();
+  wait_prev = event->tail_;
+  wait_next = nullptr;
+  if (event->tail_) {
+    event->tail_->wait_next = this;
+  } else {
+    event->head_ = this;
+  }
+  event->tail_ = this;
+  waiting = true;
+  if (timeout_ticks) {
+    deadline = timer_ticks + timeout_ticks;
+    expire = AsyncEvent::expire;
+    executor->add_timer(this);
+  }
+  event->lock_.unlock_irqrestore(flags);
+  return true;
+}
+
+void AsyncEvent::remove(Awaiter *a) {
+  if (a->wait_prev) {
+    a->wait_prev->wait_next = a->wait_next;
+  } else {
+    head_ = a->wait_next;
+  }
+  if (a->wait_next) {
+    a->wait_next->wait_prev = a->wait_prev;
+  } else {
+    tail_ = a->wait_prev;
+  }
+  a->wait_prev = nullptr;
+  a->wait_next = nullptr;
+  a->waiting = false;
+}
+
+// The timer of a wait_for() expired. A signal() may have taken the waiter meanwhile, it is resumed
+// by the same executor thread after this returns.
+void AsyncEvent::expire(AsyncTimer *t) {
+  auto a = static_cast<Awaiter*>(t);
+  auto event = a->event;
+  auto flags = event->lock_.lock_irqsave();
+  if (a->waiting) {
+    event->remove(a);
+    a->timed_out = true;
+    a->executor->ready(a);
+  }
+  event->lock_.unlock_irqrestore(flags);
+}
+
+void AsyncEvent::signal() {
+  auto flags = lock_.lock_irqsave();
+  auto a = head_;
+  if (a) {
+    remove(a);
+    if (a->timeout_ticks) {
+      a->executor->remove_timer(a);
+    }
+    a->executor->ready(a);
+  } else {
+    count_++;
+  }
+  lock_.unlock_irqrestore(flags);
+}
+
+void AsyncEvent::reset() {
+  auto flags = lock_.lock_irqsave();
+  count_ = 0;
+  lock_.unlock_irqrestore(flags);
+}
+
+void executor_init(PerCpu *cpu) {
+  auto executor = knew<Executor>();
+  auto t = knew<Thread>(alloc_thread_id(), "async", nullptr, KTHREAD_STACK_SIZE);
+  assert(executor != nullptr && t != nullptr, "Out of memory for the executor");
+  executor->cpu_ = cpu->id;
+  executors[cpu->id] = executor;
+  t->tmp_start = Executor::thread_main;
+  t->cookie = executor;
+  // completions are handled ahead of ordinary threads, like tasklets
+  t->priority = SoftirqPriority;
+  t->pinned = true;
+  start_thread_on(t, cpu);
+}
+
+void async_init() {
+  for (u64 i = 0; i < FrameSizeClasses; i++) {
+    new(&frame_slabs[i]) KmemCache(frame_cache_names[i], 1UL << (Log2MinFrameSize + i));
+  }
+  executor_init(this_cpu());
+}
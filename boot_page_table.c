@@ -1,12 +1,13 @@
 #include "include/common/defs.h"
 #include "include/cpu_defs.h"
 
-// map 0-64M -> KERNEL_START -> KERNEL_START+64M
+// map 0-64M -> KERNEL_START -> KERNEL_START+64M with 4K pages
+// map 64M-4G -> KERNEL_START+64M -> KERNEL_START+4G with 2M pages
 struct KernelImagePageTable {
   struct PageMappingL4Entry pml4t[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
   struct PageDirectoryPointerEntry pdpt[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
-  struct PageDirectoryEntry pdt[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
-  struct PageTableEntry pt[KERNEL_SPACE_PAGES] ALIGN(PAGE_SIZE);
+  struct PageDirectoryEntry pdt[KERNEL_SPACE_PAGES / PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
+  struct PageTableEntry pt[KERNEL_IMAGE_PAGES] ALIGN(PAGE_SIZE);
 };
 
 struct KernelImagePageTable t ALIGN(PAGE_SIZE);
@@ -74,29 +75,33 @@ void setup_kernel_image_page_table(u64 kernelPhyStart) {
   t.pml4t[256].rw = 1;
   t.pml4t[256].base_addr = ((u64)(&t.pdpt)) >> 12;
 
-  t.pdpt[0].p = 1;
-  t.pdpt[0].rw = 1;
-  t.pdpt[0].base_addr = ((u64)(&t.pdt)) >> 12;
+  for (u64 i = 0; i < KERNEL_SPACE_PAGES / PAGES_PER_TABLE / PAGES_PER_TABLE; i++) {
+    t.pdpt[i].p = 1;
+    t.pdpt[i].rw = 1;
+    t.pdpt[i].base_addr = ((u64)(&t.pdt[PAGES_PER_TABLE * i])) >> 12;
+  }
 
-  for (u64 i = 0; i < PAGES_PER_TABLE; i++) {
+  // [KERNEL_START, KERNEL_START+KERNEL_IMAGE_PAGES*PAGE_SIZE) -> kernel image file, non-identity mapping, not manaaged by allocator
+  for (u64 i = 0; i < KERNEL_IMAGE_PAGES / PAGES_PER_TABLE; i++) {
     t.pdt[i].p = 1;
     t.pdt[i].rw = 1;
     t.pdt[i].base_addr = ((u64)&t.pt[PAGES_PER_TABLE * i]) >> 12;
   }
-
-  // [KERNEL_START, KERNEL_START+KERNEL_IMAGE_PAGES*PAGE_SIZE) -> kernel image file, non-identity mapping, not manaaged by allocator
-  // [KERNEL_START+KERNEL_IMAGE_PAGES*PAGE_SIZE, KERNEL_START+1G) -> identity mapping, available physical pages in this range are managed by allocator
-  for (u64 i = 0; i < KERNEL_SPACE_PAGES; i++) {
-    t.pt[i].p = 1;
-    t.pt[i].rw = 1;
-    t.pt[i].base_addr = i;
-  }
   for (u64 i = 0; i < KERNEL_IMAGE_PAGES; i++) {
     t.pt[i].p = 1;
     t.pt[i].rw = 1;
     t.pt[i].base_addr = (kernelPhyStart/4096) + i;
   }
 
+  // [KERNEL_START+KERNEL_IMAGE_PAGES*PAGE_SIZE, KERNEL_START+4G) -> identity mapping with 2M pages
+  for (u64 i = KERNEL_IMAGE_PAGES / PAGES_PER_TABLE; i < KERNEL_SPACE_PAGES / PAGES_PER_TABLE; i++) {
+    struct HugePageEntry *entry = (struct HugePageEntry*)&t.pdt[i];
+    entry->p = 1;
+    entry->rw = 1;
+    entry->ps = 1;
+    entry->base_addr = (i * PAGES_PER_TABLE * PAGE_SIZE) >> 12;
+  }
+
   cr3 = t.pml4t;
   puts("before setting cr3 to ");
   puti((u64)cr3);
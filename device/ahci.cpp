@@ -4,10 +4,14 @@
 #include <kernel.h>
 #include <device/pci.h>
 #include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/ioremap.h>
 #include <mm/page_alloc.h>
+#include <mm/dma_pool.h>
 #include <mm/mm.h>
+#include <mm/vmalloc.h>
 #include <common/hexdump.hpp>
-#include <process.h>
+#include <workqueue.h>
 #include <device/gpt.hpp>
 
 
@@ -261,15 +265,51 @@ typedef enum
 
 #define HBA_PxIS_TFES   (1 << 30)       /* TFES - Task File Error Status */
 
+// a PRDT entry transfers at most 4M
+constexpr u64 PrdtMaxBytes = 4UL << 20;
+// 256 bytes command tables, 64+16+48+16*8
+constexpr u32 MaxPrdtEntries = 8;
+constexpr u64 CmdTableSize = sizeof(HBA_CMD_TBL) + (MaxPrdtEntries - 1) * sizeof(HBA_PRDT_ENTRY);
+// bounce buffers of AHCIDevice::Read, a command per buffer
+constexpr u64 BounceSize = 64 * 1024;
+
+// Command lists, received FIS areas and command tables of the ports, addresses are kept 32-bit
+// since the HBA may not support 64-bit addressing.
+static DmaPool cmd_list_pool("ahci-cmd-list", 32 * sizeof(HBA_CMD_HEADER), 1024, DmaMask32);
+static DmaPool fis_pool("ahci-fis", 256, 256, DmaMask32);
+static DmaPool cmd_table_pool("ahci-cmd-table", CmdTableSize, 128, DmaMask32);
+static DmaPool bounce_pool("ahci-bounce", BounceSize, PAGE_SIZE, DmaMask32);
+
 // startl, starth are sector IDs, starting from 0
 // count is in sectors, one sector is 512 byte
-bool read(HBA_PORT *port, u32 startl, u32 starth, u32 count, u64 buf_phy_addr)
+// buf is a sector aligned kernel address, it does not have to be physically contiguous,
+// every PRDT entry covers a physically contiguous run of it.
+// Returns the number of sectors read, fewer than count if buf has more runs than MaxPrdtEntries, 0 on error.
+u32 read(HBA_PORT *port, u32 startl, u32 starth, u32 count, void *buf)
 {
+  assert((u64)buf % SectorSize == 0, "AHCI read buffer is not sector aligned");
   port->is = (u32) -1;		// Clear pending interrupt bits
   int spin = 0; // Spin lock timeout counter
   int slot = find_cmdslot(port);
   if (slot == -1)
-    return false;
+    return 0;
+
+  // runs start and end on page or sector boundaries, so they are whole sectors
+  HBA_PRDT_ENTRY prdt[MaxPrdtEntries] = {};
+  u32 prdtl = 0;
+  u64 bytes = 0;
+  const u64 total = (u64)count * SectorSize;
+  while (bytes < total && prdtl < MaxPrdtEntries) {
+    u64 run;
+    auto phy = vmalloc_to_phy((u8*)buf + bytes, min(total - bytes, PrdtMaxBytes), &run);
+    prdt[prdtl].dba = (u32)phy;
+    prdt[prdtl].dbau = phy >> 32;
+    prdt[prdtl].dbc = run - 1;	// 1 less than the actual byte count
+    prdt[prdtl].i = 1;
+    prdtl++;
+    bytes += run;
+  }
+  count = bytes / SectorSize;
 
   auto cmdheader_phy = (port->clb + ((u64)port->clbu<<32));
   assert(cmdheader_phy < IDENTITY_MAP_PHY_END, "");
@@ -277,28 +317,11 @@ bool read(HBA_PORT *port, u32 startl, u32 starth, u32 count, u64 buf_phy_addr)
   cmdheader += slot;
   cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(u32);	// Command FIS size
   cmdheader->w = 0;		// Read from device
-  cmdheader->prdtl = (u16)((count-1)>>4) + 1;	// PRDT entries count
+  cmdheader->prdtl = prdtl;	// PRDT entries count
 
   HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*)phy2virt((u64)cmdheader->ctba + ((u64)cmdheader->ctbau<<32));
-  memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) +
-      (cmdheader->prdtl-1)*sizeof(HBA_PRDT_ENTRY));
-
-  int i = 0;
-  // 8K bytes (16 sectors) per PRDT
-  for (i=0; i<cmdheader->prdtl-1; i++)
-  {
-    cmdtbl->prdt_entry[i].dba = (u64) buf_phy_addr;
-    cmdtbl->prdt_entry[i].dbau = ((u64) buf_phy_addr) >> 32;
-    cmdtbl->prdt_entry[i].dbc = 8*1024-1;	// 8K bytes (this value should always be set to 1 less than the actual value)
-    cmdtbl->prdt_entry[i].i = 1;
-    buf_phy_addr += 4*1024*2;	// 4K words
-    count -= 16;	// 16 sectors
-  }
-  // Last entry
-  cmdtbl->prdt_entry[i].dba = (u64) buf_phy_addr;
-  cmdtbl->prdt_entry[i].dbau = ((u64) buf_phy_addr) >> 32;
-  cmdtbl->prdt_entry[i].dbc = (count<<9)-1;	// 512 bytes per sector
-  cmdtbl->prdt_entry[i].i = 1;
+  memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) - sizeof(HBA_PRDT_ENTRY));
+  memcpy(cmdtbl->prdt_entry, prdt, prdtl * sizeof(HBA_PRDT_ENTRY));
 
   // Setup command
   FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
@@ -327,7 +350,7 @@ bool read(HBA_PORT *port, u32 startl, u32 starth, u32 count, u64 buf_phy_addr)
   if (spin == 1000000)
   {
     Kernel::sp() << "port hung\n";
-    return false;
+    return 0;
   }
 
   port->ci = 1<<slot;	// Issue command
@@ -343,7 +366,7 @@ bool read(HBA_PORT *port, u32 startl, u32 starth, u32 count, u64 buf_phy_addr)
     if (port->is & HBA_PxIS_TFES)	// Task file error
     {
       Kernel::sp() << "Read disk error\n";
-      return false;
+      return 0;
     }
   }
 
@@ -351,62 +374,79 @@ bool read(HBA_PORT *port, u32 startl, u32 starth, u32 count, u64 buf_phy_addr)
   if (port->is & HBA_PxIS_TFES)
   {
     Kernel::sp() << "Read disk error\n";
-    return false;
+    return 0;
   }
 
-  return true;
+  return count;
 
 }
 
+// Points the port at a command list, a received FIS area and command tables of our own
+// instead of the ones the firmware left behind.
+static void port_rebase(HBA_PORT *port) {
+  u64 clb, fb;
+  auto cmd_list = (HBA_CMD_HEADER*)cmd_list_pool.alloc(&clb);
+  auto fis = fis_pool.alloc(&fb);
+  assert(cmd_list != nullptr && fis != nullptr, "Out of memory for the AHCI port");
+  memset(cmd_list, 0, 32 * sizeof(HBA_CMD_HEADER));
+  memset(fis, 0, 256);
+  for (int i = 0; i < 32; i++) {
+    u64 ctba;
+    auto cmdtbl = cmd_table_pool.alloc(&ctba);
+    assert(cmdtbl != nullptr, "Out of memory for the AHCI command tables");
+    memset(cmdtbl, 0, CmdTableSize);
+    cmd_list[i].ctba = (u32)ctba;
+    cmd_list[i].ctbau = ctba >> 32;
+  }
+
+  stop_cmd(port);
+  port->clb = (u32)clb;
+  port->clbu = clb >> 32;
+  port->fb = (u32)fb;
+  port->fbu = fb >> 32;
+  start_cmd(port);
+}
+
 void ahci_port_init(char *port_control_register) {
   auto *cmd = (u32*)(port_control_register + 0x18);
   if ((*cmd & 2) == 0) {
     Kernel::sp() << "Spinning up\n";
     *cmd = *cmd | 2;
   }
-  start_cmd((HBA_PORT*)port_control_register);
-  // enable FIS
-//  *cmd |= 1 << 4;
+  port_rebase((HBA_PORT*)port_control_register);
   Kernel::sp() << IntRadix::Hex << "  port command " << *cmd << "\n";
 
-  auto command_list_addr = (*(u64*)(port_control_register) & 0xfffffffffffff000);
-  auto fis_base_addr = (*(u64*)(port_control_register+8) & 0xfffffffffffff000);
-
-
-  Kernel::sp() << IntRadix::Hex << "  cmd_list_addr: " << (u64)command_list_addr << ", fis_bas_addr: " << fis_base_addr << "\n";
-  assert(command_list_addr < IDENTITY_MAP_PHY_END, "");
-  assert(fis_base_addr < IDENTITY_MAP_PHY_END, "");
-
-  auto buf = kernel_page_alloc(16);
-  auto buf_phy = ((u64)buf-KERNEL_START);
-  auto ok = read((HBA_PORT*)port_control_register, 1, 0, 1, buf_phy);
+  u64 buf_phy;
+  auto buf = bounce_pool.alloc(&buf_phy);
+  assert(buf != nullptr, "Out of memory for the AHCI buffer");
+  auto ok = read((HBA_PORT*)port_control_register, 1, 0, 1, buf) == 1;
 
   Kernel::sp() << "read ok = " << (int)ok << "\n";
 
   hexdump((const char*)buf, 512);
+  bounce_pool.free(buf);
 }
 
 bool AHCIDriver::Enumerate(PCIDeviceInfo *info) {
   auto config_space = info->config_space;
-  abar = &config_space->bars[5];
+  // BAR5 is ABAR, the HBA registers, as assigned by the firmware
+  abar = info->bars[5];
+  if (abar.start == 0 || abar.is_io) {
+    Kernel::sp() << "AHCI ABAR not assigned\n";
+    return false;
+  }
+  // pci enable memory space and bus mastering
+  config_space->command = config_space->command | (1<<1) | (1<<2);
   Init();
 
-  create_kthread("ahci", reinterpret_cast<void (*)(void *)>(AHCIDriver::KthreadEntry), this);
+  system_wq->queue_work(&list_partitions_work_);
   return true;
 }
 
 void AHCIDriver::Init() {
-  assert(abar != nullptr, "abar is null");
+  void *ahci_reg_page = ioremap(abar.start, abar.size);
 
-//  void *ahci_reg_page = kernel_page_alloc(16);
-//  u32 ahci_phy = (u64)ahci_reg_page - KERNEL_START;
-  // TODO: use allocate to allocate non-cachable memory range, currently hard code it
-  u32 ahci_phy = 0xcabcd000;
-  void *ahci_reg_page = (void*)(ahci_phy + KERNEL_START);
-
-  *abar = ahci_phy;
-
-  Kernel::sp() << "set ahci abar = " << IntRadix::Hex << ahci_phy << "\n";
+  Kernel::sp() << "ahci abar = " << IntRadix::Hex << abar.start << "\n";
 
   auto capabilities = (HBACapabilities*)((char*)ahci_reg_page + 0x00);
   Kernel::sp() << "  Capabilities: " << IntRadix::Hex << *(u32*)capabilities << "\n";
@@ -461,7 +501,8 @@ void AHCIDriver::Init() {
 
 }
 
-void AHCIDriver::KthreadEntry(AHCIDriver *that) {
+void AHCIDriver::ListPartitions(void *cookie) {
+  auto that = (AHCIDriver*)cookie;
   if (that->sata_devices.empty()) {
     Kernel::k->panic("No AHCI device found");
   }
@@ -474,10 +515,6 @@ void AHCIDriver::KthreadEntry(AHCIDriver *that) {
   for (auto &part : partitions) {
     Kernel::sp() << "  partition: 0x" << IntRadix::Hex << part.start_offset << ", size = 0x" << IntRadix::Hex << part.size << "\n";
   }
-
-  while (true) {
-    kyield();
-  }
 }
 
 template <typename T>
@@ -496,22 +533,35 @@ Error AHCIDevice::Read(void *output, unsigned long start, unsigned long size) {
   const auto sector_start_addr = align_left(start, SectorSize);
   const auto sector_end_addr = align_right(start + size, SectorSize);
 
-  const auto start_offset = start - sector_start_addr;
-  const auto end_offset = sector_end_addr - (start + size);
-
   const auto sector_start = sector_start_addr / SectorSize;
   const auto sector_end = sector_end_addr / SectorSize;
   const auto sector_count= sector_end - sector_start;
 
-  const u32 starth = (sector_start >> 32ul) & 0xffffffff;
-  const u32 startl = sector_start & 0xffffffff;
-
-
-  char *buf = (char*)kmalloc(size);
-  auto buf_phy = ((u64)buf-KERNEL_START);
+  // whole sectors are read into a bounce buffer, one buffer at a time
+  u64 buf_phy;
+  char *buf = (char*)bounce_pool.alloc(&buf_phy);
+  if (!buf) {
+    return Error::ErrFailure;
+  }
 
-  const auto ok = read((HBA_PORT*)port_control_reg, startl, starth, sector_count, buf_phy);
-  memcpy(output, buf + start_offset, size);
+  u64 done = 0;
+  while (done < sector_count) {
+    const auto sector = sector_start + done;
+    const u32 starth = (sector >> 32ul) & 0xffffffff;
+    const u32 startl = sector & 0xffffffff;
+    const auto n = read((HBA_PORT*)port_control_reg, startl, starth, min(sector_count - done, BounceSize / SectorSize), buf);
+    if (n == 0) {
+      break;
+    }
+    // the part of [start, start + size) in the sectors read
+    const auto chunk_start = sector * SectorSize;
+    const auto copy_start = max(chunk_start, start);
+    const auto copy_end = min(chunk_start + n * SectorSize, start + size);
+    memcpy((char*)output + (copy_start - start), buf + (copy_start - chunk_start), copy_end - copy_start);
+    done += n;
+  }
+  const bool ok = done == sector_count;
+  bounce_pool.free(buf);
 
   return ok ? Error::ErrSuccess : Error::ErrFailure;
 }
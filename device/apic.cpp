@@ -2,9 +2,11 @@
 #include <kernel.h>
 #include <irq.hpp>
 #include <lib/utils.h>
+#include <mm/ioremap.h>
 #include <mm/page_alloc.h>
 #include <lib/string.h>
-#include <process.h>
+#include <thread.h>
+#include <device/apic.h>
 
 constexpr u16 APIC_APICID	= 0x20;
 constexpr u16 APIC_APICVER	= 0x30;
@@ -33,14 +35,20 @@ constexpr u32 APIC_NMI	= (4<<8);
 constexpr u32 TMR_PERIODIC	= 0x20000;
 constexpr u32 TMR_BASEDIV	= (1<<20);
 
+// ICR low
+constexpr u32 APIC_ICR_FIXED	= 0x000;
+constexpr u32 APIC_ICR_INIT	= 0x500;
+constexpr u32 APIC_ICR_STARTUP	= 0x600;
+constexpr u32 APIC_ICR_PENDING	= (1<<12);
+constexpr u32 APIC_ICR_ASSERT	= (1<<14);
+
 void test_apic() ;
 class APIC {
  public:
   explicit APIC() {
     auto old = get_msr(APIC_BASE_MSR);
     auto apic_base_phy = old & 0xfffffffff000;
-    apic_base = apic_base_phy + KERNEL_START;
-    assert(apic_base < IDENTITY_MAP_END, "APIC base must be below IDENTITY_MAP_END");
+    apic_base = (u64)ioremap(apic_base_phy, PAGE_SIZE);
 
 //    auto addr = kernel_page_alloc(16);
 //    auto phy_addr = ((u64)addr - KERNEL_START);
@@ -50,11 +58,19 @@ class APIC {
 //    auto a = get_msr(APIC_BASE_MSR);
 //    Kernel::sp() << "a = " << a  << " " << phy_addr << "\n";
 
-    setup_timer();
+    init_local();
+    timer_ticks_ = calibrate_timer();
+    start_timer();
 //    test_apic();
   }
 
-  void setup_timer() {
+  // every cpu sees its own local APIC at the same address, so application processors share the boot cpu object
+  void init_ap() {
+    init_local();
+    start_timer();
+  }
+
+  void init_local() {
     auto id = read(APIC_APICID);
     Kernel::sp() << "Local APIC ID = " << id << " base = 0x" << IntRadix::Hex << apic_base << "\n";
 
@@ -75,6 +91,9 @@ class APIC {
     set_msr(APIC_BASE_MSR, get_msr(APIC_BASE_MSR) | (1<<11));
 
     write(APIC_SPURIOUS, IRQ_SPURIOUS + APIC_SW_ENABLE);
+  }
+
+  u32 calibrate_timer() {
     write(APIC_LVT_TMR, 32);
     write(APIC_TMRDIV, 3);
 
@@ -93,20 +112,37 @@ class APIC {
     write(APIC_LVT_TMR, read(APIC_LVT_TMR) & ~(1 << 16));
 
     // Now we know how often the APIC timer has ticked in 10ms
-    u32 ticks = 0xFFFFFFFF - read(APIC_TMRCURRCNT);
+    return 0xFFFFFFFF - read(APIC_TMRCURRCNT);
+  }
 
+  void start_timer() {
     // Start timer as periodic on IRQ 0, divider 16, with the number of ticks we counted
     write(APIC_LVT_TMR, IRQ_TIMER | TMR_PERIODIC);
     write(APIC_TMRDIV, 0x3);
-    write(APIC_TMRINITCNT, ticks);
+    write(APIC_TMRINITCNT, timer_ticks_);
+  }
+
+  u32 id() {
+    return read(APIC_APICID) >> 24;
+  }
+
+  void send_ipi(u32 apic_id, u32 icr) {
+    // an interrupt handler sending an IPI in between would overwrite ICRH
+    auto flags = irq_save();
+    while (read(APIC_ICRL) & APIC_ICR_PENDING) {
+      __builtin_ia32_pause();
+    }
+    write(APIC_ICRH, apic_id << 24);
+    write(APIC_ICRL, icr);
+    irq_restore(flags);
   }
 
 
   u32 read(u16 addr) {
-    return *(u32*)((u8*)apic_base+addr);
+    return *(volatile u32*)((u8*)apic_base+addr);
   }
   void write(u16 addr, u32 data) {
-    *(u32*)((u8*)apic_base+addr) = data;
+    *(volatile u32*)((u8*)apic_base+addr) = data;
   }
 
   void eoi() {
@@ -115,6 +151,8 @@ class APIC {
 
  private:
   u64 apic_base;
+  // initial count of the periodic timer
+  u32 timer_ticks_ = 0;
 };
 
 u8 _boot_apic_space[sizeof(APIC)];
@@ -136,6 +174,26 @@ void test_apic() {
   }
 }
 
+void lapic_init_ap() {
+  boot_apic->init_ap();
+}
+
 void lapic_eoi() {
   boot_apic->eoi();
+}
+
+u32 lapic_id() {
+  return boot_apic->id();
+}
+
+void lapic_send_ipi(u32 apic_id, u8 vector) {
+  boot_apic->send_ipi(apic_id, APIC_ICR_FIXED | APIC_ICR_ASSERT | vector);
+}
+
+void lapic_send_init(u32 apic_id) {
+  boot_apic->send_ipi(apic_id, APIC_ICR_INIT | APIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(u32 apic_id, u8 vector_page) {
+  boot_apic->send_ipi(apic_id, APIC_ICR_STARTUP | APIC_ICR_ASSERT | vector_page);
 }
\ No newline at end of file
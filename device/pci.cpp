@@ -3,6 +3,7 @@
 #include <kernel.h>
 #include <device/pci.h>
 #include <lib/string.h>
+#include <mm/ioremap.h>
 #include <mm/page_alloc.h>
 #include <irq.hpp>
 
@@ -42,16 +43,14 @@ void PCIBusDriver::Enumerate(ECMGroup *segment_groups, size_t n) {
   Kernel::sp() << "Enumerating PCI devices:\n";
   for (u64 i = 0; i < n; i++) {
     Kernel::sp() << IntRadix::Hex << "Segment group " << segment_groups[i].base << " " << segment_groups[i].segment_group << segment_groups[i].bus_start << " " << segment_groups[i].bus_end << "\n";
-    auto base = segment_groups[i].base;
-    if (base >= IDENTITY_MAP_START) {
-      Kernel::sp() << "Warning segment group start addr out of range " << IntRadix::Hex << base << "\n";
-      continue;
-    }
+    // ECAM: 1M of config space per bus, base is the address of bus 0
+    auto n_buses = segment_groups[i].bus_end - segment_groups[i].bus_start + 1;
+    auto ecam = (u64)ioremap(segment_groups[i].base + ((u64)segment_groups[i].bus_start << 20), (u64)n_buses << 20);
 
     for (u64 j = 0; j < segment_groups[i].bus_end - segment_groups[i].bus_start; j++) {
       auto bus = segment_groups[i].bus_start + j;
       for (int device = 0; device < 32; device++) {
-        auto cs0 = (ExtendedConfigSpace*)(KERNEL_START + (base | (j << 20) | (device << 15)));
+        auto cs0 = (ExtendedConfigSpace*)(ecam + ((j << 20) | (device << 15)));
         if (cs0->vendor == PCI_INVALID_VENDOR) {
           continue;
         }
@@ -63,7 +62,7 @@ void PCIBusDriver::Enumerate(ECMGroup *segment_groups, size_t n) {
             << " slot 0x" << device << "\n";
 
         for (int function = 0; function < 8; function++) {
-          volatile auto cs = (ExtendedConfigSpace*)(KERNEL_START + (base | (j << 20) | (device << 15 | function << 12)));
+          volatile auto cs = (ExtendedConfigSpace*)(ecam + ((j << 20) | (device << 15 | function << 12)));
           if (cs->vendor == PCI_INVALID_VENDOR) {
             continue;
           }
@@ -1,6 +1,8 @@
 #include <device/rtl8139.hpp>
 #include <cpu_utils.h>
 #include <kernel.h>
+#include <mm/ioremap.h>
+#include <mm/dma_pool.h>
 #include <mm/page_alloc.h>
 #include <cpu_defs.h>
 #include <lib/string.h>
@@ -11,8 +13,11 @@
 #include <common/hexdump.hpp>
 #include <net/arp.hpp>
 #include <common/endian.hpp>
-#include <process.h>
 #include <common/kssq.hpp>
+#include <async.h>
+#include <smp.h>
+#include <softirq.h>
+#include <array>
 
 constexpr u32 RxOk = 1 << 0;
 constexpr u32 RxError = 1 << 1;
@@ -23,6 +28,34 @@ constexpr u32 RxOverflow = 0x10;
 constexpr u32 RxFifoOverflow = 0x40;
 constexpr u32 RxAck = RxOk | RxOverflow | RxFifoOverflow;
 
+// cmd register
+constexpr u8 CmdRxBufferEmpty = 1 << 0;
+
+// status word in front of every received frame
+constexpr u16 RxStatusOk = 1 << 0;
+constexpr u16 RxStatusError = 0x3e; // frame alignment, crc, long, runt, invalid symbol
+
+// one of the 4 tx buffers, a frame is at most 1792 bytes
+constexpr u64 TxBufferSize = 4096;
+// a tx not acked by TxOk/TxError within ~1s is given up
+constexpr u64 TxTimeoutTicks = 100;
+
+// frames handled per run of the rx tasklet, the tasklet is scheduled again if there are more
+constexpr int RxBudget = 64;
+
+// CRC-32/ISO-HDLC (the ethernet FCS) lookup table, one entry per byte value
+static constexpr auto crc32_table = []() {
+  std::array<u32, 256> table{};
+  for (u32 i = 0; i < 256; i++) {
+    u32 crc = i;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
 
 #pragma pack(push, 1)
 struct Rtl8139Register {
@@ -72,15 +105,18 @@ class Rtl8139Device {
       config_space(pci_config_space),
       regs(reinterpret_cast<volatile Rtl8139Register*>(regs_base)),
       rx_buffer_size(1<<16),
-      tx_buffer_size(1<<16),
+      irq_tasklet_(IrqTasklet, this),
       tx_queue_(init_tx_queue()) {
 
-    rx_buffer = (volatile char*) kernel_page_alloc(16);
-    tx_buffer_raw = (char*) kernel_page_alloc(16);
-    tx_buffer_raw_phy = (u32)(u64)(tx_buffer_raw - KERNEL_START);
+    // the device only takes 32-bit buffer addresses
+    DmaBuffer rx_dma, tx_dma;
+    bool ok = dma_alloc(rx_buffer_size, DmaMask32, &rx_dma) && dma_alloc(4 * TxBufferSize, DmaMask32, &tx_dma);
+    assert(ok, "Out of memory for the RTL8139 buffers");
+    rx_buffer = (volatile char*)rx_dma.vaddr;
+    rx_buffer_phy = rx_dma.bus_addr;
     for (int i = 0; i < 4; i++) {
-      tx_buffer[i] = tx_buffer_raw + 4096*i;
-      tx_buffer_phy[i] = tx_buffer_raw_phy + 4096*i;
+      tx_buffer[i] = (char*)tx_dma.vaddr + TxBufferSize*i;
+      tx_buffer_phy[i] = tx_dma.bus_addr + TxBufferSize*i;
     }
 
     // pci enable bus mastering
@@ -120,13 +156,8 @@ class Rtl8139Device {
     arp_ = arp;
   }
 
-  static void KthreadEntry(void *cookie) {
-    ((Rtl8139Device*)cookie)->kthread_entry();
-  }
-
-  void kthread_entry();
-
-  void start_kthread();
+  // sends the packets of tx_queue_ one at a time, see spawn()
+  Task<> tx_loop();
 
   void reset() {
 
@@ -148,7 +179,6 @@ class Rtl8139Device {
     Kernel::sp() << "\n";
 
     // setup RX buffer
-    u32 rx_buffer_phy = (u32)(u64)(rx_buffer - KERNEL_START);
     regs->rx_buffer_start_addr = rx_buffer_phy;
 
     // config rx buffer
@@ -203,33 +233,26 @@ class Rtl8139Device {
     rx_offset %= (8192);
   }
 
-  void handle_rx() {
+  // returns false if the rx buffer is empty
+  bool handle_rx() {
+    if (regs->cmd & CmdRxBufferEmpty) {
+      return false;
+    }
     auto status = *(u32*)(rx_buffer + rx_offset);
     auto packet_size = (status >> 16);
     if (packet_size == 0) {
       Kernel::sp() << "RTL8139 rx 0\n";
-      return;
+      return false;
     }
 
-    // drop packet crc32 not matched
+    // the NIC has checked the crc32 already
     const char *data = (const char*)rx_buffer + rx_offset + 4;
-    auto calculated_crc32 = crc32iso_hdlc(0, data, packet_size-4);
-    auto stored_crc32 = *(u32*)&data[packet_size-4];
-    if (stored_crc32 != calculated_crc32) {
-      Kernel::sp() << "CRC32 not match, drop packet! 0x" << IntRadix::Hex << stored_crc32 << " != 0x" << calculated_crc32 << "\n";
+    if (!(status & RxStatusOk) || (status & RxStatusError)) {
+      Kernel::sp() << "RTL8139 drop bad packet, status 0x" << IntRadix::Hex << (status & 0xffff) << "\n";
       consume_rx(packet_size);
-      return;
+      return true;
     }
 
-    Kernel::sp() << "RTL8139 rx 0x" << rx_offset << " 0x" << packet_size << " capr 0x" << regs->current_address_of_packet_read << " cbr " << regs->current_buffer_address << "\n";
-//    hexdump(data, packet_size, false, 4);
-//    Kernel::sp() << "\n";
-
-    // skip dst, src and protocol
-    const u8 *upper_data = (u8*)data + 6 + 6 + 2;
-    size_t upper_size = packet_size - 6 - 6 - 2 - 4; // subtract checksum at the end
-    kvector<u8> upper_buffer(upper_size);
-    memcpy(upper_buffer.data(), upper_data, upper_size);
     EthernetAddress dst, src;
     memcpy(dst.data, data, sizeof(dst.data));
     memcpy(src.data, data+sizeof(src.data), sizeof(dst.data));
@@ -239,64 +262,81 @@ class Rtl8139Device {
     // drop non-unicast packet
     if (!dst.IsBroadcast() && dst != mac) {
       consume_rx(packet_size);
-      return;
+      return true;
     }
 
-    RxUpper(dst, src, protocol, std::move(upper_buffer));
+    // skip dst, src and protocol
+    const u8 *upper_data = (u8*)data + 6 + 6 + 2;
+    size_t upper_size = packet_size - 6 - 6 - 2 - 4; // subtract checksum at the end
+    kvector<u8> upper_buffer(upper_size);
+    memcpy(upper_buffer.data(), upper_data, upper_size);
+    // the slot in the ring is free once the payload is copied out
     consume_rx(packet_size);
-  }
 
-  void handle_tx() {
-    tx_buffer_index++;
-    tx_buffer_index %= 4;
-    tx_done_ = true;
-    Kernel::sp() << "RTL8139 tx ok\n";
+    RxUpper(dst, src, protocol, std::move(upper_buffer));
+    return true;
   }
 
+  // Hard interrupt: acknowledges the events and leaves the work to irq_tasklet_.
+  // Frames arriving after the acknowledgement raise a new interrupt.
   bool irq() {
-    if (regs->isr == 0) {
+    u16 isr = regs->isr;
+    if (isr == 0) {
       return false;
     }
-    // clear RX OK
-    if (regs->isr & RxOk) {
-      handle_rx();
-      regs->isr = RxOk;
+    // NOTE: clear isr, must use 1 to clear this
+    regs->isr = isr;
+    pending_isr_.fetch_or(isr);
+    irq_tasklet_.schedule();
+    return true;
+  }
+
+  static void IrqTasklet(void *cookie) {
+    ((Rtl8139Device*)cookie)->irq_bottom_half();
+  }
+
+  // runs the events collected by irq() with interrupts enabled
+  void irq_bottom_half() {
+    u16 isr = pending_isr_.exchange(0);
+    if (isr & (RxOk | RxOverflow)) {
+      if (isr & RxOverflow) {
+        Kernel::sp() << "RTL8139 rx buffer overflow\n";
+      }
+      int n = 0;
+      while (n < RxBudget && handle_rx()) {
+        n++;
+      }
+      // more frames than the budget, the rest waits for the other tasklets queued meanwhile
+      if (n == RxBudget) {
+        pending_isr_.fetch_or(RxOk);
+        irq_tasklet_.schedule();
+      }
     }
-    if (regs->isr & RxError) {
+    if (isr & RxError) {
       Kernel::sp() << "RTL8139 rx error\n";
-      regs->isr = RxError;
-    }
-    if (regs->isr & TxOk) {
-      handle_tx();
-      regs->isr = TxOk;
-    }
-    if (regs->isr & TxError) {
-      Kernel::sp() << "RTL8139 tx error\n";
-      regs->isr = TxError;
     }
-    if (regs->isr & RxOverflow) {
-      Kernel::sp() << "RTL8139 rx buffer overflow\n";
-      handle_rx();
-      regs->isr = RxOverflow;
+    // a failed tx ends the descriptor too, tx_loop moves on either way
+    if (isr & (TxOk | TxError)) {
+      if (isr & TxError) {
+        Kernel::sp() << "RTL8139 tx error\n";
+      }
+      tx_done_.signal();
     }
-    if (regs->isr & (1<<5)) {
+    if (isr & (1<<5)) {
       Kernel::sp() << "RTL8139 packet underrun/link change\n";
     }
-    if (regs->isr & RxFifoOverflow) {
+    if (isr & RxFifoOverflow) {
       Kernel::sp() << "RTL8139 rx fifo overflow\n";
     }
-    if (regs->isr & (1<<13)) {
+    if (isr & (1<<13)) {
       Kernel::sp() << "RTL8139 cable length changed\n";
     }
-    if (regs->isr & Timeout) {
+    if (isr & Timeout) {
       Kernel::sp() << "RTL8139 timeout\n";
     }
-    if (regs->isr & (1<<15)) {
+    if (isr & (1<<15)) {
       Kernel::sp() << "RTL8139 system error\n";
     }
-    // NOTE: clear isr, must use 1 to clear this
-    regs->isr = RxAck;
-    return true;
   }
 
 //  void SendPacket(EthernetAddress src, EthernetAddress dst, std::span<const u8> data) {
@@ -307,15 +347,13 @@ class Rtl8139Device {
 //
 //  }
 
-  unsigned long crc32iso_hdlc(unsigned long crc, void const *mem, size_t len) {
+  static u32 crc32iso_hdlc(u32 crc, void const *mem, size_t len) {
     auto data = (unsigned char const *) mem;
     if (data == NULL)
       return 0;
     crc ^= 0xffffffff;
     while (len--) {
-      crc ^= *data++;
-      for (unsigned k = 0; k < 8; k++)
-        crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+      crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
     }
     return crc ^ 0xffffffff;
   }
@@ -325,7 +363,11 @@ class Rtl8139Device {
   }
 
   bool TxEnqueue(KEthernetPacket* &packet) {
-    return tx_queue_.enq(packet);
+    auto success = tx_queue_.enq(packet);
+    if (success) {
+      tx_queued_.signal();
+    }
+    return success;
   }
 
   void SetIPDriver(IPDriver *ip) {
@@ -343,13 +385,20 @@ class Rtl8139Device {
   u64 rx_buffer_size;
   u32 rx_offset = 0;
 
-  char *tx_buffer_raw;
-  u32 tx_buffer_raw_phy;
+  u32 rx_buffer_phy;
+
   char *tx_buffer[4];
   u32 tx_buffer_phy[4];
-  u64 tx_buffer_size;
   int tx_buffer_index = 0;
-  std::atomic<bool> tx_done_ = false;
+  // signaled once per packet put on tx_queue_
+  AsyncEvent tx_queued_;
+  // signaled by the TxOk and TxError interrupts
+  AsyncEvent tx_done_;
+  // consumer side of tx_queue_
+  KEthernetPacket *tx_packet_ = create_packet();
+  // interrupt events not handled yet, see irq()
+  std::atomic<u16> pending_isr_ = 0;
+  Tasklet irq_tasklet_;
 
   volatile Rtl8139Register *regs;
   volatile ExtendedConfigSpace *config_space;
@@ -358,37 +407,32 @@ class Rtl8139Device {
   IPDriver *ipv4_;
   SSQueue<KEthernetPacket> tx_queue_;
 };
-void Rtl8139Device::start_kthread() {
-  create_kthread("rtl8139", Rtl8139Device::KthreadEntry, this);
-}
-
-void Rtl8139Device::kthread_entry() {
-  auto packet = create_packet();
-  size_t i = 0;
+Task<> Rtl8139Device::tx_loop() {
   while (true) {
-    auto success = tx_queue_.deq(packet);
-    if (!success) {
-      i++;
-      kyield();
+    co_await tx_queued_;
+    if (!tx_queue_.deq(tx_packet_)) {
       continue;
     }
-
-    while (!tx_ready()) {
-      kyield();
+    // the NIC still owns the buffer
+    for (u64 waited = 0; !tx_ready() && waited < TxTimeoutTicks; waited++) {
+      co_await async_sleep(1);
     }
 
-    size_t size = EthernetHeaderSize + packet->size;
-    bool queued = tx_async(packet->pkt_start, size);
-    if (!queued) {
-      Kernel::sp() << "rtl8139 drop tx packet, nic tx reentry\n";
+    // an ack of a tx that timed out earlier must not complete this one
+    tx_done_.reset();
+    size_t size = EthernetHeaderSize + tx_packet_->size;
+    if (!tx_async(tx_packet_->pkt_start, size)) {
+      Kernel::sp() << "rtl8139 drop tx packet, tx buffer " << tx_buffer_index << " stuck\n";
+      tx_buffer_index = (tx_buffer_index + 1) % 4;
       continue;
     }
 
     // wait for NIC to ack the tx via IRQ
-    // TODO: replace this busy wait
-    while (!tx_done_);
-
-    tx_done_ = false;
+    if (!(co_await tx_done_.wait_for(TxTimeoutTicks))) {
+      Kernel::sp() << "rtl8139 tx timeout on buffer " << tx_buffer_index << "\n";
+    }
+    // skip the descriptor after TxOk, TxError or a timeout alike
+    tx_buffer_index = (tx_buffer_index + 1) % 4;
   }
 }
 bool Rtl8139Device::tx_async(const void *buffer, unsigned long size) {
@@ -397,13 +441,10 @@ bool Rtl8139Device::tx_async(const void *buffer, unsigned long size) {
   }
 
   // max size 1792
-  auto tx_buffer_phy = (u64)buffer - KERNEL_START;
-  assert(tx_buffer_phy < (1ul<<32), "invalid tx buffer set, must be < 4G");
-
   // expand to 64-4 bytes if shorter
   memcpy(tx_buffer[tx_buffer_index], buffer, size);
   if (size < 64 - 4) {
-    memset(&tx_buffer[tx_buffer_index] + size, 0, 64-4-size);
+    memset(tx_buffer[tx_buffer_index] + size, 0, 64-4-size);
     size = 64 - 4;
   }
   u32 crc32 = crc32iso_hdlc(0, tx_buffer[tx_buffer_index], size);
@@ -474,22 +515,30 @@ void ioapic_init(SystemDescriptionTable* table) {
     auto entry_type = p[offset];
     auto len = p[offset+1];
 
-    // IO APIC
-    if (entry_type == 1) {
+    // processor local APIC, usable if enabled or online capable
+    if (entry_type == 0) {
+      auto apic_id = p[offset+3];
+      auto apic_flags = *(u32*)(p+offset+4);
+      if (apic_flags & 3) {
+        smp_add_cpu(apic_id);
+      }
+    }
+
+    // IO APIC, only the first one is used
+    if (entry_type == 1 && ioapic0_phy_addr == 0) {
       auto id = p[offset+2];
       auto phy_addr = *(u32*)(p+offset+4);
       auto global_system_interrupt_base = *(u32*)(p+offset+8);
       Kernel::sp() << "IO APIC 0x" << IntRadix::Hex << id << " 0x" << phy_addr << " 0x" << global_system_interrupt_base << "\n";
       ioapic0_phy_addr = phy_addr;
       ioapic0_gsb = global_system_interrupt_base;
-      break;
     }
     offset += len;
   }
 
   assert(ioapic0_phy_addr != 0, "No IO APIC available!");
 
-  auto ioapic0 = (void*)(KERNEL_START + ioapic0_phy_addr);
+  auto ioapic0 = ioremap(ioapic0_phy_addr, PAGE_SIZE);
   // IOAPICVER
   u32 v = read_ioapic_register(ioapic0, 0x1);
   auto max_redir_entry = ((v >> 16) & 0xff) + 1;
@@ -530,7 +579,7 @@ bool RTL8139Driver::Enumerate(PCIDeviceInfo *info) {
   }
 
   assert1(found);
-  volatile void *regs_base = phy2virt(b.start);
+  volatile void *regs_base = ioremap(b.start, b.size);
   dev = knew<Rtl8139Device>(info->config_space, regs_base);
   // TODO: unify management of this objects
   auto arp = knew<ArpDriver>(this);
@@ -543,26 +592,25 @@ bool RTL8139Driver::Enumerate(PCIDeviceInfo *info) {
   SetIPDriver(ip);
   dev->SetIPDriver(ip);
   dev->reset();
-
-  dev->start_kthread();
+  spawn(dev->tx_loop());
 
   return true;
 }
+// the PCI interrupt handler sends the EOI
 bool RTL8139Driver::HandleInterrupt(unsigned long irq_num) {
-  bool handled = dev->irq();
-  if (handled) {
-    lapic_eoi();
-  }
-  return handled;
+  return dev->irq();
 }
 
 bool RTL8139Driver::TxEnqueue(EthernetAddress dst, u16 protocol, u8 *payload, size_t size) {
+  auto flags = tx_lock_.lock_irqsave();
   tx_packet_->size = size;
   tx_packet_->dst = dst;
   tx_packet_->src = dev->mac;
   tx_packet_->protocol = cpu2be(protocol);
   memcpy(tx_packet_->data, payload, size);
-  return dev->TxEnqueue(tx_packet_);
+  auto success = dev->TxEnqueue(tx_packet_);
+  tx_lock_.unlock_irqrestore(flags);
+  return success;
 }
 EthernetAddress RTL8139Driver::address() const {
   return dev->mac;
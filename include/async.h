@@ -0,0 +1,297 @@
+#pragma once
+#include <common/defs.h>
+#include <lib/string.h>
+#include <wait.h>
+#include <coroutine>
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+// Coroutines for driver state machines. A coroutine waiting for an interrupt, a timer or a queue
+// costs its frame only, instead of a thread and a stack.
+//
+//   Task<> Driver::tx_loop() {
+//     while (true) {
+//       co_await queued_;
+//       ...
+//       co_await done_;
+//     }
+//   }
+//   spawn(driver->tx_loop());
+//
+// Coroutines only run on executor threads, one per cpu, and a suspended coroutine is resumed by the
+// executor it suspended on. The ready list and timers of an executor are protected by the lock of its
+// wait queue, the waiters of an AsyncEvent by the lock of the event, which is taken first.
+
+struct PerCpu;
+class Executor;
+
+// Coroutine frames come from dedicated slab caches with a per-cpu free list in front of them.
+void *async_frame_alloc(size_t size);
+void async_frame_free(void *p, size_t size);
+
+// a suspended coroutine on the ready list of its executor
+struct AsyncWaiter {
+  std::coroutine_handle<> handle;
+  Executor *executor = nullptr;
+  AsyncWaiter *next = nullptr;
+};
+
+// A deadline on the timer list of an executor, the executor thread calls expire() without locks
+// once timer_ticks reaches it.
+struct AsyncTimer {
+  u64 deadline = 0;
+  void (*expire)(AsyncTimer *) = nullptr;
+  AsyncTimer *prev = nullptr;
+  AsyncTimer *next = nullptr;
+  // on the timer list, not expired yet
+  bool pending = false;
+};
+
+class Executor {
+ public:
+  // the executor of the calling cpu, a coroutine runs on it
+  static Executor *current();
+
+  // makes w run on this executor
+  void ready(AsyncWaiter *w);
+  // timers are kept sorted by deadline
+  void add_timer(AsyncTimer *t);
+  // returns false if t expired already, expire() is then called or running
+  bool remove_timer(AsyncTimer *t);
+
+  void print() const;
+
+ private:
+  static void thread_main(void *cookie);
+  void run();
+  void ready_locked(AsyncWaiter *w);
+  void remove_timer_locked(AsyncTimer *t);
+  // takes the expired timers off the list, linked through AsyncTimer::next
+  AsyncTimer *take_expired_locked();
+
+  friend void executor_init(PerCpu *cpu);
+
+  u64 cpu_ = 0;
+  AsyncWaiter *ready_head_ = nullptr;
+  AsyncWaiter *ready_tail_ = nullptr;
+  AsyncTimer *timers_ = nullptr;
+  // the executor thread sleeps here until a coroutine is ready or the first timer expires
+  WaitQueue wq_;
+
+ public:
+  // statistics, timers is the number of pending timers
+  u64 spawned = 0;
+  u64 resumed = 0;
+  u64 timers = 0;
+};
+
+// Where a coroutine goes when it finishes: to the coroutine awaiting it, or away if it was spawned.
+struct AsyncFinalAwaiter {
+  bool await_ready() noexcept { return false; }
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+    auto &p = h.promise();
+    if (p.continuation) {
+      return p.continuation;
+    }
+    if (p.detached) {
+      h.destroy();
+    }
+    return std::noop_coroutine();
+  }
+  void await_resume() noexcept { }
+};
+
+struct AsyncPromiseBase {
+  // a task starts when it is awaited or spawned
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  AsyncFinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception();
+
+  static void *operator new(size_t size) noexcept {
+    return async_frame_alloc(size);
+  }
+  static void operator delete(void *p, size_t size) {
+    async_frame_free(p, size);
+  }
+
+  std::coroutine_handle<> continuation;
+  // spawned, the frame is freed when it finishes
+  bool detached = false;
+  // first resume of a spawned task
+  AsyncWaiter start;
+};
+
+// A lazily started coroutine returning T. co_await runs it on the current executor and returns its value,
+// the Task owns the frame unless it is spawned. Frame allocation failure gives an empty Task.
+template <typename T = void>
+class Task;
+
+template <typename T>
+struct AsyncPromise : AsyncPromiseBase {
+  Task<T> get_return_object() noexcept;
+  static Task<T> get_return_object_on_allocation_failure() noexcept;
+  void return_value(T value) {
+    result.emplace(std::move(value));
+  }
+  T take_result() {
+    return std::move(*result);
+  }
+
+  std::optional<T> result;
+};
+
+template <>
+struct AsyncPromise<void> : AsyncPromiseBase {
+  Task<void> get_return_object() noexcept;
+  static Task<void> get_return_object_on_allocation_failure() noexcept;
+  void return_void() { }
+  void take_result() { }
+};
+
+template <typename T>
+class Task {
+ public:
+  using promise_type = AsyncPromise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit Task(Handle h) :h_(h) { }
+  Task(Task &&rhs) noexcept :h_(std::exchange(rhs.h_, nullptr)) { }
+  Task(const Task &) = delete;
+  ~Task() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  bool valid() const {
+    return (bool)h_;
+  }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      Handle h;
+      bool await_ready() noexcept {
+        assert(h, "awaiting a task whose frame allocation failed");
+        return h.done();
+      }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h.promise().continuation = caller;
+        return h;
+      }
+      T await_resume() {
+        return h.promise().take_result();
+      }
+    };
+    return Awaiter{h_};
+  }
+
+  // gives up the frame, for spawn()
+  Handle release() {
+    return std::exchange(h_, nullptr);
+  }
+
+ private:
+  Handle h_;
+};
+
+template <typename T>
+Task<T> AsyncPromise<T>::get_return_object() noexcept {
+  return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+template <typename T>
+Task<T> AsyncPromise<T>::get_return_object_on_allocation_failure() noexcept {
+  return Task<T>(nullptr);
+}
+
+inline Task<void> AsyncPromise<void>::get_return_object() noexcept {
+  return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+inline Task<void> AsyncPromise<void>::get_return_object_on_allocation_failure() noexcept {
+  return Task<void>(nullptr);
+}
+
+// Runs task on the executor of the calling cpu, its frame is freed when it finishes.
+// Returns false if the frame could not be allocated.
+bool spawn(Task<void> task);
+
+// co_await async_sleep(ticks) resumes after ticks timer ticks
+struct AsyncSleep : AsyncWaiter, AsyncTimer {
+  explicit AsyncSleep(u64 ticks) :ticks(ticks) { }
+  bool await_ready() const noexcept { return ticks == 0; }
+  void await_suspend(std::coroutine_handle<> h);
+  void await_resume() const noexcept { }
+
+  u64 ticks;
+};
+
+static inline AsyncSleep async_sleep(u64 ticks) {
+  return AsyncSleep(ticks);
+}
+
+// co_await async_yield() lets the other ready coroutines of the executor run first
+struct AsyncYield : AsyncWaiter {
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  void await_resume() const noexcept { }
+};
+
+static inline AsyncYield async_yield() {
+  return {};
+}
+
+// An event for coroutines, the counterpart of Completion: every signal() lets one co_await return,
+// in FIFO order. signal() can be called from interrupt handlers, tasklets and threads, so it serves
+// for interrupt completions as well as for counting items put on a queue.
+class AsyncEvent {
+ public:
+  struct Awaiter : AsyncWaiter, AsyncTimer {
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    // false if the wait timed out
+    bool await_resume() const noexcept { return !timed_out; }
+
+    AsyncEvent *event;
+    u64 timeout_ticks = 0;
+    bool timed_out = false;
+    // on the waiter list of the event
+    bool waiting = false;
+    Awaiter *wait_prev = nullptr;
+    Awaiter *wait_next = nullptr;
+  };
+
+  void signal();
+  // drops the signals nobody has waited for yet
+  void reset();
+
+  // co_await event
+  Awaiter operator co_await() {
+    Awaiter a;
+    a.event = this;
+    return a;
+  }
+  // co_await event.wait_for(ticks), false on timeout
+  Awaiter wait_for(u64 timeout_ticks) {
+    Awaiter a;
+    a.event = this;
+    a.timeout_ticks = timeout_ticks;
+    return a;
+  }
+
+ private:
+  void remove(Awaiter *a);
+  static void expire(AsyncTimer *t);
+
+  kspinlock lock_;
+  u64 count_ = 0;
+  Awaiter *head_ = nullptr;
+  Awaiter *tail_ = nullptr;
+};
+
+// dedicated frame caches and the executor of the boot cpu
+void async_init();
+// creates the executor thread of cpu, it is pinned to the cpu
+void executor_init(PerCpu *cpu);
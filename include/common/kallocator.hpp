@@ -13,7 +13,7 @@ class kallocator {
   using difference_type = std::ptrdiff_t;
 
   pointer allocate(size_type n) {
-    return reinterpret_cast<pointer>(kmalloc(n));
+    return reinterpret_cast<pointer>(kmalloc(n * sizeof(T)));
   }
   void deallocate(T *p, std::size_t n) {
     kfree(p);
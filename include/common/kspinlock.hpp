@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <cpu_utils.h>
 
 class kspinlock {
  public:
@@ -9,7 +10,9 @@ class kspinlock {
   ~kspinlock() = default;
 
   void lock() {
-    while (lock_.test_and_set(std::memory_order_acquire));
+    while (lock_.test_and_set(std::memory_order_acquire)) {
+      __builtin_ia32_pause();
+    }
   }
   bool try_lock() {
     return !lock_.test_and_set(std::memory_order_acquire);
@@ -17,6 +20,17 @@ class kspinlock {
   void unlock() {
     lock_.clear(std::memory_order_release);
   }
+
+  // for locks also taken by interrupt handlers, returns the rflags for unlock_irqrestore()
+  u64 lock_irqsave() {
+    auto flags = irq_save();
+    lock();
+    return flags;
+  }
+  void unlock_irqrestore(u64 flags) {
+    unlock();
+    irq_restore(flags);
+  }
  private:
   std::atomic_flag lock_;
-};
\ No newline at end of file
+};
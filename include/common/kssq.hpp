@@ -17,6 +17,10 @@ class SSQueue {
   }
   explicit SSQueue(kvector<T*> vec) :rx_queue_(std::move(vec)) { }
 
+  bool empty() const {
+    return rx_start_ == rx_end_;
+  }
+
   bool deq(T* &packet) {
     if (rx_start_ == rx_end_) {
       // empty queue
@@ -75,7 +75,7 @@ class SmallVec { // NOLINT(cppcoreguidelines-pro-type-member-init)
   }
 
   T &operator[](size_t offset) {
-    return get_buf(size_);
+    return get_buf(offset);
   }
 
   const T &operator[](size_t offset) const {
@@ -6,22 +6,30 @@
 #define ALIGN(N) __attribute__ ((aligned (N)))
 #define PAGES_PER_TABLE 512UL
 
-// 4G
+// 4G, mapped by the boot loader
+// the kernel extends the direct map to cover all RAM in mm_init()
 #define KERNEL_SPACE_PAGES (4UL*512UL*512UL)
 
-// kmalloc region use 2M pages, max size 64G
-#define KMALLOC_START (0xffff008000000000ul)
+// vmalloc region for virtually contiguous allocations, 64G counted in 2M pages, one PML4 entry
+#define KMALLOC_START (0xffffa00000000000UL)
 #define KMALLOC_PAGES (64UL*512UL)
+#define KMALLOC_SIZE (KMALLOC_PAGES*(2UL*1024UL*1024UL))
 
 // 64MiB
 #define KERNEL_IMAGE_PAGES ((32UL*512UL))
 #define KERNEL_START (0xffff800000000000UL)
-#define IDENTITY_MAP_SIZE (KERNEL_SPACE_PAGES*PAGE_SIZE - KERNEL_IMAGE_PAGES*PAGE_SIZE)
+// end of the direct map, at least 4G
+extern u64 direct_map_phy_end;
 #define IDENTITY_MAP_PHY_START (KERNEL_IMAGE_PAGES*PAGE_SIZE)
-#define IDENTITY_MAP_PHY_END (KERNEL_IMAGE_PAGES*PAGE_SIZE+IDENTITY_MAP_SIZE)
+#define IDENTITY_MAP_PHY_END (direct_map_phy_end)
+#define IDENTITY_MAP_SIZE (IDENTITY_MAP_PHY_END - IDENTITY_MAP_PHY_START)
 #define IDENTITY_MAP_START (KERNEL_START+IDENTITY_MAP_PHY_START)
 #define IDENTITY_MAP_END (IDENTITY_MAP_START+IDENTITY_MAP_SIZE)
 
+// ioremap region for MMIO, one PML4 entry
+#define IOREMAP_START (0xffff900000000000UL)
+#define IOREMAP_SIZE (512UL*1024UL*1024UL*1024UL)
+
 //// 256 TiB ~ 512TiB
 //#define PAGE_ALLOC_START 0xffff100000000000UL
 //#define PAGE_ALLOC_END 0xffff200000000000UL
@@ -164,6 +172,24 @@ struct PageDirectoryEntry {
   u16 available : 11;
   u8 nx : 1;
 };
+// PDE mapping a 2M page or PDPE mapping a 1G page
+// base_addr is the physical address >> 12, its lowest bit is the PAT bit
+struct HugePageEntry {
+  u8 p : 1;
+  u8 rw : 1;
+  u8 us : 1;
+  u8 pwt : 1;
+  u8 pcd : 1;
+  u8 a : 1;
+  u8 d : 1;
+  u8 ps : 1; // must be 1
+
+  u8 g : 1;
+  u8 avl : 3;
+  u64 base_addr : 40;
+  u16 available : 11;
+  u8 nx : 1;
+};
 struct PageDirectoryPointerEntry {
   u8 p : 1;
   u8 rw : 1;
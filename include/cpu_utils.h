@@ -7,7 +7,9 @@
 // 0 -> kernel space
 // 1 -> user space
 // 2 -> per-cpu space
-#define PER_CPU __attribute__((section(".data.per_cpu")))
+// The section is the copy of the boot cpu, see per_cpu() in percpu.h.
+// It must not match .data.* in kernel.ld.
+#define PER_CPU __attribute__((section(".per_cpu")))
 
 
 void halt();
@@ -18,12 +20,50 @@ std::tuple<void*, u16> get_idt();
 void load_idt(std::tuple<void*, u16> idtr_input);
 
 #define APIC_BASE_MSR 0x1B
+#define EFER_MSR 0xC0000080
+#define EFER_SCE (1ul<<0u)
+#define EFER_LMA (1ul<<10u)
+#define EFER_NXE (1ul<<11u)
+#define STAR_MSR 0xC0000081
+#define LSTAR_MSR 0xC0000082
+#define FMASK_MSR 0xC0000084
+#define GS_BASE_MSR 0xC0000101
+#define KERNEL_GS_BASE_MSR 0xC0000102
+#define PAT_MSR 0x277
+#define MTRR_CAP_MSR 0xFE
+#define MTRR_DEF_TYPE_MSR 0x2FF
+#define MTRR_PHYS_BASE_MSR(n) (0x200 + 2 * (n))
+#define MTRR_PHYS_MASK_MSR(n) (0x201 + 2 * (n))
+
+#define CR0_WP (1ul<<16u)
+#define CR4_PCIDE (1ul<<17u)
+
+// CPUID 0x1 ECX
+#define CPUID_MONITOR (1u<<3u)
+#define CPUID_PCID (1u<<17u)
+
+// CPUID 0x80000001 EDX
+#define CPUID_EXT_NX (1u<<20u)
+#define CPUID_EXT_PAGE1GB (1u<<26u)
 
 u64 get_msr(u32 msr);
 void set_msr(u32 msr, u64 value);
 
 void flush_tlb();
 
+static void invlpg(u64 vaddr) {
+  asm volatile("invlpg (%0)" : :"r"(vaddr) :"memory");
+}
+
+static inline u64 rdtsc() {
+  u32 lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((u64)hi << 32) | lo;
+}
+
+// returns eax, ebx, ecx, edx
+std::tuple<u32, u32, u32, u32> cpuid(u32 leaf, u32 subleaf = 0);
+
 static void cli() {
   asm volatile ("cli");
 }
@@ -31,9 +71,33 @@ static void sti() {
   asm volatile ("sti");
 }
 
+// disables interrupts, returns the previous rflags for irq_restore()
+static inline u64 irq_save() {
+  u64 flags;
+  asm volatile("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline bool irqs_enabled() {
+  u64 flags;
+  asm volatile("pushf\n\tpop %0" : "=r"(flags));
+  return flags & (1u << 9);
+}
+
+static inline void irq_restore(u64 flags) {
+  if (flags & (1u << 9)) {
+    asm volatile("sti" : : : "memory");
+  }
+}
+
 u16 get_cs();
 
+u64 get_cr0();
+void set_cr0(u64 cr0);
 u64 get_cr2();
 u64 get_cr3();
+void set_cr3(u64 cr3);
+u64 get_cr4();
+void set_cr4(u64 cr4);
 u64 get_rbp();
 u64 get_pml4t_phy();
@@ -2,6 +2,7 @@
 #include <device/pci.h>
 #include <common/kstring.hpp>
 #include <common/error.hpp>
+#include <workqueue.h>
 
 constexpr u64 SectorSize = 512;
 
@@ -10,7 +11,7 @@ class AHCIDevice {
   explicit AHCIDevice(void *port_control_reg):port_control_reg(port_control_reg) {}
 
   // start, size are in bytes, they do not have to be aligned
-  // temp buffer are allocated and data is then copied to output
+  // whole sectors are read into a pooled DMA bounce buffer and then copied to output
   Error Read(void *output, u64 start, u64 size);
  private:
   void *port_control_reg;
@@ -24,10 +25,11 @@ class AHCIDriver : public PCIDeviceDriver {
   virtual bool Enumerate(PCIDeviceInfo *info) override;
   virtual bool HandleInterrupt(u64 irq_num) override { return false; }
 
-  static void KthreadEntry(AHCIDriver *that);
+  static void ListPartitions(void *cookie);
 
   void Init();
  private:
   kvector<AHCIDevice> sata_devices;
-  u32 *abar;
+  PCIBar abar;
+  Work list_partitions_work_{ListPartitions, this};
 };
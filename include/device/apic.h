@@ -0,0 +1,17 @@
+#pragma once
+#include <common/defs.h>
+
+// Local APIC of the boot cpu: timer calibration and the periodic IRQ_TIMER
+void lapic_init();
+// Local APIC of an application processor, reuses the timer calibration of the boot cpu
+void lapic_init_ap();
+void lapic_eoi();
+// APIC ID of the calling cpu
+u32 lapic_id();
+
+// fixed interrupt vector on the cpu apic_id
+void lapic_send_ipi(u32 apic_id, u8 vector);
+// INIT and STARTUP IPIs for bringing up application processors,
+// the cpu starts in real mode at vector_page * 4K
+void lapic_send_init(u32 apic_id);
+void lapic_send_startup(u32 apic_id, u8 vector_page);
@@ -1,6 +1,7 @@
 #pragma once
 #include <device/pci.h>
 #include <net/ethernet.hpp>
+#include <common/kspinlock.hpp>
 
 class IPDriver;
 class RTL8139Driver : public PCIDeviceDriver, public EthernetDriver {
@@ -19,6 +20,9 @@ class RTL8139Driver : public PCIDeviceDriver, public EthernetDriver {
     ip_driver_ = driver;
   }
  private:
+  // TxEnqueue() may run on several cpus, the staging packet and the single producer
+  // side of the device tx queue are used by one at a time
+  kspinlock tx_lock_;
   KEthernetPacket *tx_packet_;
   IPDriver *ip_driver_;
 };
@@ -11,13 +11,23 @@
 #define IRQ_TIMER 32
 #define IRQ_SPURIOUS 37
 #define IRQ_SYSCALL 42
+// inter-processor interrupts, see smp.h
+#define IRQ_IPI_RESCHEDULE 0xf0
+#define IRQ_IPI_TLB_SHOOTDOWN 0xf1
 
 #define INTERRUPT_STACK_SIZE (16UL * PAGE_SIZE)
 
+// page fault error code
+constexpr u64 PageFaultPresent = 1u << 0;
+constexpr u64 PageFaultWrite = 1u << 1;
+constexpr u64 PageFaultUser = 1u << 2;
+constexpr u64 PageFaultFetch = 1u << 4;
+
 constexpr size_t MaxHandlersPerInterrupt = 16;
 constexpr size_t MaxInterrupts = 256;
 
 extern "C" void return_from_syscall(struct Context*);
+// interrupt stack of the boot cpu, the others allocate theirs in smp_init()
 extern u8 interrupt_stack[];
 extern u8 *interrupt_stack_bottom;
 
@@ -25,7 +35,7 @@ struct IrqHandlerInfo {
   u64 irq_num;
   u64 error_code;
   Context *context;
-  u64 pid;
+  u64 tid;
 };
 
 using InterruptHandler = std::function<void (IrqHandlerInfo *info)>;
@@ -35,20 +45,23 @@ class Interrupt {
   SmallVec<InterruptHandler, MaxHandlersPerInterrupt> handlers_;
 };
 
-extern "C" void irq_handler(u64 irq_num, u64 error_code);
+// frame is the context pushed by _irq_handler
+extern "C" void irq_handler(u64 irq_num, u64 error_code, Context *frame);
 
 class InterruptProcessor {
  public:
   explicit InterruptProcessor(Kernel *kernel);
   void Register(size_t id, InterruptHandler handler);
   void Register(size_t start_id, size_t count, InterruptHandler handler);
+  // loads the IDT on the calling cpu, all cpus share the IDT and the handlers
+  void load();
 
  private:
-  void HandleInterrupt(u64 irq_num, u64 error_code);
+  void HandleInterrupt(u64 irq_num, u64 error_code, Context *frame);
 
   void setup_idt(u16 selector, void *default_handler);
 
-  friend void irq_handler(u64, u64);
+  friend void irq_handler(u64, u64, Context*);
  private:
   Kernel *k;
   Interrupt interrupts_[MaxInterrupts];
@@ -8,7 +8,8 @@
 #include <fs/mem_fs_node.hpp>
 #include <device/pci.h>
 
-constexpr size_t MaxValidStacks = 8;
+// the init stack and the interrupt stack of every cpu
+constexpr size_t MaxValidStacks = 72;
 
 class InterruptProcessor;
 class Syscall;
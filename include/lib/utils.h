@@ -1,25 +1,27 @@
 #pragma once
 
-// when n = 0, it returns (u64)-1
+// when n = 0, it returns 0
 static u64 log2(u64 n) {
-  u64 ret = 0;
-  do {
-    n >>= 1;
-    ret++;
-  } while (n > 0);
-  return ret - 1;
+  if (n == 0) {
+    return 0;
+  }
+  return 63 - __builtin_clzl(n);
 }
 
-// when n = 0, it returns (u64)-1
+// when n = 0, it returns 0
 static u64 log2_ceil(u64 n) {
-  u64 ones = 0;
-  u64 ret = 0;
-  do {
-    if ((n & 1) != 0) {
-      ones++;
-    }
-    n >>= 1;
-    ret++;
-  } while (n > 0);
-  return ones > 1 ? ret : ret - 1;
+  if (n <= 1) {
+    return 0;
+  }
+  return 64 - __builtin_clzl(n - 1);
+}
+
+template <typename T>
+static T min(T a, T b) {
+  return a < b ? a : b;
+}
+
+template <typename T>
+static T max(T a, T b) {
+  return a < b ? b : a;
 }
@@ -0,0 +1,51 @@
+#pragma once
+#include <common/defs.h>
+#include <common/kspinlock.hpp>
+
+// Memory for device DMA. Without an IOMMU the bus address of a buffer is its physical address,
+// and x86 keeps DMA cache coherent, so buffers are ordinary write-back memory.
+// dma_mask is the highest bus address the device can reach.
+constexpr u64 DmaMask32 = 0xffffffffUL;
+constexpr u64 DmaMask64 = ~0UL;
+
+struct DmaBuffer {
+  void *vaddr;
+  u64 bus_addr;
+  u64 size;
+};
+
+// A physically contiguous, page aligned and zeroed buffer below dma_mask, returns false on failure.
+// Masks narrower than 32 bits are not supported.
+bool dma_alloc(u64 size, u64 dma_mask, DmaBuffer *buf);
+void dma_free(const DmaBuffer &buf);
+
+// Recycled DMA blocks of one size and alignment, for descriptors, command tables and bounce buffers.
+// Blocks are carved from dma_alloc() chunks, freed blocks are kept for reuse and chunks are never returned.
+// alloc() and free() take the lock of the pool and work in interrupt handlers.
+class DmaPool {
+ public:
+  DmaPool(const char *name, u64 size, u64 align, u64 dma_mask);
+
+  // returns nullptr on failure, the block is not zeroed
+  void *alloc(u64 *bus_addr);
+  void free(void *vaddr);
+
+  void print_usage() const;
+
+ private:
+  bool grow_locked();
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  mutable kspinlock lock_;
+  const char *name_;
+  u64 block_size_;
+  u64 dma_mask_;
+  // a power of two, at least a page
+  u64 chunk_size_;
+  FreeBlock *free_ = nullptr;
+  u64 chunks_ = 0;
+  u64 allocated_ = 0;
+};
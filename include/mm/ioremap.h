@@ -0,0 +1,11 @@
+#pragma once
+#include <common/defs.h>
+#include <mm/page_table.h>
+
+// Maps the physical range [phy, phy+size) to the ioremap region of kernel space,
+// phy and size do not have to be page aligned.
+// MMIO registers should be mapped CacheUncached, framebuffers can use CacheWriteCombining.
+void *ioremap(u64 phy, u64 size, CacheMode mode = CacheUncached);
+
+// vaddr and size are the ones passed to and returned by ioremap()
+void iounmap(volatile void *vaddr, u64 size);
@@ -2,8 +2,9 @@
 
 #define KERNEL_CODE_SEGMENT_INDEX 2
 #define KERNEL_DATA_SEGMENT_INDEX 3
-#define USER_CODE_SEGMENT_INDEX 4
-#define USER_DATA_SEGMENT_INDEX 5
+// sysret loads user ss and cs from the two descriptors following the kernel data segment
+#define USER_DATA_SEGMENT_INDEX 4
+#define USER_CODE_SEGMENT_INDEX 5
 #define TSS_INDEX 6
 // TSS is 16 bytes, so 7 is always occupied
 
@@ -13,11 +14,20 @@
 #define USER_DATA_SELECTOR (USER_DATA_SEGMENT_INDEX*8 + 3)
 #define TSS_SELECTOR (TSS_INDEX*8)
 
+#ifndef __ASSEMBLER__
+struct SegmentDescriptor;
+struct TaskStateSegment;
+
+constexpr u64 GdtEntries = 128;
+
 void mm_init();
+// Loads gdt, a copy of the GDT of the boot cpu with its own TSS, on an application processor.
+// Interrupts from user mode run on rsp0.
+void load_cpu_gdt(SegmentDescriptor *gdt, TaskStateSegment *tss, u8 *rsp0);
 void map_user_addr(u64 vaddr, u64 paddr, u64 n_pages);
 
 u64 kernel2phy(u64 kernel_vaddr);
 bool is_kernel(u64 vaddr);
 
 void *phy2virt(u64 phy);
-
+#endif
@@ -9,18 +9,94 @@ struct PageRegion {
   u64 attr;
 };
 
+// builds the zones from all EfiConventionalMemory regions
 void page_allocator_init(SmallVec<PageRegion, 1024> &regions);
 
-// allocate 2^i contiguous physical pages that has mapped to kernel space
-// return 0 on failure
+// Physical memory zones
+// DMA32: below 4G, for devices with 32-bit DMA addresses
+// Normal: everything above 4G
+enum ZoneType {
+  ZoneDMA32 = 0,
+  ZoneNormal = 1,
+  ZoneCount,
+};
+
+// max number of EFI regions per zone
+constexpr size_t MaxZoneRegions = 128;
+
+// page allocation flags
+// the physical address of the pages must be below 4G
+constexpr u32 PageAllocDMA32 = 1u << 0;
+// the pages are zero-filled, single pages usually come zeroed already from the zeroed page pool
+constexpr u32 PageAllocZero = 1u << 1;
+// fail instead of draining the per-cpu magazines and the zeroed page pool, for callers with a fallback
+constexpr u32 PageAllocNoReclaim = 1u << 2;
+
+// allocate 2^i bytes of contiguous physical pages that has mapped to kernel space
+// return nullptr on failure
 // returns virtual address of the first page
-void *kernel_page_alloc(u64 i);
+void *kernel_page_alloc(u64 i, u32 flags = 0);
 
 // release the pages
 void kernel_page_free(void *);
 
-u64 physical_page_alloc(u64 i);
+// allocate 2^i bytes of contiguous physical pages, which may not be mapped to kernel space
+// return 0 on failure
+u64 physical_page_alloc(u64 i, u32 flags = 0);
 void physical_page_release(u64 paddr);
 
-constexpr u64 Log2MinSize = 16; // 64K
+// print buddy allocator and kmalloc size class usage
+void buddy_allocator_usage();
+
+// starts the thread filling the zeroed page pool, after thread_init()
+void page_zero_init();
+
+// Moves the PageMovable page at paddr to the allocated page new_paddr and remaps it, returns false
+// if the page is not movable anymore. Afterwards the page at paddr has no user, the caller frees it.
+// Implemented by the owner of movable pages, used by compaction.
+bool migrate_page(u64 paddr, u64 new_paddr);
+
+constexpr u64 Log2MinSize = 12; // 4K
 constexpr u64 Log2MaxSize = 32; // 4G
+constexpr u64 MaxPageOrder = Log2MaxSize - Log2MinSize;
+
+// Page::flags
+// first page of a free block, linked in the free list of its order
+constexpr u32 PageFree = 1u << 0;
+// first page of an allocated block
+constexpr u32 PageAllocated = 1u << 1;
+// the page belongs to a slab, Page::owner points to the slab
+constexpr u32 PageSlab = 1u << 2;
+// an allocated block cached in a per-cpu magazine, Page::owner points to its buddy allocator
+constexpr u32 PageMagazine = 1u << 3;
+// a zeroed page in the zeroed page pool, Page::owner points to its buddy allocator
+constexpr u32 PageZeroPool = 1u << 4;
+// a single page mapped by one user address space, compaction may move it.
+// Page::owner points to the Process and Page::index is the user address it is mapped at.
+constexpr u32 PageMovable = 1u << 5;
+
+// Metadata of every physical page managed by the page allocator.
+// Only the first page of a block has valid order and list links.
+struct Page {
+  Page *prev;
+  Page *next;
+  void *owner;
+  u32 flags;
+  u32 order;
+  // number of users of an allocated block, it is 1 after allocation
+  u32 refcount;
+  // reverse mapping of a PageMovable page
+  u64 index;
+};
+
+// returns nullptr if paddr is not managed by the page allocator
+Page *phy_to_page(u64 paddr);
+u64 page_to_phy(const Page *page);
+
+// Reference counting of allocated blocks, used for pages shared between address spaces.
+// put_page() releases the block when the last reference is dropped.
+// Pages outside the page allocator, e.g. the kernel image, are never freed and are ignored.
+void get_page(u64 paddr);
+void put_page(u64 paddr);
+// the page is allocated and has a single reference, its only user may write it in place
+bool page_exclusive(u64 paddr);
@@ -0,0 +1,88 @@
+#pragma once
+#include <common/defs.h>
+#include <cpu_defs.h>
+
+constexpr u64 PageSize2M = 1UL << 21;
+
+// Memory types of a mapping, the value is the PAT entry index selected by the PAT, PCD and PWT bits.
+// The PAT MSR is programmed by pat_init() to match.
+enum CacheMode {
+  CacheWriteBack = 0,
+  CacheWriteCombining = 1,
+  CacheUncached = 3,
+  CacheWriteThrough = 5,
+};
+
+// EFER.NXE is set, the nx bit can be used in page table entries
+extern bool nx_enabled;
+
+// CR4.PCIDE is set, TLB entries are tagged with the PCID in the low 12 bits of cr3
+extern bool pcid_enabled;
+
+// program the PAT MSR and dump the MTRRs
+void pat_init();
+// program the PAT MSR of the calling cpu
+void pat_cpu_init();
+// Returns true if the MTRRs give the size aligned range [start, start+size) a single memory type.
+// A large page over several memory types is undefined. Overlapping ranges count as different types.
+bool mtrr_range_uniform(u64 start, u64 size);
+
+// Returns the cr3 value switching to the address space pml4t_paddr identified by (asid, owner) on the calling cpu.
+// With PCIDs the TLB entries of the address space survive switches to other ones: the no-flush bit
+// is set unless the PCID was last used by another owner on this cpu, or the address space ran on
+// another cpu since (migrated), where its mappings may have changed without flushing this cpu.
+u64 address_space_cr3(u64 pml4t_paddr, u64 asid, const void *owner, bool migrated);
+// the PCID of (asid, owner) must not be reused without a flush on any cpu
+void address_space_release(u64 asid, const void *owner);
+
+// Software walk of 4-level page tables, all tables are accessed through the direct map.
+// Intermediate tables are allocated with kernel_page_alloc() when alloc is true,
+// user sets the us bit of the intermediate entries.
+
+// returns the PTE of vaddr, nullptr if a table on the way is missing and alloc is false
+PageTableEntry *page_table_walk(PageMappingL4Entry *pml4t, u64 vaddr, bool alloc, bool user);
+
+// returns the PDE of vaddr, for 2M mappings
+HugePageEntry *page_table_walk_pde(PageMappingL4Entry *pml4t, u64 vaddr, bool alloc, bool user);
+
+// returns the physical address vaddr maps to, 0 if it is not mapped
+u64 page_table_translate(const PageMappingL4Entry *pml4t, u64 vaddr);
+
+// PageTableEntry::avl bits
+// the page is shared copy-on-write, it is mapped read-only in a writable area
+constexpr u8 PteAvlCow = 1u << 0;
+// the page is being migrated, the entry is not present until migrate_page() is done
+constexpr u8 PteAvlMigrating = 1u << 1;
+
+// the kernel PML4, its upper half is shared by all processes
+PageMappingL4Entry *kernel_pml4t();
+
+// Copies the kernel half of the kernel PML4 into pml4t.
+// All kernel PML4 entries are populated at boot, so later kernel mappings are visible to every process.
+void copy_kernel_page_table(PageMappingL4Entry *pml4t);
+
+// frees the page tables of the user half of pml4t, but not the pages they map
+void free_user_page_tables(PageMappingL4Entry *pml4t);
+
+// map [vaddr, vaddr+size) -> [paddr, paddr+size) in kernel space, not executable,
+// 2M pages are used where vaddr, paddr and size allow it
+void kernel_map_pages(u64 vaddr, u64 paddr, u64 size, CacheMode mode);
+void kernel_unmap_pages(u64 vaddr, u64 size);
+// Like kernel_unmap_pages() without flushing other cpus, for callers holding a lock that
+// tlb_shootdown() must not be called under. Page tables left empty are unlinked and returned
+// chained through their first entry, free_page_tables() frees them once tlb_shootdown() is done.
+u64 kernel_clear_pages(u64 vaddr, u64 size);
+void free_page_tables(u64 tables);
+
+static inline void set_cache_mode(PageTableEntry &pte, CacheMode mode) {
+  pte.pwt = mode & 1;
+  pte.pcd = (mode >> 1) & 1;
+  pte.pat = (mode >> 2) & 1;
+}
+
+static inline void set_cache_mode(HugePageEntry &pde, CacheMode mode) {
+  pde.pwt = mode & 1;
+  pde.pcd = (mode >> 1) & 1;
+  // PAT is bit 12, the lowest bit of base_addr
+  pde.base_addr = (pde.base_addr & ~1ul) | ((mode >> 2) & 1);
+}
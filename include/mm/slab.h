@@ -0,0 +1,74 @@
+#pragma once
+#include <common/defs.h>
+#include <common/kspinlock.hpp>
+#include <cstddef>
+
+// kmalloc size classes: 8B, 16B, ..., 32K
+// Requests larger than the biggest class are served by the page allocator directly.
+constexpr u64 Log2MinSlabObjectSize = 3;
+constexpr u64 Log2MaxSlabObjectSize = 15;
+constexpr u64 SlabSizeClasses = Log2MaxSlabObjectSize - Log2MinSlabObjectSize + 1;
+
+struct Slab;
+
+struct SlabList {
+  Slab *head = nullptr;
+  size_t count = 0;
+};
+
+// A cache of equally sized objects, carved from page allocator blocks.
+// Each slab keeps an intrusive free list of its objects, slabs are kept on
+// either the partial or the full list of the cache. alloc() and free() take the lock of the cache.
+class KmemCache {
+ public:
+  KmemCache() = default;
+  KmemCache(const char *name, size_t object_size);
+
+  void *alloc();
+  void free(void *p);
+
+  void print_usage() const;
+
+  const char *name() const {
+    return name_;
+  }
+  size_t object_size() const {
+    return object_size_;
+  }
+
+  // returns the slab owning p, p must be allocated by a KmemCache
+  static Slab *slab_of(void *p);
+
+ private:
+  void *alloc_locked();
+  void free_locked(void *p);
+  Slab *create_slab();
+  void destroy_slab(Slab *slab);
+
+  kspinlock lock_;
+
+  const char *name_ = nullptr;
+  size_t object_size_ = 0;
+  // offset of the first object from the slab start
+  size_t first_object_offset_ = 0;
+  size_t objects_per_slab_ = 0;
+  u64 slab_log2size_ = 0;
+
+  SlabList partial_;
+  SlabList full_;
+  // at most one completely free slab is cached to avoid thrashing the page allocator
+  Slab *empty_ = nullptr;
+
+ public:
+  // statistics
+  size_t allocated_objects = 0;
+  size_t total_allocs = 0;
+  size_t total_frees = 0;
+  size_t slabs_created = 0;
+  size_t slabs_destroyed = 0;
+};
+
+void slab_init();
+
+// print per size class counters of kmalloc
+void slab_allocator_usage();
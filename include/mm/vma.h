@@ -0,0 +1,38 @@
+#pragma once
+#include <common/defs.h>
+
+// VirtualMemoryArea::flags
+constexpr u32 VmaRead = 1u << 0;
+constexpr u32 VmaWrite = 1u << 1;
+constexpr u32 VmaExec = 1u << 2;
+// the area is extended downwards when a fault hits below it, up to limit
+constexpr u32 VmaGrowsDown = 1u << 3;
+
+// max number of areas per process
+constexpr size_t MaxVmas = 32;
+
+// An immutable file in kernel memory whose pages can be mapped into user space directly,
+// data is page aligned and lives as long as the kernel.
+struct FileImage {
+  const char *name;
+  const u8 *data;
+  u64 size;
+};
+
+// A range of user virtual address space [start, end), pages are populated on first touch.
+// Pages below file_end are backed by file at file_offset + (vaddr - start), the rest is zero filled.
+struct VirtualMemoryArea {
+  u64 start;
+  u64 end;
+  u32 flags;
+  // lowest start of a VmaGrowsDown area
+  u64 limit;
+  const char *name;
+  const FileImage *file;
+  u64 file_offset;
+  u64 file_end;
+
+  bool contains(u64 vaddr) const {
+    return vaddr >= start && vaddr < end;
+  }
+};
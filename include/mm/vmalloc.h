@@ -0,0 +1,20 @@
+#pragma once
+#include <common/defs.h>
+
+// Virtually contiguous kernel memory in the vmalloc region, backed by pages that need not be
+// physically contiguous, so that large buffers keep working once physical memory is fragmented.
+// Each physical run is the largest buddy block available up to 2M, 2M runs are mapped with 2M pages.
+// Page tables of the region are allocated when a mapping first needs them and freed with the last one.
+// Devices doing DMA to a vmalloc buffer need scatter-gather, see vmalloc_to_phy().
+
+// runs after slab_init()
+void vmalloc_init();
+
+// returns nullptr on failure, size is rounded up to pages, memory is not zeroed
+void *vmalloc(u64 size);
+// addr is the one returned by vmalloc(), nullptr is ignored
+void vfree(void *addr);
+
+// Returns the physical address of the kernel address vaddr, and in *contiguous the number of bytes,
+// at most size, from vaddr on that are physically contiguous.
+u64 vmalloc_to_phy(const void *vaddr, u64 size, u64 *contiguous);
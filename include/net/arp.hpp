@@ -7,6 +7,8 @@
 #include <net/ipv4.hpp>
 #include <optional>
 #include <common/kssq.hpp>
+#include <async.h>
+#include <workqueue.h>
 
 constexpr u16 ArpOpcodeRequest = 1;
 constexpr u16 ArpOpcodeReply = 2;
@@ -36,9 +38,11 @@ struct ArpPacket {
 class ArpDriver {
  public:
   explicit ArpDriver(EthernetDriver *driver);
+  // starts the periodic gateway requests, they need the address of driver
   void SetIPDriver(IPDriver *driver) {
     ip_driver_ = driver;
     put(eth_driver_->address(), ip_driver_->address());
+    spawn(gateway_loop());
   }
   void HandleRx(EthernetAddress dst, EthernetAddress src, u16 protocol, kvector<u8> data);
 
@@ -55,17 +59,18 @@ class ArpDriver {
   std::optional<EthernetAddress> find(IPv4Address ip) const;
   void put(EthernetAddress eth, IPv4Address ip);
 
-  static void ArpThreadStart(void *cookie);
   void Request(IPv4Address ip);
  private:
-  void arp_thread_poll_rx(ArpPacket *&packet);
+  static void RxWork(void *cookie);
+  void handle_rx_queue();
+  // requests the gateway address periodically, retries until it replies
+  Task<> gateway_loop();
   void request_gateway_ethernet_address();
   void queue_up_mapping(ArpPacket *packet);
   void handle_request(ArpPacket *packet);
 
   EthernetDriver *eth_driver_;
-  IPDriver *ip_driver_;
-  u64 arp_kthread_id;
+  IPDriver *ip_driver_ = nullptr;
 
   // this lock locks the following members
   mutable kspinlock lock_;
@@ -75,4 +80,9 @@ class ArpDriver {
 
   ArpPacket *tmp_pkt = knew<ArpPacket>();
   SSQueue<ArpPacket> rx_queue_ = SSQueue<ArpPacket>(4);
+  // consumer side of rx_queue_, rx_work_ is its only user
+  ArpPacket *rx_pkt_ = knew<ArpPacket>();
+  Work rx_work_{RxWork, this};
+  // signaled by replies from the gateway
+  AsyncEvent gateway_reply_;
 };
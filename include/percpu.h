@@ -0,0 +1,107 @@
+#pragma once
+
+// Offsets of the PerCpu fields used by irq.S, the gs base of a cpu points to its PerCpu
+#define PERCPU_SELF 0
+#define PERCPU_USER_RSP 8
+#define PERCPU_CONTEXT_TOP 16
+#define PERCPU_KERNEL_STACK_TOP 24
+#define PERCPU_IRQ_DEPTH 32
+#define PERCPU_NEED_RESCHED 40
+#define PERCPU_PREV_ON_CPU 48
+
+#ifndef __ASSEMBLER__
+#include <common/defs.h>
+#include <cpu_defs.h>
+#include <run_queue.h>
+#include <softirq.h>
+
+constexpr u64 MaxCpus = 64;
+
+class Thread;
+
+struct PerCpu;
+
+// The PerCpu fields irq.S reaches at fixed offsets. They are kept in a standard layout base
+// of PerCpu, so that their offsets can be checked, and a single base class sits at offset 0.
+struct PerCpuHead {
+  PerCpu *self;
+  // user rsp while _syscall_entry switches stacks
+  u64 syscall_user_rsp;
+  // end of the context of the current thread, the syscall entry saves registers below it
+  u8 *context_top;
+  // top of the kernel stack of the current thread, syscalls run on it
+  u8 *kernel_stack_top;
+  // number of nested _irq_handler, it is 1 when handling an interrupt from a thread
+  u64 irq_depth;
+  // the current thread should give up the cpu when returning from the interrupt or syscall,
+  // set by the timer when its time slice is used up, by wakeups and by yield
+  volatile bool need_resched;
+  // Thread::on_cpu of the thread switched out by schedule(), cleared by return_from_syscall
+  // once the kernel no longer runs on the stack of that thread
+  volatile bool *prev_on_cpu;
+};
+
+static_assert(__builtin_offsetof(PerCpuHead, self) == PERCPU_SELF);
+static_assert(__builtin_offsetof(PerCpuHead, syscall_user_rsp) == PERCPU_USER_RSP);
+static_assert(__builtin_offsetof(PerCpuHead, context_top) == PERCPU_CONTEXT_TOP);
+static_assert(__builtin_offsetof(PerCpuHead, kernel_stack_top) == PERCPU_KERNEL_STACK_TOP);
+static_assert(__builtin_offsetof(PerCpuHead, irq_depth) == PERCPU_IRQ_DEPTH);
+static_assert(__builtin_offsetof(PerCpuHead, need_resched) == PERCPU_NEED_RESCHED);
+static_assert(__builtin_offsetof(PerCpuHead, prev_on_cpu) == PERCPU_PREV_ON_CPU);
+
+// State of a cpu, reached through gs in the kernel.
+// User code runs with a zero gs base, the kernel one is swapped in by swapgs on every entry from user mode.
+struct PerCpu : PerCpuHead {
+  u64 id;
+  u32 apic_id;
+  volatile bool online;
+  // offset of the copy of the .data.per_cpu section of this cpu, see per_cpu()
+  u64 per_cpu_offset;
+
+  Thread *current;
+  // runs when nothing else is runnable, it is never on a run queue
+  Thread *idle;
+  // tsc when the current thread was switched in
+  u64 switch_in_tsc;
+  RunQueue run_queue;
+  // tasklets scheduled by interrupt handlers on this cpu
+  SoftirqQueue softirq;
+
+  SegmentDescriptor *gdt;
+  TaskStateSegment *tss;
+  // rsp0 of the tss, interrupts from user mode run on it
+  u8 *interrupt_stack_top;
+};
+
+// cpus[0] is the boot cpu, the others are filled by smp_init() in MADT order
+extern PerCpu *cpus[MaxCpus];
+// number of cpus in cpus[], the ones that failed to start are not PerCpu::online
+extern u64 n_cpus;
+
+static inline PerCpu *this_cpu() {
+  PerCpu *cpu;
+  asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+// Variables declared PER_CPU have one copy per cpu, the boot cpu uses the section itself
+// and every other cpu a copy made when it is brought up.
+template <typename T>
+static inline T &per_cpu(T &var, const PerCpu *cpu) {
+  return *(T*)((u8*)&var + cpu->per_cpu_offset);
+}
+
+template <typename T>
+static inline T &per_cpu(T &var) {
+  return per_cpu(var, this_cpu());
+}
+
+// sets up the PerCpu of the boot cpu and points gs to it
+void percpu_init();
+
+// allocates the PerCpu and the copy of the .data.per_cpu section of an application processor
+PerCpu *percpu_alloc(u64 id, u32 apic_id);
+
+// points the gs base of the calling cpu to cpu
+void percpu_load(PerCpu *cpu);
+#endif
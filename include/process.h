@@ -1,56 +1,14 @@
 #pragma once
 #include "common/defs.h"
 #include <common/kstring.hpp>
-
-#pragma pack(push, 1)
-// If you update this struct, you should update _irq_handler and _return_from_syscall in irq.S
-struct Context {
-  u64 ds;
-  u64 es;
-  u64 fs;
-  u64 gs;
-
-  u64 cr3;
-
-  u64 r15;
-  u64 r14;
-  u64 r13;
-  u64 r12;
-  u64 r11;
-  u64 r10;
-  u64 r9;
-  u64 r8;
-  u64 rbp;
-  u64 rsi;
-  u64 rdi;
-  u64 rbx;
-  u64 rdx;
-  u64 rcx;
-  u64 rax;
-
-  u64 reserved1[2];
-  u64 rip;
-  u64 cs;
-  u64 rflags;
-  u64 rsp;
-  u64 ss;
-};
-#pragma pack(pop)
+#include <common/small_vec.hpp>
+#include <mm/vma.h>
+#include <thread.h>
 
 void process_init();
 
-extern "C" {
-
-void schedule();
-void store_current_thread_context(Context *context);
-Context *current_context();
-extern u64 current_pid;
-
-}
-
-constexpr u64 MAX_PROCESS = 1024;
-constexpr u64 THREAD_KERNEL_STACK_SIZE = 16*PAGE_SIZE;
-constexpr u64 PROCESS_MAX_USER_PAGES = 512*512;
+// lower half of the canonical address space
+constexpr u64 USER_SPACE_END = 0x0000800000000000UL;
 
 constexpr u64 USER_STACK_SIZE = 1024*1024;
 constexpr u64 USER_IMAGE_START = 1UL*1024UL*1024UL;
@@ -60,87 +18,73 @@ constexpr u64 USER_BRK_START = 16UL * 1024*1024;
 constexpr u64 USER_BRK_SIZE = 16UL * 1024*1024;
 
 
-enum ProcessState {
-  Wait,
-  Running
-};
-
-u64 get_kernel_pdpt_phy_addr();
-
-#pragma pack(push, 1)
-struct PageTabletSructures {
-  // page table for the process
-  PageMappingL4Entry pml4t[PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
-  PageDirectoryPointerEntry pdpt[PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
-  PageDirectoryEntry pdt[PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
-  PageTableEntry pt[PROCESS_MAX_USER_PAGES] ALIGN(PAGE_SIZE);
-};
-#pragma pack(pop)
-
-class Process;
-extern Process *processes[];
-class Process {
+// A thread with a user address space
+class Process : public Thread {
  public:
 
-  explicit Process(u64 id, u64 start_phy);
+  Process(u64 id, const kstring &name);
+  ~Process();
 
   void print() {
-    Kernel::sp() << SerialPort::IntRadix::Hex << "user image " << user_image_phy_addr << " stack 0x" << user_stack_phy_addr << "\n";
+    Thread::print();
+    Kernel::sp() << "  resident pages " << SerialPort::IntRadix::Dec << resident_pages << "\n";
+    for (auto &vma : vmas) {
+      Kernel::sp() << SerialPort::IntRadix::Hex << "  0x" << vma.start << " - 0x" << vma.end << " " << vma.name
+                   << (vma.file ? " " : "") << (vma.file ? vma.file->name : "") << "\n";
+    }
   }
 
   void map_user_addr(u64 vaddr, u64 paddr, u64 n_pages);
 
-  void *load_elf_from_buffer(char *buffer, u64 size);
+  VirtualMemoryArea *add_vma(u64 start, u64 end, u32 flags, const char *name);
+  // returns the area containing vaddr, grows a VmaGrowsDown area if vaddr is right below it
+  VirtualMemoryArea *find_vma(u64 vaddr);
+  // resolves a page fault at vaddr, returns false if it is an invalid access
+  bool handle_page_fault(u64 vaddr, u64 error_code);
+  // Makes this address space a copy-on-write duplicate of parent's.
+  // Resident pages are shared with a reference count and mapped read-only in both page tables.
+  void copy_address_space(Process *parent);
 
-  static void process_entrypoint(Process *p) {
-    p->kernel_entrypoint();
-  }
-
-  u64 phy_addr_in_this(void *ptr) {
-    return start_phy + ((u64)ptr - (u64)this);
-  }
+  // sets up areas mapping the PT_LOAD segments of file, returns the entrypoint
+  void *load_elf(const FileImage *file);
 
+  // the process of the current thread, nullptr in a kernel thread
   static Process *current() {
-    return processes[current_pid];
+    return Thread::current()->process;
   }
 
-  void kernel_entrypoint();
-
-  // id = 0 for empty process slot
-  u64 id;
-  ProcessState state = ProcessState::Wait;
-  kstring name;
-  // phy addr of the start of this Process object
-  u64 start_phy = 0;
-  int jiffies = 0;
-  int max_jiffies = 10;
+ private:
+  bool handle_page_fault_locked(u64 vaddr, u64 error_code);
+  // gives this process a private copy of the copy-on-write page at vaddr
+  bool break_cow(u64 vaddr, PageTableEntry *pte);
 
-  PageTabletSructures *pts;
-  u64 pts_paddr;
+ public:
 
-  u8 kernel_stack[THREAD_KERNEL_STACK_SIZE];
-  u8 kernel_stack_bottom[0];
+  // user half of the page table is allocated on demand by map_user_addr(),
+  // the kernel half is shared with the kernel page table
+  PageMappingL4Entry *pml4t;
+  u64 pml4t_paddr;
 
-  Context context;
+  SmallVec<VirtualMemoryArea, MaxVmas> vmas;
+  // user pages mapped in this address space, including pages shared copy-on-write
+  u64 resident_pages = 0;
+  // shared pages copied by write faults
+  u64 cow_copies = 0;
 
-  u64 user_image_phy_addr;
   u8 *user_image;
   u64 user_image_size = USER_IMAGE_SIZE;
 
-  u64 user_stack_phy_addr;
+  // [user_stack, user_stack + user_stack_size) is the max extent of the stack
   u8 *user_stack;
   u64 user_stack_size = USER_STACK_SIZE;
 
+  // the heap area grows from brk_start, up to brk_end
+  VirtualMemoryArea *heap;
   u64 brk_start;
   u64 brk_end;
 
-  void *cookie;
-
-  void (*tmp_start)(void*) = 0;
-
   kup<Syscall> syscall_;
 };
 
-u64 create_kthread(const kstring &name, void (*start)(void *), void *cookie);
-
-void kyield();
\ No newline at end of file
+// creates a process with an empty address space, it runs in the kernel until it loads a program
+Process *create_process(const kstring &name);
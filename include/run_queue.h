@@ -0,0 +1,48 @@
+#pragma once
+#include <common/defs.h>
+#include <common/kspinlock.hpp>
+#include <cstddef>
+
+class Thread;
+
+// priority levels of runnable threads, 0 is the highest
+constexpr u32 SchedPriorities = 32;
+constexpr u32 DefaultPriority = SchedPriorities / 2;
+
+// Runnable threads, one FIFO per priority linked through Thread::rq_prev/rq_next.
+// A bitmap of non-empty levels makes every operation O(1).
+// Every cpu has its own run queue, see PerCpu, all operations need lock with interrupts disabled.
+class RunQueue {
+ public:
+  // appends p to the tail of its priority level
+  void enqueue(Thread *p);
+  void dequeue(Thread *p);
+  // removes and returns the first thread of the highest non-empty level, nullptr if empty
+  Thread *pick_next();
+  // Like pick_next() for another cpu taking work from this queue, threads still running
+  // on a cpu (Thread::on_cpu) and pinned threads are skipped. Not O(1), only called by idle cpus.
+  Thread *steal();
+
+  bool empty() const {
+    return bitmap_ == 0;
+  }
+  // the highest non-empty priority, SchedPriorities if empty
+  u32 highest_priority() const {
+    return empty() ? SchedPriorities : __builtin_ctz(bitmap_);
+  }
+  size_t size() const {
+    return size_;
+  }
+
+  kspinlock lock;
+
+ private:
+  struct Level {
+    Thread *head = nullptr;
+    Thread *tail = nullptr;
+  };
+
+  Level levels_[SchedPriorities];
+  u32 bitmap_ = 0;
+  size_t size_ = 0;
+};
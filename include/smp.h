@@ -0,0 +1,19 @@
+#pragma once
+#include <common/defs.h>
+
+// records a local APIC found in the MADT, the boot cpu is skipped
+void smp_add_cpu(u32 apic_id);
+
+// Starts the application processors recorded by smp_add_cpu() with INIT-SIPI-SIPI.
+// Each one runs its idle thread and takes work from the run queues of the other cpus.
+// Called on the boot cpu with interrupts disabled, after lapic_init() and efi_table_init().
+void smp_init();
+
+// Flushes the TLB of the other online cpus and waits until they are done.
+// The calling cpu has to flush its own TLB.
+void tlb_shootdown();
+
+// tlb_shootdown() that also moves every cpu running on the page table at pml4t_paddr, the calling
+// one included, to the kernel page table. Kernel threads keep the page table of the previous
+// thread, a process calls it before its page table is freed.
+void tlb_shootdown_leave(u64 pml4t_paddr);
@@ -0,0 +1,57 @@
+#pragma once
+#include <common/defs.h>
+#include <run_queue.h>
+#include <wait.h>
+#include <atomic>
+
+struct PerCpu;
+class Thread;
+
+// softirq threads run ahead of ordinary threads
+constexpr u32 SoftirqPriority = DefaultPriority - 1;
+
+// Deferred interrupt work (bottom half). An interrupt handler only acknowledges its device and schedules
+// a tasklet, which runs later with interrupts enabled in the softirq thread of the cpu that scheduled it.
+// Scheduling a tasklet that is already queued does nothing, scheduling one that is running makes it run
+// once more afterwards. A tasklet never runs on two cpus at the same time.
+class Tasklet {
+ public:
+  Tasklet(void (*func)(void *), void *data) :func_(func), data_(data) { }
+
+  // callable from interrupt handlers
+  void schedule();
+
+ private:
+  static constexpr u32 Scheduled = 1;
+  static constexpr u32 Running = 2;
+
+  friend class SoftirqQueue;
+
+  void (*func_)(void *);
+  void *data_;
+  std::atomic<u32> state_ = 0;
+  Tasklet *next_ = nullptr;
+};
+
+// Tasklets scheduled on a cpu, see PerCpu::softirq. The queue is only touched by its cpu with interrupts
+// disabled, its softirq thread is pinned to the cpu.
+class SoftirqQueue {
+ public:
+  void enqueue(Tasklet *t);
+  // runs the tasklets queued so far, the ones scheduled meanwhile are left for the next call
+  void run();
+
+  bool empty() const {
+    return head_ == nullptr;
+  }
+
+  // the softirq thread sleeps here while the queue is empty
+  WaitQueue wq;
+
+ private:
+  Tasklet *head_ = nullptr;
+  Tasklet *tail_ = nullptr;
+};
+
+// creates the softirq thread of cpu, it starts running once the cpu schedules
+void softirq_init(PerCpu *cpu);
@@ -14,6 +14,8 @@ class Syscall {
   Syscall(Kernel *k, Process *p) :kernel_(k), process_(p) { }
 
   static void SetupSyscall(Kernel *kernel);
+  // SYSCALL MSRs of the calling cpu, SetupSyscall() does it for the boot cpu
+  static void InitCpu();
 
  public:
   int sys_read();
@@ -23,6 +25,7 @@ class Syscall {
   int sys_exit();
   int sys_yield();
   int sys_anon_allocate();
+  int sys_fork();
  private:
   Kernel *kernel_;
   Process *process_;
@@ -0,0 +1,170 @@
+#pragma once
+#include <common/defs.h>
+#include <cpu_defs.h>
+#include <common/kstring.hpp>
+#include <percpu.h>
+#include <run_queue.h>
+#include <wait.h>
+
+#pragma pack(push, 1)
+// If you update this struct, you should update _irq_handler and _return_from_syscall in irq.S
+struct Context {
+  u64 ds;
+  u64 es;
+  u64 fs;
+  u64 gs;
+
+  u64 cr3;
+
+  u64 r15;
+  u64 r14;
+  u64 r13;
+  u64 r12;
+  u64 r11;
+  u64 r10;
+  u64 r9;
+  u64 r8;
+  u64 rbp;
+  u64 rsi;
+  u64 rdi;
+  u64 rbx;
+  u64 rdx;
+  u64 rcx;
+  u64 rax;
+
+  u64 reserved1[2];
+  u64 rip;
+  u64 cs;
+  u64 rflags;
+  u64 rsp;
+  u64 ss;
+};
+#pragma pack(pop)
+
+// timer interrupt and idle thread of the boot cpu, before process_init()
+void thread_init();
+
+extern "C" {
+
+// picks the next thread to run on this cpu and clears PerCpu::need_resched
+void schedule();
+void store_current_thread_context(Context *context);
+Context *current_context();
+
+}
+
+constexpr u64 MAX_THREADS = 1024;
+// kernel stack of threads running user code, syscalls and page faults run on it
+constexpr u64 THREAD_KERNEL_STACK_SIZE = 16*PAGE_SIZE;
+// kernel threads only run driver loops and deferred work
+constexpr u64 KTHREAD_STACK_SIZE = 4*PAGE_SIZE;
+
+enum ThreadState {
+  // runnable, on the run queue of Thread::cpu
+  Wait,
+  Running,
+  // sleeping on a WaitQueue
+  Blocked,
+  Exited,
+};
+
+class Process;
+class Thread;
+extern Thread *threads[];
+
+// A schedulable flow of execution with its own kernel stack.
+// A kernel thread has no address space: it keeps the page table of whatever ran before it,
+// whose kernel half is the same in all address spaces, so switching to it does not touch cr3.
+class Thread {
+ public:
+  // process is the owner of the address space, nullptr for a kernel thread
+  Thread(u64 id, const kstring &name, Process *process, u64 kernel_stack_size);
+  ~Thread();
+
+  static Thread *current() {
+    return this_cpu()->current;
+  }
+
+  u8 *kernel_stack_top() const {
+    return kernel_stack + kernel_stack_size;
+  }
+
+  void print() const;
+
+  // id = 0 for empty thread slot
+  u64 id;
+  ThreadState state = ThreadState::Wait;
+  kstring name;
+  Process *process;
+
+  u8 *kernel_stack;
+  u64 kernel_stack_size;
+
+  Context context;
+
+  // kernel entry point, called with cookie
+  void (*tmp_start)(void*) = nullptr;
+  void *cookie = nullptr;
+
+  // timer ticks of the current time slice, the thread is preempted after max_jiffies
+  // if another thread of the same or a higher priority is runnable
+  int jiffies = 0;
+  int max_jiffies = 10;
+
+  // run queue, see run_queue.h
+  // cpu whose run queue the thread is put on, changed when another cpu steals it
+  u64 cpu = 0;
+  // cpu the thread last ran on
+  u64 last_cpu = 0;
+  // a cpu runs on the kernel stack of the thread, it may be on a run queue already but must not
+  // be run elsewhere, see PerCpu::prev_on_cpu
+  volatile bool on_cpu = false;
+  // never stolen by another cpu, for per-cpu threads like the softirq thread
+  bool pinned = false;
+  u32 priority = DefaultPriority;
+  bool on_run_queue = false;
+  Thread *rq_prev = nullptr;
+  Thread *rq_next = nullptr;
+
+  // wait queue, see wait.h
+  WaitQueue *wait_queue = nullptr;
+  Thread *wait_prev = nullptr;
+  Thread *wait_next = nullptr;
+  // timer tick ending a timed wait, 0 if the wait is not timed
+  u64 wait_deadline = 0;
+  Thread *sleep_prev = nullptr;
+  Thread *sleep_next = nullptr;
+
+  // cpu time accounting: timer ticks and tsc cycles spent running, times switched out
+  u64 cpu_ticks = 0;
+  u64 cpu_cycles = 0;
+  u64 switches = 0;
+
+ private:
+  static void entrypoint(Thread *t);
+};
+
+// returns a fresh thread id
+u64 alloc_thread_id();
+// registers t in threads[] and puts it on the run queue of the calling cpu
+void start_thread(Thread *t);
+// start_thread() on the run queue of cpu
+void start_thread_on(Thread *t, PerCpu *cpu);
+// makes t the current thread without schedule(), for the first thread a cpu returns to
+void set_first_thread(Thread *t);
+
+// creates a kernel thread running start(cookie), returns its id
+u64 create_kthread(const kstring &name, void (*start)(void *), void *cookie);
+
+// Makes a blocked thread runnable on its cpu, and requests a reschedule there if it is not of lower priority
+// than the thread running on it. Remote cpus are notified with IRQ_IPI_RESCHEDULE.
+void wake_up_thread(Thread *t);
+
+// Creates the thread running on cpu when nothing else is runnable, its cpu time is the idle time of the cpu.
+// It is registered in threads[] but never put on a run queue.
+Thread *create_idle_thread(PerCpu *cpu);
+
+// ends the current kernel thread, its slot is never reused
+[[noreturn]] void kthread_exit();
+
+void kyield();
@@ -0,0 +1,109 @@
+#pragma once
+#include <common/defs.h>
+#include <common/kspinlock.hpp>
+
+class Thread;
+
+// APIC timer ticks since boot
+extern volatile u64 timer_ticks;
+
+// called by the timer interrupt, wakes up timed waits that expired
+void timer_tick();
+
+// Threads blocked until an event, linked through Thread::wait_prev/wait_next.
+// Waiting is only possible in kernel threads, waking up also works in interrupt handlers.
+// Each wait queue has a lock, taken with interrupts disabled before any run queue lock. Conditions
+// are checked under it, so a wakeup between the check and blocking is not lost. The wait queues of
+// an object can share the lock of the object, so that it protects the state of the conditions too.
+class WaitQueue {
+ public:
+  WaitQueue() :lock_(&own_lock_) { }
+  explicit WaitQueue(kspinlock *lock) :lock_(lock) { }
+  WaitQueue(const WaitQueue &) = delete;
+
+  kspinlock &lock() const {
+    return *lock_;
+  }
+
+  // blocks the current thread until cond() is true
+  template <typename Cond>
+  void wait_event(Cond cond) {
+    auto flags = lock_->lock_irqsave();
+    while (!cond()) {
+      sleep(0);
+    }
+    lock_->unlock_irqrestore(flags);
+  }
+
+  // returns cond(), false if it is still false after timeout_ticks
+  template <typename Cond>
+  bool wait_event_timeout(Cond cond, u64 timeout_ticks) {
+    auto flags = lock_->lock_irqsave();
+    auto deadline = timer_ticks + timeout_ticks;
+    bool ret;
+    while (!(ret = cond()) && timer_ticks < deadline) {
+      sleep(deadline);
+    }
+    lock_->unlock_irqrestore(flags);
+    return ret;
+  }
+
+  // Blocks the current thread until it is woken up or timer_ticks reaches deadline, 0 for no deadline.
+  // lock() must be held with interrupts disabled, it is dropped while blocked.
+  // Callers recheck their condition afterwards, wakeups may be spurious.
+  void sleep(u64 deadline);
+
+  // wakes up the first waiter, returns false if there is none
+  bool wake_one();
+  void wake_all();
+  // wake_one() and wake_all() with lock() held
+  bool wake_one_locked();
+  void wake_all_locked();
+
+  bool empty() const {
+    return head_ == nullptr;
+  }
+
+ private:
+  void remove(Thread *p);
+
+  kspinlock own_lock_;
+  kspinlock *lock_;
+  Thread *head_ = nullptr;
+  Thread *tail_ = nullptr;
+};
+
+// blocks the current thread for ticks timer ticks
+void sleep_ticks(u64 ticks);
+
+// A one-shot event, every complete() lets one wait() return.
+class Completion {
+ public:
+  void complete();
+  void wait();
+  // returns false on timeout
+  bool wait_timeout(u64 timeout_ticks);
+
+ private:
+  u64 done_ = 0;
+  WaitQueue wq_;
+};
+
+// Counting semaphore
+class Semaphore {
+ public:
+  explicit Semaphore(long count = 0) :count_(count) { }
+
+  void down();
+  // returns false if the count is 0
+  bool try_down();
+  void up();
+
+  long count() const {
+    return count_;
+  }
+
+ private:
+  long count_;
+  WaitQueue wq_;
+};
@@ -0,0 +1,100 @@
+#pragma once
+#include <common/defs.h>
+#include <common/kstring.hpp>
+#include <wait.h>
+
+// A function run later by a worker thread of a WorkQueue, unlike a tasklet it may sleep.
+// Queueing a work that is pending already does nothing, queueing one that is running makes it run once
+// more afterwards. A work never runs on two workers at the same time, and it must not free itself.
+class Work {
+ public:
+  Work(void (*func)(void *), void *data) :func_(func), data_(data) { }
+
+  // queued or delayed, and not started yet
+  bool pending() const {
+    return pending_;
+  }
+
+ private:
+  friend class WorkQueue;
+
+  void (*func_)(void *);
+  void *data_;
+  Work *next_ = nullptr;
+  // timer tick a delayed work is due, 0 once it is queued
+  u64 deadline_ = 0;
+  // tsc when it was queued
+  u64 queued_tsc_ = 0;
+  bool pending_ = false;
+  bool running_ = false;
+};
+
+struct WorkQueueStats {
+  // works queued, delayed ones are counted when they are due
+  u64 queued;
+  u64 executed;
+  // works waiting for a worker now, and the most there have been
+  u64 depth;
+  u64 max_depth;
+  // delayed works that are not due yet
+  u64 delayed;
+  // tsc cycles spent running works, the longest run, and cycles works waited for a worker
+  u64 exec_cycles;
+  u64 max_exec_cycles;
+  u64 wait_cycles;
+};
+
+// Works run by a pool of kernel threads in FIFO order, drivers submit units of work instead of owning threads.
+// Works can be queued from interrupt handlers and tasklets. The lists, the states of the works and the stats
+// are protected by lock_, which the wait queues of the workers and of the flushes share.
+class WorkQueue {
+ public:
+  explicit WorkQueue(const kstring &name);
+
+  // starts worker threads until there are n_workers, they are stolen by idle cpus like any thread
+  void grow(u64 n_workers);
+
+  // returns false if work is pending already
+  bool queue_work(Work *work);
+  // queues work after delay_ticks timer ticks, returns false if work is pending already
+  bool queue_delayed_work(Work *work, u64 delay_ticks);
+
+  // waits until work is neither pending nor running, a delayed work also until it has run
+  void flush_work(Work *work);
+  // waits until no work is queued or running, delayed works that are not due are not waited for
+  void flush();
+
+  WorkQueueStats stats() const;
+  void print() const;
+
+ private:
+  static void worker_main(void *cookie);
+
+  void enqueue_locked(Work *work);
+  // queues the delayed works that are due, then takes the first queued work
+  Work *take_locked();
+  // the earliest deadline of the delayed works, 0 if there are none
+  u64 next_deadline_locked() const;
+
+  kstring name_;
+  mutable kspinlock lock_;
+  u64 n_workers_ = 0;
+  // workers running a work
+  u64 busy_ = 0;
+  Work *head_ = nullptr;
+  Work *tail_ = nullptr;
+  // delayed works, unsorted
+  Work *delayed_ = nullptr;
+  // idle workers wait here, until the next delayed work is due
+  WaitQueue worker_wq_{&lock_};
+  WaitQueue flush_wq_{&lock_};
+  WorkQueueStats stats_ = {};
+};
+
+// the work queue shared by drivers, one worker per online cpu
+extern WorkQueue *system_wq;
+
+// creates system_wq with a single worker, before the drivers start
+void workqueue_init();
+// one worker per online cpu in system_wq, after smp_init()
+void workqueue_smp_init();
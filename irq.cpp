@@ -3,7 +3,7 @@
 #include <lib/string.h>
 #include <kernel.h>
 #include "debug.h"
-#include <process.h>
+#include <thread.h>
 #include <irq.hpp>
 #include <atomic>
 #include <common/small_vec.hpp>
@@ -11,6 +11,7 @@
 #include <functional>
 #include <common/unwind.hpp>
 #include <mm/mm.h>
+#include <percpu.h>
 
 extern "C" void _default_irq_handler();
 
@@ -59,6 +60,8 @@ extern "C" void _54h_irq_handler();
 extern "C" void _55h_irq_handler();
 extern "C" void _56h_irq_handler();
 extern "C" void _57h_irq_handler();
+extern "C" void _reschedule_ipi_handler();
+extern "C" void _tlb_shootdown_ipi_handler();
 
 InterruptDescriptor main_idt[256];
 
@@ -79,15 +82,21 @@ void set_idt_offset(InterruptDescriptor *desc, void* ptr, bool user_mode = false
 InterruptProcessor::InterruptProcessor(Kernel *kernel) :k(kernel) { // NOLINT(cppcoreguidelines-pro-type-member-init)
   auto cs = get_cs();
   setup_idt(cs, (void*)&_default_irq_handler);
+  load();
+}
+
+void InterruptProcessor::load() {
   load_idt(std::make_tuple<void*, u16>(main_idt_, 0xfff));
 }
 
-void InterruptProcessor::HandleInterrupt(unsigned long irq_num, unsigned long error_code) {
-  auto context = current_context();
+void InterruptProcessor::HandleInterrupt(unsigned long irq_num, unsigned long error_code, Context *frame) {
+  // a nested exception returns to its own frame, otherwise the saved context of the thread is used
+  auto context = this_cpu()->irq_depth > 1 ? frame : current_context();
+  auto current = Thread::current();
   if (interrupts_[irq_num].handlers_.empty()) {
     Kernel::k->serial_port_
         << "unhandled interrupt: "
-        << "IRQ = 0x" << SerialPort::IntRadix::Hex << irq_num << " error = 0x" << error_code << " pid = 0x" << current_pid << "(" << processes[current_pid]->name.c_str() << ")" << "\n"
+        << "IRQ = 0x" << SerialPort::IntRadix::Hex << irq_num << " error = 0x" << error_code << " cpu " << this_cpu()->id << " tid = 0x" << (current ? current->id : 0) << "(" << (current ? current->name.c_str() : "") << ")" << "\n"
         << "rip = 0x" << context->rip << " rsp = 0x" << context->rsp << "\n";
     if (irq_num == IRQ_PAGE_FAULT) {
       Kernel::k->serial_port_
@@ -111,7 +120,7 @@ void InterruptProcessor::HandleInterrupt(unsigned long irq_num, unsigned long er
         .irq_num = irq_num,
         .error_code = error_code,
         .context = context,
-        .pid = current_pid,
+        .tid = current ? current->id : 0,
     };
 
     handler(&info);
@@ -171,6 +180,9 @@ void InterruptProcessor::setup_idt(unsigned short selector, void *default_handle
   set_idt_offset(&main_idt_[0x54], (void*)&_55h_irq_handler);
   set_idt_offset(&main_idt_[0x56], (void*)&_56h_irq_handler);
   set_idt_offset(&main_idt_[0x57], (void*)&_57h_irq_handler);
+
+  set_idt_offset(&main_idt_[IRQ_IPI_RESCHEDULE], (void*)&_reschedule_ipi_handler);
+  set_idt_offset(&main_idt_[IRQ_IPI_TLB_SHOOTDOWN], (void*)&_tlb_shootdown_ipi_handler);
 }
 
 void InterruptProcessor::Register(size_t id, InterruptHandler handler) {
@@ -179,9 +191,8 @@ void InterruptProcessor::Register(size_t id, InterruptHandler handler) {
 
 static PER_CPU InterruptProcessor *processor_;
 
-extern "C" void irq_handler(u64 irq_num, u64 error_code) {
-  // TODO: percpu_get
-  processor_->HandleInterrupt(irq_num, error_code);
+extern "C" void irq_handler(u64 irq_num, u64 error_code, Context *frame) {
+  per_cpu(processor_)->HandleInterrupt(irq_num, error_code, frame);
 }
 
 void InterruptProcessor::Register(size_t start_id, size_t count, InterruptHandler handler) {
@@ -190,10 +201,12 @@ void InterruptProcessor::Register(size_t start_id, size_t count, InterruptHandle
   }
 }
 
+// Called on the boot cpu before the per-cpu areas of the other cpus are copied from it,
+// so they all share this InterruptProcessor.
 InterruptProcessor *irq_init() {
-  // TODO: percpu_allocate
-  processor_ = knew<InterruptProcessor>(Kernel::k);
-  return processor_;
+  auto &processor = per_cpu(processor_);
+  processor = knew<InterruptProcessor>(Kernel::k);
+  return processor;
 }
 
 
@@ -9,5 +9,6 @@ enum {
   SYSCALL_NR_EXIT,
   SYSCALL_NR_YIELD,
   SYSCALL_NR_ANON_ALLOCATE,
+  SYSCALL_NR_FORK,
   SYSCALL_NR_MAX,
 };
\ No newline at end of file
@@ -19,7 +19,12 @@
 #include <lib/string.h>
 #include <mm/mm.h>
 #include <mm/page_alloc.h>
+#include <device/apic.h>
+#include <percpu.h>
 #include <process.h>
+#include <smp.h>
+#include <workqueue.h>
+#include <async.h>
 #include "debug.h"
 
 Kernel *Kernel::k;
@@ -40,8 +45,6 @@ void kernel_start(EFIServicesInfo *efi_info) {
 void process_init();
 void efi_table_init();
 
-void lapic_init();
-
 extern u8* kernel_init_stack;
 extern "C" u8* kernel_init_stack_bottom;
 
@@ -97,13 +100,20 @@ void Kernel::start() {
 
   // Init basic functionalities
   // You should not switch any order of these inits
+  // everything from here on reaches the current thread and the interrupt state through gs
+  percpu_init();
   debug_init();
   mm_init();
   stacks_init();
   irq_ = irq_init();
   fs_root_ = create_root_dir();
+  thread_init();
   process_init();
   Syscall::SetupSyscall(this);
+  page_zero_init();
+  // drivers queue their work on system_wq and spawn coroutines
+  workqueue_init();
+  async_init();
 
   // Init drivers
   lapic_init();
@@ -115,7 +125,11 @@ void Kernel::start() {
 
   com1_ = knew<Serial8250>(0x3f8);
 
-  // exec process 1
+  // the MADT is parsed by efi_table_init()
+  smp_init();
+  workqueue_smp_init();
+
+  // exec the main process
   return_from_syscall(current_context());
 
   panic("ERROR: kernel::start() should not return, but it returns");
@@ -130,10 +144,8 @@ void Kernel::panic(const char *s) {
 }
 
 void Kernel::stack_dump(unsigned long rbp) {
-  auto kstack = std::make_tuple(
-      (u64)processes[current_pid]->kernel_stack,
-      (u64)processes[current_pid]->kernel_stack_bottom
-  );
+  auto t = Thread::current();
+  auto kstack = t ? std::make_tuple((u64)t->kernel_stack, (u64)t->kernel_stack_top()) : std::make_tuple(0UL, 0UL);
   Kernel::sp() << "Stack dump:\n";
   Unwind unwind(rbp, Kernel::k->stacks_, kstack);
   unwind.Iterate([](u64 rbp, u64 ret_addr) {
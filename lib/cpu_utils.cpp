@@ -72,11 +72,24 @@ void flush_tlb() {
       "mov %%rax, %%cr3\t\n"
   :::"memory", "%rax");
 }
+std::tuple<u32, u32, u32, u32> cpuid(u32 leaf, u32 subleaf) {
+  u32 eax, ebx, ecx, edx;
+  asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf), "c"(subleaf));
+  return std::make_tuple(eax, ebx, ecx, edx);
+}
 u16 get_cs() {
   u16 cs = 0;
   asm volatile("mov %%cs ,%0" : "=r" (cs));
   return cs;
 }
+u64 get_cr0() {
+  u64 ret;
+  asm volatile("mov %%cr0, %0" :"=r"(ret));
+  return ret;
+}
+void set_cr0(u64 cr0) {
+  asm volatile("mov %0, %%cr0" : :"r"(cr0) :"memory");
+}
 u64 get_cr2() {
   u64 cr2;
   asm volatile("mov %%cr2, %0" :"=r"(cr2));
@@ -87,6 +100,17 @@ u64 get_cr3() {
   asm volatile("mov %%cr3, %0" :"=r"(ret));
   return ret;
 }
+void set_cr3(u64 cr3) {
+  asm volatile("mov %0, %%cr3" : :"r"(cr3) :"memory");
+}
+u64 get_cr4() {
+  u64 ret;
+  asm volatile("mov %%cr4, %0" :"=r"(ret));
+  return ret;
+}
+void set_cr4(u64 cr4) {
+  asm volatile("mov %0, %%cr4" : :"r"(cr4) :"memory");
+}
 u64 get_pml4t_phy() {
   return get_cr3() & 0xfffffffffffff000;
 }
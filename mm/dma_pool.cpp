@@ -0,0 +1,77 @@
+#include <cpu_defs.h>
+#include <kernel.h>
+#include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/dma_pool.h>
+#include <mm/mm.h>
+#include <mm/page_alloc.h>
+
+bool dma_alloc(u64 size, u64 dma_mask, DmaBuffer *buf) {
+  assert(dma_mask >= DmaMask32, "DMA masks narrower than 32 bits are not supported");
+  auto log2size = max(log2_ceil(size), Log2MinSize);
+  auto flags = PageAllocZero | (dma_mask < DmaMask64 ? PageAllocDMA32 : 0);
+  auto vaddr = kernel_page_alloc(log2size, flags);
+  if (!vaddr) {
+    return false;
+  }
+  buf->vaddr = vaddr;
+  buf->bus_addr = kernel2phy((u64)vaddr);
+  buf->size = 1UL << log2size;
+  assert(buf->bus_addr + buf->size - 1 <= dma_mask, "DMA buffer above the DMA mask");
+  return true;
+}
+
+void dma_free(const DmaBuffer &buf) {
+  kernel_page_free(buf.vaddr);
+}
+
+DmaPool::DmaPool(const char *name, u64 size, u64 align, u64 dma_mask)
+    :name_(name), dma_mask_(dma_mask) {
+  assert(align != 0 && (align & (align - 1)) == 0 && align <= PAGE_SIZE, "invalid DMA pool alignment");
+  block_size_ = (max(size, (u64)sizeof(FreeBlock)) + align - 1) & ~(align - 1);
+  chunk_size_ = 1UL << max(log2_ceil(block_size_), Log2MinSize);
+}
+
+bool DmaPool::grow_locked() {
+  DmaBuffer chunk;
+  if (!dma_alloc(chunk_size_, dma_mask_, &chunk)) {
+    return false;
+  }
+  chunks_++;
+  for (u64 offset = 0; offset + block_size_ <= chunk_size_; offset += block_size_) {
+    auto block = (FreeBlock*)((u8*)chunk.vaddr + offset);
+    block->next = free_;
+    free_ = block;
+  }
+  return true;
+}
+
+void *DmaPool::alloc(u64 *bus_addr) {
+  auto flags = lock_.lock_irqsave();
+  if (!free_ && !grow_locked()) {
+    lock_.unlock_irqrestore(flags);
+    return nullptr;
+  }
+  auto block = free_;
+  free_ = block->next;
+  allocated_++;
+  lock_.unlock_irqrestore(flags);
+  *bus_addr = kernel2phy((u64)block);
+  return block;
+}
+
+void DmaPool::free(void *vaddr) {
+  auto block = (FreeBlock*)vaddr;
+  auto flags = lock_.lock_irqsave();
+  block->next = free_;
+  free_ = block;
+  allocated_--;
+  lock_.unlock_irqrestore(flags);
+}
+
+void DmaPool::print_usage() const {
+  auto flags = lock_.lock_irqsave();
+  Kernel::sp() << "dma pool " << name_ << ": block size " << IntRadix::Dec << block_size_ << " chunks " << chunks_
+               << " allocated blocks " << allocated_ << "\n";
+  lock_.unlock_irqrestore(flags);
+}
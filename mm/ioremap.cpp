@@ -0,0 +1,36 @@
+#include <cpu_defs.h>
+#include <kernel.h>
+#include <lib/string.h>
+#include <mm/ioremap.h>
+#include <common/kspinlock.hpp>
+
+// Virtual space of the ioremap region is handed out linearly and never reused,
+// the region is 512G and mappings are mostly done once by drivers at boot.
+static u64 ioremap_next = IOREMAP_START;
+// protects ioremap_next and the kernel page tables of the region
+static kspinlock ioremap_lock;
+
+void *ioremap(u64 phy, u64 size, CacheMode mode) {
+  auto offset = phy & (PAGE_SIZE - 1);
+  auto phy_start = phy - offset;
+  auto map_size = (offset + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+  // keep big mappings 2M aligned so that kernel_map_pages() can use 2M pages
+  auto align = map_size >= PageSize2M ? PageSize2M : PAGE_SIZE;
+  auto flags = ioremap_lock.lock_irqsave();
+  auto vaddr = (ioremap_next + align - 1) & ~(align - 1);
+  if (vaddr + map_size > IOREMAP_START + IOREMAP_SIZE) {
+    Kernel::k->panic("ioremap region exhausted");
+  }
+  ioremap_next = vaddr + map_size;
+
+  kernel_map_pages(vaddr, phy_start, map_size, mode);
+  ioremap_lock.unlock_irqrestore(flags);
+  Kernel::sp() << "ioremap 0x" << IntRadix::Hex << phy << " size 0x" << size << " -> 0x" << vaddr + offset << "\n";
+  return (void*)(vaddr + offset);
+}
+
+void iounmap(volatile void *vaddr, u64 size) {
+  auto offset = (u64)vaddr & (PAGE_SIZE - 1);
+  kernel_unmap_pages((u64)vaddr - offset, (offset + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
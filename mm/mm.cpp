@@ -7,8 +7,13 @@
 #include <lib/string.h>
 #include <mm/mm.h>
 #include <mm/page_alloc.h>
+#include <mm/page_table.h>
+#include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <irq.hpp>
 #include <lib/file_size.h>
+#include <lib/utils.h>
+#include <cpu_utils.h>
 
 #define CR4_PSE (1u<<4u)
 #define CR4_PAE (1u<<5u)
@@ -73,7 +78,7 @@ void calculate_total_pages(const u64* pml4t) {
   Kernel::sp() << "total pages: 0x" << SerialPort::IntRadix::Hex << total_pages << '\n';
 }
 
-SegmentDescriptor kernel_gdt[128];
+SegmentDescriptor kernel_gdt[GdtEntries];
 
 extern "C" void __gdt_init_next_instruction();
 
@@ -81,24 +86,78 @@ static void load_kernel_gdt() {
   load_gdt(std::make_tuple(kernel_gdt, sizeof(kernel_gdt)-1));
 }
 
+// max size of the direct map when the CPU has no 1G pages, in GiB
+constexpr u64 MaxDirectMap2MGiB = 64;
+
+// Kernel space page tables, pml4t[256] maps [KERNEL_START, KERNEL_START + direct_map_phy_end).
+// The direct map is write-back, MTRRs keep the MMIO holes in it uncached,
+// drivers access MMIO through ioremap() instead.
+// The first 64M is the kernel image, mapped with 4K pages so that text and rodata can be read-only.
+// The rest is the direct map, the first GiB uses 2M pages, the others use 1G pages
+// or 2M pages if the CPU does not support 1G pages or the MTRRs split the GiB.
 struct KernelImagePageTable {
   PageMappingL4Entry pml4t[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
 
   PageDirectoryPointerEntry pdpt[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
 
-  PageDirectoryEntry pdt[KERNEL_SPACE_PAGES / PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
-  PageTableEntry pt[KERNEL_SPACE_PAGES] ALIGN(PAGE_SIZE);
+  PageDirectoryEntry pdt[MaxDirectMap2MGiB * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
+  PageTableEntry image_pt[KERNEL_IMAGE_PAGES] ALIGN(PAGE_SIZE);
+
+  // lower level tables of the ioremap and vmalloc regions are allocated on demand
+  PageDirectoryPointerEntry ioremap_pdpt[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
+  PageDirectoryPointerEntry vmalloc_pdpt[1 * PAGES_PER_TABLE] ALIGN(PAGE_SIZE);
 };
 
 KernelImagePageTable t ALIGN(PAGE_SIZE);
 
-u64 get_kernel_pdpt_phy_addr() {
-//  return ((u64)&t.pml4t[256] - KERNEL_START) + Kernel::k->efi_info.kernel_physical_start;
+// the boot loader maps the first 4G
+u64 direct_map_phy_end = KERNEL_SPACE_PAGES * PAGE_SIZE;
 
-  u64 cr3;
-  asm volatile("mov %%cr3,%0" : "=r" (cr3));
-  auto pml4t = reinterpret_cast<const u64*>((cr3 & 0x000ffffffffff000) + KERNEL_START);
-  return pml4t[256] & 0xfffffffffffff000;
+bool nx_enabled = false;
+
+PageMappingL4Entry *kernel_pml4t() {
+  return t.pml4t;
+}
+
+// interrupts from user mode switch to rsp0 of the TSS
+static void setup_tss(SegmentDescriptor *gdt, TaskStateSegment *tss, u8 *rsp0) {
+  memset(tss, 0, sizeof(*tss));
+  tss->iomap_base_addr = ((u64)&tss->iomap - (u64)tss);
+  tss->rsp0 = (u64)rsp0;
+
+  auto *task_desc = (SystemSegmentDescriptor*)&gdt[TSS_INDEX];
+  auto tss_addr = (u64)tss;
+  memset(task_desc, 0, sizeof(SystemSegmentDescriptor));
+  task_desc->segment_limit_lo16 = sizeof(TaskStateSegment) & 0xffff;
+  task_desc->segment_limit_hi4 = sizeof(TaskStateSegment) >> 16;
+  task_desc->base_addr_lo16 = tss_addr & 0xffff;
+  task_desc->base_addr_mid8 = (tss_addr >> 16) & 0xff;
+  task_desc->base_addr_midhi8 = (tss_addr >> 24) & 0xff;
+  task_desc->base_addr_hi32 = (tss_addr >> 32) & 0xffffffff;
+
+  task_desc->type = DescriptorType::LongAvailableTSS;
+  task_desc->dpl = 0;
+  task_desc->p = 1;
+}
+
+void load_cpu_gdt(SegmentDescriptor *gdt, TaskStateSegment *tss, u8 *rsp0) {
+  memcpy(gdt, kernel_gdt, sizeof(kernel_gdt));
+  setup_tss(gdt, tss, rsp0);
+  load_gdt(std::make_tuple(gdt, sizeof(kernel_gdt)-1));
+
+  // reload cs with lretq, the data selectors are plain moves. fs and gs stay null, see percpu.h
+  asm volatile("leaq 1f(%%rip), %%rax\t\n"
+               "pushq %0\t\n"
+               "pushq %%rax\t\n"
+               "lretq\t\n"
+               "1:\t\n"
+               "mov %w1, %%ds\t\n"
+               "mov %w1, %%es\t\n"
+               "mov %w1, %%ss\t\n"
+               "ltr %w2\t\n"
+               :
+               :"i"((u64)KERNEL_CODE_SELECTOR), "r"((u64)KERNEL_DATA_SELECTOR), "r"((u64)TSS_SELECTOR)
+               :"%rax", "memory");
 }
 
 void gdt_init() {
@@ -186,25 +245,7 @@ void gdt_init() {
   kernel_gdt[i].__wr = 1;
   kernel_gdt[i]._dpl = 3;
 
-  // setup TSS
-  memset(&tss, 0, sizeof(tss));
-  tss.iomap_base_addr = ((u64)&tss.iomap - (u64)&tss);
-  tss.rsp0 = (u64)interrupt_stack_bottom;
-
-  auto *task_desc = (SystemSegmentDescriptor*)&kernel_gdt[TSS_INDEX];
-  auto tss_addr = (u64)&tss;
-  memset(task_desc, 0, sizeof(SystemSegmentDescriptor));
-  task_desc->segment_limit_lo16 = sizeof(TaskStateSegment) & 0xffff;
-  task_desc->segment_limit_hi4 = sizeof(TaskStateSegment) >> 16;
-  task_desc->base_addr_lo16 = tss_addr & 0xffff;
-  task_desc->base_addr_mid8 = (tss_addr >> 16) & 0xff;
-  task_desc->base_addr_midhi8 = (tss_addr >> 24) & 0xff;
-  task_desc->base_addr_hi32 = (tss_addr >> 32) & 0xffffffff;
-
-  task_desc->type = DescriptorType::LongAvailableTSS;
-  task_desc->dpl = 0;
-  task_desc->p = 1;
-
+  setup_tss(kernel_gdt, &tss, interrupt_stack_bottom);
   load_kernel_gdt();
 
   Kernel::sp() << "loading tr 0x" << SerialPort::IntRadix::Hex << TSS_SELECTOR << "\n";
@@ -217,59 +258,134 @@ void gdt_init() {
       );
 }
 
-//extern "C" void setup_kernel_image_page_table();
+extern "C" char _TEXT_START_[]; // NOLINT(bugprone-reserved-identifier)
+extern "C" char _TEXT_END_[]; // NOLINT(bugprone-reserved-identifier)
+extern "C" char _DATA_START_[]; // NOLINT(bugprone-reserved-identifier)
+
+// the direct map covers all memory reported by EFI except MMIO, and at least 4G
+static u64 max_physical_memory_end() {
+  auto &efi_info = Kernel::k->efi_info;
+  u64 end = KERNEL_SPACE_PAGES * PAGE_SIZE;
+  for (int i = 0; i < efi_info.descriptor_count; i++) {
+    auto md = (EFI_MEMORY_DESCRIPTOR*)(efi_info.memory_descriptors + i * efi_info.descriptor_size);
+    if (md->Type == EfiReservedMemoryType || md->Type == EfiMemoryMappedIO || md->Type == EfiMemoryMappedIOPortSpace) {
+      continue;
+    }
+    end = max(end, md->PhysicalStart + md->NumberOfPages * PAGE_SIZE);
+  }
+  // round up to 1G
+  return (end + (1UL << 30) - 1) & ~((1UL << 30) - 1);
+}
 
 void setup_page_table_in_kernel_space() {
-  // copy page to to kernel space
-  u64 pml4t_phy = get_pml4t_phy();
-  auto pml4t = reinterpret_cast<const u64*>(pml4t_phy + KERNEL_START);
+  auto [ext_eax, ext_ebx, ext_ecx, ext_edx] = cpuid(0x80000001);
+  bool page1gb = ext_edx & CPUID_EXT_PAGE1GB;
+  bool nx = ext_edx & CPUID_EXT_NX;
+  if (nx) {
+    set_msr(EFER_MSR, get_msr(EFER_MSR) | EFER_NXE);
+    nx_enabled = true;
+  }
+
+  auto max_gib = page1gb ? PAGES_PER_TABLE : MaxDirectMap2MGiB;
+  auto phy_end = max_physical_memory_end();
+  if (phy_end > (max_gib << 30)) {
+    Kernel::sp() << "direct map is limited to " << IntRadix::Dec << max_gib << " GiB\n";
+    phy_end = max_gib << 30;
+  }
 
   // setup mapping again;
   memset(&t, 0, sizeof(t));
 
   auto kernel_start_phy = Kernel::k->efi_info.kernel_physical_start;
+  auto table_phy = [kernel_start_phy](const void *entry) {
+    return ((u64)entry - KERNEL_START + kernel_start_phy) >> 12;
+  };
 
   t.pml4t[256].p = 1;
   t.pml4t[256].rw = 1;
-  t.pml4t[256].base_addr = ((u64)(&t.pdpt[0])-KERNEL_START + kernel_start_phy) >> 12;
-
-  for (u64 i = 0; i < sizeof(t.pdpt)/sizeof(t.pdpt[0]); i++) {
+  t.pml4t[256].base_addr = table_phy(&t.pdpt[0]);
+
+  // A large page over several MTRR memory types is undefined, GiBs the MTRRs split, like the one
+  // with the PCI hole below 4G, use 2M pages too.
+  u64 n_pdt = 0;
+  for (u64 i = 0; i < phy_end >> 30; i++) {
+    bool use_1g = i != 0 && page1gb && mtrr_range_uniform(i << 30, 1UL << 30);
+    if (!use_1g && n_pdt == MaxDirectMap2MGiB) {
+      Kernel::sp() << "direct map GiB " << IntRadix::Dec << i << " spans several memory types\n";
+      use_1g = true;
+    }
+    if (use_1g) {
+      auto &entry = *(HugePageEntry*)&t.pdpt[i];
+      entry.p = 1;
+      entry.rw = 1;
+      entry.ps = 1;
+      entry.nx = nx;
+      entry.base_addr = (i << 30) >> 12;
+      continue;
+    }
+    auto pdt = &t.pdt[n_pdt++ * PAGES_PER_TABLE];
     t.pdpt[i].p = 1;
     t.pdpt[i].rw = 1;
-    t.pdpt[i].base_addr = ((u64)(&t.pdt[i * PAGES_PER_TABLE])-KERNEL_START + kernel_start_phy) >> 12;
+    t.pdpt[i].base_addr = table_phy(pdt);
+    // the kernel image at the start of the first GiB is mapped below
+    for (u64 j = i == 0 ? KERNEL_IMAGE_PAGES / PAGES_PER_TABLE : 0; j < PAGES_PER_TABLE; j++) {
+      auto &entry = *(HugePageEntry*)&pdt[j];
+      entry.p = 1;
+      entry.rw = 1;
+      entry.ps = 1;
+      entry.nx = nx;
+      entry.base_addr = ((i << 30) + (j << 21)) >> 12;
+    }
   }
 
-  for (u64 i = 0; i < sizeof(t.pdt)/sizeof(t.pdt[0]); i++) {
+  // Kernel space PML4 entries are shared by all processes, they are all set up here
+  // so that processes never miss kernel mappings created later.
+  auto ioremap_slot = (IOREMAP_START >> 39) & (PAGES_PER_TABLE - 1);
+  t.pml4t[ioremap_slot].p = 1;
+  t.pml4t[ioremap_slot].rw = 1;
+  t.pml4t[ioremap_slot].base_addr = table_phy(&t.ioremap_pdpt[0]);
+  auto vmalloc_slot = (KMALLOC_START >> 39) & (PAGES_PER_TABLE - 1);
+  t.pml4t[vmalloc_slot].p = 1;
+  t.pml4t[vmalloc_slot].rw = 1;
+  t.pml4t[vmalloc_slot].base_addr = table_phy(&t.vmalloc_pdpt[0]);
+
+  // kernel image, boot stack and bss are writable, text is read-only, rodata is read-only and not executable
+  for (u64 i = 0; i < KERNEL_IMAGE_PAGES / PAGES_PER_TABLE; i++) {
     t.pdt[i].p = 1;
     t.pdt[i].rw = 1;
-    t.pdt[i].base_addr = ((u64)(&t.pt[i * PAGES_PER_TABLE])-KERNEL_START+kernel_start_phy) >> 12;
+    t.pdt[i].base_addr = table_phy(&t.image_pt[i * PAGES_PER_TABLE]);
   }
-
-  // kernel identity mapping
-  for (u64 i = 0; i < KERNEL_SPACE_PAGES; i++) {
-    t.pt[i].p = 1;
-    t.pt[i].rw = 1;
-    t.pt[i].base_addr = i;
-
-    // disable cache for 3G~4G because these may contain MMIO address
-//    if (i * PAGE_SIZE >= 3UL * 1024*1024*1024) {
-    t.pt[i].pcd = 1;
-//    }
-  }
-
-  // kernel image
+  auto text_start = (u64)_TEXT_START_ - KERNEL_START;
+  auto text_end = (u64)_TEXT_END_ - KERNEL_START;
+  auto rodata_end = (u64)_DATA_START_ - KERNEL_START;
   for (u64 i = 0; i < KERNEL_IMAGE_PAGES; i++) {
-    t.pt[i].p = 1;
-    t.pt[i].rw = 1;
-    t.pt[i].base_addr = (kernel_start_phy>>12) + i;
+    auto offset = i * PAGE_SIZE;
+    t.image_pt[i].p = 1;
+    t.image_pt[i].rw = offset < text_start || offset >= rodata_end;
+    t.image_pt[i].nx = nx && (offset < text_start || offset >= text_end);
+    t.image_pt[i].base_addr = (kernel_start_phy>>12) + i;
   }
 
   // cr3 needs to by physical addr
   auto vaddr = (u64)&t.pml4t;
   auto cr3 = (vaddr - KERNEL_START) + Kernel::k->efi_info.kernel_physical_start;
 
-  Kernel::sp() << "moving page table to kernel, new cr3 = 0x" << SerialPort::IntRadix::Hex << cr3 << "\n";
+  Kernel::sp() << "moving page table to kernel, new cr3 = 0x" << SerialPort::IntRadix::Hex << cr3
+               << ", direct map 0x" << phy_end << (page1gb ? " with 1G pages" : " with 2M pages")
+               << (nx ? ", nx" : "") << "\n";
   asm volatile("mov %0,%%cr3" : :"r" (cr3));
+  direct_map_phy_end = phy_end;
+
+  // the kernel page table uses PCID 0, cr3 has no PCID bits yet
+  auto [std_eax, std_ebx, std_ecx, std_edx] = cpuid(1);
+  if (std_ecx & CPUID_PCID) {
+    set_cr4(get_cr4() | CR4_PCIDE);
+    pcid_enabled = true;
+    Kernel::sp() << "PCID enabled\n";
+  }
+
+  // enforce read-only pages in the kernel
+  set_cr0(get_cr0() | CR0_WP);
 }
 
 void page_table_init() {
@@ -277,6 +393,7 @@ void page_table_init() {
 }
 constexpr size_t MaxPageRegions = 1024;
 
+// EfiConventionalMemory regions, size in bytes
 static SmallVec<PageRegion, 1024> available_memory;
 
 void dump_efi_info() {
@@ -286,7 +403,6 @@ void dump_efi_info() {
   Kernel::sp() << "Memory segments: \n";
   for (int i = 0; i < efi_info.descriptor_count; i++) {
     auto md = (EFI_MEMORY_DESCRIPTOR*)(efi_info.memory_descriptors + i * efi_info.descriptor_size);
-    available_memory.emplace_back(PageRegion{md->Type, md->PhysicalStart, 0, md->NumberOfPages * 4096, md->Attribute});
     if (md->Type == EfiConventionalMemory) {
       auto l1 = md->PhysicalStart;
       auto r1 = md->PhysicalStart+4096*md->NumberOfPages;
@@ -300,7 +416,7 @@ void dump_efi_info() {
         Kernel::k->panic("Kernel image should not intersection with conventional memory\n");
       }
 
-      available_memory.push_back(PageRegion{md->Type, md->PhysicalStart, 0, md->NumberOfPages, md->Attribute});
+      available_memory.push_back(PageRegion{md->Type, md->PhysicalStart, 0, md->NumberOfPages * 4096, md->Attribute});
       total_size += md->NumberOfPages*4096;
     }
   }
@@ -316,11 +432,14 @@ void mm_init() {
   calculate_total_pages(pml4t);
 
   gdt_init();
+  pat_init();
   page_table_init();
 
   dump_efi_info();
 
   page_allocator_init(available_memory);
+  slab_init();
+  vmalloc_init();
 }
 
 u64 kernel2phy(unsigned long kernel_addr) {
@@ -1,428 +1,981 @@
 #include <cpu_defs.h>
+#include <efi/efi.h>
+#include <efi/efidef.h>
 #include <kernel.h>
 #include <lib/file_size.h>
 #include <lib/string.h>
 #include <lib/utils.h>
+#include <mm/mm.h>
 #include <mm/page_alloc.h>
+#include <mm/slab.h>
+#include <common/kmemory.hpp>
+#include <common/kspinlock.hpp>
+#include <percpu.h>
+#include <thread.h>
+#include <wait.h>
+
+// Buddy allocator over a physically contiguous range of 4K pages.
+// A block of order k is 2^k pages and is aligned to 2^k pages in physical address space,
+// so the buddy of a block is found by flipping bit k of its page frame number.
+// Free blocks are kept in per-order intrusive lists, a bitmap of non-empty orders
+// lets allocation find the smallest suitable order with a single find-first-set.
+struct BuddyAllocator {
+  BuddyAllocator(u64 phy_start, u64 n_pages, Page *pages) :start_pfn(phy_start / PAGE_SIZE), end_pfn(phy_start / PAGE_SIZE + n_pages), pages(pages) {
+    assert(phy_start % PAGE_SIZE == 0, "buddy allocator region not page aligned");
+    memset(pages, 0, n_pages * sizeof(Page));
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(free_blocks, 0, sizeof(free_blocks));
+    memset(allocated_blocks, 0, sizeof(allocated_blocks));
+
+    // seed the free lists with the largest naturally aligned blocks that fit in the region
+    u64 pfn = start_pfn;
+    while (pfn < end_pfn) {
+      u64 order = pfn == 0 ? MaxPageOrder : __builtin_ctzl(pfn);
+      if (order > MaxPageOrder) {
+        order = MaxPageOrder;
+      }
+      while (pfn + (1UL << order) > end_pfn) {
+        order--;
+      }
+      add_to_free_list(pfn_to_page(pfn), order);
+      free_pages += 1UL << order;
+      pfn += 1UL << order;
+    }
+  }
 
-struct Block {
-  Block() = default;
-  explicit Block(u8 available) :available(available) {}
+  u64 page_to_pfn(const Page *page) const {
+    return start_pfn + (page - pages);
+  }
 
-  u8 valid = false;
-  u8 available = true;
+  Page *pfn_to_page(u64 pfn) const {
+    return &pages[pfn - start_pfn];
+  }
 
-  Block *prev = nullptr;
-  Block *next = nullptr;
-};
+  bool contains(u64 pfn) const {
+    return pfn >= start_pfn && pfn < end_pfn;
+  }
 
-struct Bucket {
-  u64 log2size;
+  void add_to_free_list(Page *page, u64 order) {
+    auto &head = free_lists[order];
+    page->flags = PageFree;
+    page->order = order;
+    page->prev = nullptr;
+    page->next = head;
+    if (head) {
+      head->prev = page;
+    }
+    head = page;
 
-  size_t allocated_blocks = 0;
-  size_t available_blocks = 0;
-  // can be null to represent empty
-  Block *first_block;
-};
+    non_empty_orders |= 1UL << order;
+    free_blocks[order]++;
+  }
 
-constexpr u64 BlockSize = 16 * PAGE_SIZE;
-constexpr u64 MaxBlocks = 4UL * 1024UL * 1024UL * 1024UL / BlockSize;
+  void remove_from_free_list(Page *page) {
+    auto order = page->order;
+    auto &head = free_lists[order];
+    if (page->prev) {
+      page->prev->next = page->next;
+    } else {
+      head = page->next;
+    }
+    if (page->next) {
+      page->next->prev = page->prev;
+    }
+    page->prev = nullptr;
+    page->next = nullptr;
+    page->flags &= ~PageFree;
 
-static Block preallocated_blocks[MaxBlocks];
+    if (!head) {
+      non_empty_orders &= ~(1UL << order);
+    }
+    free_blocks[order]--;
+  }
 
-struct BuddyAllocator {
-  BuddyAllocator(u64 addr, u64 log2size, Block *base, u64 max_blocks) :phy_start(addr), root_log2size(log2size), blocks(base), max_blocks(max_blocks) {
-    // initialize buckets
-    memset(buckets, 0, sizeof(buckets));
-    auto root = &base[0];
-    new(root) Block(true);
-    root->valid = true;
-    for (u64 i = 0; i < (Log2MaxSize-Log2MinSize+1); i++) {
-      buckets[i].first_block = nullptr;
-      buckets[i].log2size = Log2MinSize + i;
+  Page *alloc_block(u64 order) {
+    auto candidates = non_empty_orders & ~((1UL << order) - 1);
+    if (candidates == 0) {
+      return nullptr;
     }
 
-    root->next = root;
-    root->prev = root;
-    buckets[log2size - Log2MinSize].first_block = root;
+    u64 current = __builtin_ctzl(candidates);
+    auto block = free_lists[current];
+    remove_from_free_list(block);
+
+    // split, return the upper halves to the free lists
+    while (current > order) {
+      current--;
+      add_to_free_list(block + (1UL << current), current);
+    }
+
+    block->flags = PageAllocated;
+    block->order = order;
+    block->owner = nullptr;
+    block->refcount = 1;
+    allocated_blocks[order]++;
+    free_pages -= 1UL << order;
+    return block;
   }
 
-  u64 get_block_offset(Block *block) const {
-    return block - blocks;
+  void free_block(Page *block) {
+    assert(block->flags & PageAllocated, "Cannot free pages that are not allocated");
+    u64 order = block->order;
+    allocated_blocks[order]--;
+    free_pages += 1UL << order;
+
+    block->flags = 0;
+    block->owner = nullptr;
+    block->refcount = 0;
+
+    // merge with free buddies as far as possible
+    u64 pfn = page_to_pfn(block);
+    while (order < MaxPageOrder) {
+      u64 buddy_pfn = pfn ^ (1UL << order);
+      if (!contains(buddy_pfn) || !contains(buddy_pfn + (1UL << order) - 1)) {
+        break;
+      }
+      auto buddy = pfn_to_page(buddy_pfn);
+      if (!(buddy->flags & PageFree) || buddy->order != order) {
+        break;
+      }
+      remove_from_free_list(buddy);
+      pfn &= ~(1UL << order);
+      order++;
+    }
+    add_to_free_list(pfn_to_page(pfn), order);
+  }
+
+  u64 allocate_pages(u64 log2size) {
+    if (log2size < Log2MinSize) {
+      Kernel::k->panic("Failed to allocate pages, log2size < Log2MinSize");
+    }
+    if (log2size > Log2MaxSize) {
+      return 0;
+    }
+
+    auto block = alloc_block(log2size - Log2MinSize);
+    if (!block) {
+      return 0;
+    }
+    return page_to_pfn(block) * PAGE_SIZE;
+  }
+
+  void free_pages_at(u64 addr) {
+    assert(addr % PAGE_SIZE == 0, "Failed to free pages, addr is not aligned");
+    auto pfn = addr / PAGE_SIZE;
+    assert(contains(pfn), "Failed to free pages, addr not managed by this allocator");
+    free_block(pfn_to_page(pfn));
   }
 
   void print_usage() const {
     Kernel::sp() << "Buddy allocator at 0x" << SerialPort::IntRadix::Hex << (u64)this << " usage:\n";
-    size_t total_free = 0;
     size_t total_available_blocks = 0, total_allocated_blocks = 0;
-    size_t total = (1ul << root_log2size);
-    for (u64 i = Log2MinSize; i <= root_log2size; i++) {
-      auto [_, free, alloc, avail] = print_bucket_usage(&get_bucket(i));
-      total_free += free;
-      total_available_blocks += avail;
-      total_allocated_blocks += alloc;
+    size_t total = (end_pfn - start_pfn) * PAGE_SIZE;
+    size_t total_free = free_pages * PAGE_SIZE;
+    for (u64 order = 0; order <= MaxPageOrder; order++) {
+      if (free_blocks[order] == 0 && allocated_blocks[order] == 0) {
+        continue;
+      }
+      auto block_size = PAGE_SIZE << order;
+      Kernel::sp() << "  order " << IntRadix::Dec << order << " size = ";
+      print_file_size(block_size);
+      Kernel::sp() << " used blocks " << IntRadix::Dec << allocated_blocks[order] << " ";
+      print_file_size(allocated_blocks[order] * block_size);
+      Kernel::sp() << " free blocks " << IntRadix::Dec << free_blocks[order] << " ";
+      print_file_size(free_blocks[order] * block_size);
+      Kernel::sp() << "\n";
+      total_available_blocks += free_blocks[order];
+      total_allocated_blocks += allocated_blocks[order];
     }
     Kernel::sp() << "  total used ";
     print_file_size(total - total_free);
     Kernel::sp() << " free ";
     print_file_size(total_free);
-    Kernel::sp() << " usage " << ((total - total_free) * 100 / total) << "%"
+    Kernel::sp() << " usage " << IntRadix::Dec << ((total - total_free) * 100 / total) << "%"
                  << " allocated blocks " << IntRadix::Dec << total_allocated_blocks
                  << " avail blocks " << IntRadix::Dec << total_available_blocks << "\n";
   }
 
-  std::tuple<size_t, size_t, size_t, size_t> print_bucket_usage(const Bucket *bucket) const {
-    auto bucket_size = 1UL << bucket->log2size;
-
-    Kernel::sp() << "  bucket " << SerialPort::IntRadix::Dec << bucket->log2size << " size = ";
-    print_file_size(bucket_size);
-    size_t free = 0;
-    if (bucket->first_block) {
-      Block *block = bucket->first_block;
-      do {
-        if (block->available) {
-          free++;
-        }
-        block = block->next;
-      } while (block != bucket->first_block);
-    }
-
-    Kernel::sp() << " used blocks " << IntRadix::Dec << bucket->allocated_blocks << " ";
-    print_file_size(bucket->allocated_blocks * bucket_size);
-    Kernel::sp() << " free blocks " << IntRadix::Dec << free << " ";
-    print_file_size(free * bucket_size);
-//    Kernel::sp() << " " << "free 0x" << free << " ";
-//    print_file_size(free * bucket_size);
-    Kernel::sp() << "\n";
-    return {0, free*bucket_size, bucket->allocated_blocks, bucket->available_blocks};
-  }
-
   void print() const {
-    Kernel::sp() << "Buddy allocator at 0x" << SerialPort::IntRadix::Hex << (u64)this << "\n";
-    for (u64 i = Log2MinSize; i <= root_log2size; i++) {
-      print_bucket(&get_bucket(i));
-    }
-  }
-
-  void print_bucket(const Bucket *bucket) const {
-    Kernel::sp() << "  bucket " << SerialPort::IntRadix::Dec << bucket->log2size << " size = ";
-    print_file_size(1UL << bucket->log2size);
-    Kernel::sp() << ": \n";
-    if (bucket->first_block) {
-      Block *block = bucket->first_block;
-      do {
-        Kernel::sp()
-            << "    "
-            << SerialPort::IntRadix::Hex
-            << "id 0x" << get_block_offset(block) << " "
-            << "addr 0x" << (phy_start+get_block_offset(block)*BlockSize) << " "
-            << "buddy 0x" << (u64) get_buddy(block) << " "
-            << "parent 0x" << (u64) get_parent(block) << " "
-            << (block->available ? "available" : "used") << " "
-            << (block->valid ? "valid" : "invalid") << " "
-            << "\n";
-
-        block = block->next;
-      } while (block != bucket->first_block);
-    }
-  }
-
-  Block *get_left(Block *block) const {
-    u64 offset = block - blocks;
-    if (2*offset+1 >= max_blocks) {
-      return nullptr;
+    Kernel::sp() << "Buddy allocator at 0x" << SerialPort::IntRadix::Hex << (u64)this
+                 << " pages 0x" << start_pfn * PAGE_SIZE << " - 0x" << end_pfn * PAGE_SIZE
+                 << " non-empty orders 0x" << non_empty_orders << "\n";
+    for (u64 order = 0; order <= MaxPageOrder; order++) {
+      if (free_lists[order]) {
+        Kernel::sp() << "  order " << IntRadix::Dec << order << " free blocks " << free_blocks[order]
+                     << " first 0x" << IntRadix::Hex << page_to_pfn(free_lists[order]) * PAGE_SIZE << "\n";
+      }
     }
-    return &blocks[2 * offset + 1];
   }
 
-  Block *get_right(Block *block) const {
-    u64 offset = block - blocks;
-    if (2*offset+2 >= max_blocks) {
-      return nullptr;
+  u64 start_pfn;
+  u64 end_pfn;
+  Page *pages;
+
+  Page *free_lists[MaxPageOrder + 1];
+  // bit k is set iff free_lists[k] is not empty
+  u64 non_empty_orders = 0;
+
+  size_t free_blocks[MaxPageOrder + 1];
+  size_t allocated_blocks[MaxPageOrder + 1];
+  size_t free_pages = 0;
+};
+
+// Physical memory is split into zones by address, each zone owns one buddy allocator per
+// EFI conventional memory region that falls in it.
+// Regions are of arbitrary size, so a region can not simply be merged into a bigger buddy allocator.
+struct Zone {
+  const char *name;
+  u64 phy_start;
+  u64 phy_end;
+  SmallVec<BuddyAllocator, MaxZoneRegions> regions;
+
+  u64 allocate_pages(u64 log2size) {
+    for (size_t i = 0; i < regions.size(); i++) {
+      auto addr = regions[i].allocate_pages(log2size);
+      if (addr) {
+        return addr;
+      }
     }
-    return &blocks[2 * offset + 2];
+    return 0;
   }
 
-  Block *get_parent(Block *block) const {
-    u64 offset = block - blocks;
-    if (offset == 0) {
-      return nullptr;
+  // returns nullptr if no region has a free block of order
+  Page *alloc_block(u64 order, BuddyAllocator *&region) {
+    for (size_t i = 0; i < regions.size(); i++) {
+      if (auto block = regions[i].alloc_block(order)) {
+        region = &regions[i];
+        return block;
+      }
     }
-    return &blocks[(offset-1) / 2];
+    return nullptr;
   }
 
-  Block *get_buddy(Block *block) const {
-    auto offset = get_block_offset(block);
-    if (offset == 0) {
-      return nullptr;
+  BuddyAllocator *find_region(u64 pfn) {
+    for (size_t i = 0; i < regions.size(); i++) {
+      if (regions[i].contains(pfn)) {
+        return &regions[i];
+      }
     }
-    if (offset % 2 == 0) {
-      return &blocks[offset - 1];
-    } else {
-      return &blocks[offset + 1];
+    return nullptr;
+  }
+
+  u64 total_pages() const {
+    u64 ret = 0;
+    for (size_t i = 0; i < regions.size(); i++) {
+      ret += regions[i].end_pfn - regions[i].start_pfn;
     }
+    return ret;
   }
 
-  void remove_from_available_list(Block *block) {
-    // need to change list head from bucket
-    auto &bucket = buckets[block_log2size(block) - Log2MinSize];
-    if (bucket.first_block == block) {
-      if (block->next == block) {
-        bucket.first_block = nullptr;
-      } else {
-        bucket.first_block = block->next;
-      }
+  u64 free_pages() const {
+    u64 ret = 0;
+    for (size_t i = 0; i < regions.size(); i++) {
+      ret += regions[i].free_pages;
     }
+    return ret;
+  }
 
-    auto next = block->next;
-    auto prev = block->prev;
+  void print() const {
+    Kernel::sp() << "Zone " << name << ": " << IntRadix::Dec << regions.size() << " regions, ";
+    print_file_size(total_pages() * PAGE_SIZE);
+    Kernel::sp() << " managed, ";
+    print_file_size(free_pages() * PAGE_SIZE);
+    Kernel::sp() << " free\n";
+  }
+};
 
-    if (prev) {
-      prev->next = next;
-    }
-    if (next) {
-      next->prev = prev;
-    }
+static Zone zones[ZoneCount] = {
+    {"DMA32", 0, 0x100000000UL, {}},
+    {"Normal", 0x100000000UL, ~0UL, {}},
+};
 
-    bucket.available_blocks--;
+// Adds [phy_start, phy_end) to the zone, page metadata is stored at the beginning of the region itself.
+static void zone_add_region(Zone &zone, u64 phy_start, u64 phy_end) {
+  auto n_pages = (phy_end - phy_start) / PAGE_SIZE;
+  auto metadata_pages = (n_pages * sizeof(Page) + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (n_pages <= metadata_pages) {
+    return;
+  }
+  if (zone.regions.size() == MaxZoneRegions) {
+    Kernel::sp() << "Zone " << zone.name << " is full, dropping region 0x" << IntRadix::Hex << phy_start << "\n";
+    return;
   }
+  auto metadata = (Page*)phy2virt(phy_start);
+  auto &region = zone.regions.emplace_back(phy_start + metadata_pages * PAGE_SIZE, n_pages - metadata_pages, metadata);
+  region.print();
+}
 
-  Block *alloc_block_size(u64 log2size) {
-    if (log2size > root_log2size) {
-      return nullptr;
-    }
+static void page_magazines_drain();
 
-    auto &bucket = buckets[log2size - Log2MinSize];
-    auto first = bucket.first_block;
-    if (first == nullptr) {
-      // split a larger block
-      auto parent_block = alloc_block_size(log2size + 1);
-      if (parent_block == nullptr) {
-        return nullptr;
-      }
+static void page_allocator_test() {
+  auto &zone = zones[ZoneDMA32];
+  auto free_pages = zone.free_pages();
 
-      auto left = get_left(parent_block);
-      auto right = get_right(parent_block);
+  auto addr1 = zone.allocate_pages(24);
+  Kernel::sp() << "allocated page phy addr 0x" << SerialPort::IntRadix::Hex << addr1 << "\n";
 
-      // return left node as allocated node
-      left->available = false;
-      left->valid = true;
-      right->available = true;
-      right->valid = true;
-      add_to_available_list(right);
+  auto addr2 = zone.allocate_pages(16);
+  Kernel::sp() << "allocated page phy addr 0x" << SerialPort::IntRadix::Hex << addr2 << "\n";
 
-      return left;
-    } else {
-      first->available = false;
-      remove_from_available_list(first);
+  auto addr3 = zone.allocate_pages(12);
+  Kernel::sp() << "allocated page phy addr 0x" << SerialPort::IntRadix::Hex << addr3 << "\n";
 
-      return first;
-    }
-  }
+  bool passed = addr1 && addr2 && addr3
+      && addr1 % (1UL << 24) == 0 && addr2 % (1UL << 16) == 0
+      && zone.free_pages() == free_pages - ((1UL << 12) + (1UL << 4) + 1);
 
-  u64 allocate_pages(u64 log2size) {
-    if (log2size < Log2MinSize) {
-      Kernel::k->panic("Failed to allocate pages, log2size < Log2MinSize");
-    }
+  physical_page_release(addr1);
+  physical_page_release(addr3);
+  physical_page_release(addr2);
 
-    auto block = alloc_block_size(log2size);
-    if (!block) {
-      return 0;
-    }
+  // the single page went to a magazine of this cpu
+  passed = passed && zone.free_pages() == free_pages - 1;
+  page_magazines_drain();
+  passed = passed && zone.free_pages() == free_pages;
 
-    get_bucket(log2size).allocated_blocks++;
+  auto high = physical_page_alloc(12);
+  passed = passed && high != 0 && (zones[ZoneNormal].regions.size() == 0 || high >= zones[ZoneNormal].phy_start);
+  physical_page_release(high);
 
-    return get_block_phy_addr(block);
-  }
+  assert(passed, "Buddy allocator test failed");
+  Kernel::sp() << "Buddy allocator test passed\n";
+}
 
-  u64 get_block_phy_addr(const Block *block) const {
-    return phy_start + (block - blocks) * BlockSize;
+void page_allocator_init(SmallVec<PageRegion, 1024> &regions) {
+  // Memory below IDENTITY_MAP_PHY_START is shadowed by the kernel image mapping,
+  // page metadata lives in the direct map so memory beyond it is not usable either.
+  for (size_t i = 0; i < regions.size(); i++) {
+    if (regions[i].type != EfiConventionalMemory) {
+      continue;
+    }
+    auto start = (regions[i].phy_start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    auto end = (regions[i].phy_start + regions[i].size) & ~(PAGE_SIZE - 1);
+    start = max(start, (u64)IDENTITY_MAP_PHY_START);
+    end = min(end, (u64)IDENTITY_MAP_PHY_END);
+
+    // a region across 4G is split between the zones
+    for (auto &zone : zones) {
+      auto zone_start = max(start, zone.phy_start);
+      auto zone_end = min(end, zone.phy_end);
+      if (zone_start < zone_end) {
+        zone_add_region(zone, zone_start, zone_end);
+      }
+    }
+  }
+  if (zones[ZoneDMA32].regions.size() == 0) {
+    Kernel::k->panic("No usable memory below 4G");
   }
 
-  Block *try_merge_with_buddy(Block *block) {
-    auto parent = get_parent(block);
-    if (!parent) {
-      return block;
-    }
+  for (auto &zone : zones) {
+    zone.print();
+  }
+  page_allocator_test();
+}
 
-    auto buddy = get_buddy(block);
-    if (!buddy || !buddy->available) {
-      return block;
-    }
+// Protects the buddy allocators, it is taken in interrupt handlers too.
+// The zones and their regions do not change after page_allocator_init().
+static kspinlock page_lock;
+
+// Per-cpu magazines: blocks of the small orders cached per cpu and zone, most recently freed first,
+// linked through Page::prev/next. Cached blocks stay allocated in their buddy allocator, are marked
+// PageMagazine and have Page::owner pointing to the BuddyAllocator.
+// The magazines of a cpu are guarded by their own lock, taken with interrupts disabled. Only the cpu
+// itself takes it, except when a failed high order allocation drains every cpu, so allocating and
+// freeing a cached block does not contend. Magazines are refilled from and drained to the buddy
+// allocators in batches under a single page_lock acquisition, the magazine lock is taken first.
+constexpr u64 MagazineOrders = 4;
+// pages moved per refill or drain, at least two blocks
+constexpr u64 MagazineBatchPages = 16;
+// a magazine holding more than this many batches is drained by one batch
+constexpr u64 MagazineHighBatches = 4;
+
+struct Magazine {
+  Page *head;
+  Page *tail;
+  u64 count;
+};
 
-    remove_from_available_list(buddy);
-    buddy->valid = false;
+struct CpuMagazines {
+  kspinlock lock;
+  Magazine mags[ZoneCount][MagazineOrders];
+};
 
-    assert(!parent->available, "inconsistent data structure, parent should not be available");
-    assert(parent->valid, "inconsistent data structure, parent should be valid");
-    parent->available = true;
+static CpuMagazines magazines[MaxCpus];
 
-    block->valid = false;
-    return try_merge_with_buddy(parent);
-  }
+static u64 magazine_batch(u64 order) {
+  return max(MagazineBatchPages >> order, 2UL);
+}
 
-  void add_to_available_list(Block *block) {
-    auto log2size = block_log2size(block);
-    auto &bucket = buckets[log2size-Log2MinSize];
-    auto &first = bucket.first_block;
-    if (!first) {
-      block->next = block;
-      block->prev = block;
-      first = block;
-    } else {
-      auto last = first->prev;
-      first->prev = block;
-      last->next = block;
+static ZoneType zone_of(u64 paddr) {
+  return paddr < zones[ZoneNormal].phy_start ? ZoneDMA32 : ZoneNormal;
+}
 
-      block->next = first;
-      block->prev = last;
-    }
+static void magazine_push(Magazine &m, Page *block, BuddyAllocator *region) {
+  block->flags = PageAllocated | PageMagazine;
+  block->owner = region;
+  block->prev = nullptr;
+  block->next = m.head;
+  if (m.head) {
+    m.head->prev = block;
+  } else {
+    m.tail = block;
+  }
+  m.head = block;
+  m.count++;
+}
 
-    bucket.available_blocks++;
+static void magazine_unlink(Magazine &m, Page *block) {
+  if (block->prev) {
+    block->prev->next = block->next;
+  } else {
+    m.head = block->next;
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
+  } else {
+    m.tail = block->prev;
   }
+  block->prev = nullptr;
+  block->next = nullptr;
+  block->owner = nullptr;
+  block->flags = PageAllocated;
+  m.count--;
+}
 
-  void free_pages(u64 addr) {
-    auto block_offset = (addr - phy_start) / BlockSize;
-    assert((addr-phy_start) % BlockSize == 0, "Failed to free pages, addr is not aligned");
+// returns the physical address of the most recently freed block, 0 if the magazine is empty
+static u64 magazine_pop(Magazine &m) {
+  auto block = m.head;
+  if (!block) {
+    return 0;
+  }
+  auto region = (BuddyAllocator*)block->owner;
+  magazine_unlink(m, block);
+  block->refcount = 1;
+  return region->page_to_pfn(block) * PAGE_SIZE;
+}
 
-    auto block = &blocks[block_offset];
-    assert(!block->available, "Cannot free available pages");
+// fills the magazine of the zone with a batch of blocks, returns false if the zone has no free block of order
+static bool magazine_refill_locked(Magazine &m, Zone &zone, u64 order) {
+  auto batch = magazine_batch(order);
+  for (u64 i = 0; i < batch; i++) {
+    BuddyAllocator *region;
+    auto block = zone.alloc_block(order, region);
+    if (!block) {
+      break;
+    }
+    magazine_push(m, block, region);
+  }
+  return m.count > 0;
+}
 
-    auto merged_block = try_merge_with_buddy(block);
-    merged_block->available = true;
-    add_to_available_list(merged_block);
+// returns n of the least recently freed blocks to their buddy allocators
+static void magazine_drain_locked(Magazine &m, u64 n) {
+  for (u64 i = 0; i < n && m.tail; i++) {
+    auto block = m.tail;
+    auto region = (BuddyAllocator*)block->owner;
+    magazine_unlink(m, block);
+    region->free_block(block);
+  }
+}
 
-    auto &bucket = get_bucket(block_log2size(block));
-    bucket.allocated_blocks--;
+// Interrupts are disabled. Allocations that do not need low memory prefer the Normal zone.
+static u64 magazine_alloc(u64 order, u32 flags) {
+  auto &cpu_mags = magazines[this_cpu()->id];
+  auto &mags = cpu_mags.mags;
+  bool normal = !(flags & PageAllocDMA32);
+  u64 addr = 0;
+  cpu_mags.lock.lock();
+  if (normal) {
+    addr = magazine_pop(mags[ZoneNormal][order]);
   }
+  if (!addr) {
+    addr = magazine_pop(mags[ZoneDMA32][order]);
+  }
+  if (!addr) {
+    page_lock.lock();
+    if (normal && magazine_refill_locked(mags[ZoneNormal][order], zones[ZoneNormal], order)) {
+      addr = magazine_pop(mags[ZoneNormal][order]);
+    } else if (magazine_refill_locked(mags[ZoneDMA32][order], zones[ZoneDMA32], order)) {
+      addr = magazine_pop(mags[ZoneDMA32][order]);
+    }
+    page_lock.unlock();
+  }
+  cpu_mags.lock.unlock();
+  return addr;
+}
 
-  u64 block_log2size(Block *block) const {
-    u64 depth = log2(get_block_offset(block) + 1);
-    return root_log2size - depth;
+// returns the magazines of every cpu to the buddy allocators
+static void page_magazines_drain() {
+  for (u64 cpu = 0; cpu < n_cpus; cpu++) {
+    auto &cpu_mags = magazines[cpu];
+    auto flags = cpu_mags.lock.lock_irqsave();
+    page_lock.lock();
+    for (auto &zone_mags : cpu_mags.mags) {
+      for (auto &m : zone_mags) {
+        magazine_drain_locked(m, m.count);
+      }
+    }
+    page_lock.unlock();
+    cpu_mags.lock.unlock_irqrestore(flags);
   }
+}
 
-  Bucket &get_bucket(u64 log2size) {
-    return buckets[log2size - Log2MinSize];
+static BuddyAllocator *find_region(u64 pfn) {
+  for (auto &zone : zones) {
+    auto region = zone.find_region(pfn);
+    if (region) {
+      return region;
+    }
   }
-  const Bucket &get_bucket(u64 log2size) const {
-    return buckets[log2size - Log2MinSize];
+  return nullptr;
+}
+
+static u64 zone_allocate_pages_locked(u64 i, u32 flags) {
+  if (!(flags & PageAllocDMA32)) {
+    auto addr = zones[ZoneNormal].allocate_pages(i);
+    if (addr) {
+      return addr;
+    }
   }
+  return zones[ZoneDMA32].allocate_pages(i);
+}
 
-  u64 phy_start;
-  u64 root_log2size;
-  Block *blocks;
-  u64 max_blocks;
-  Bucket buckets[Log2MaxSize - Log2MinSize + 1]{};
+// Single pages zeroed ahead of time by the page zeroing thread, for PageAllocZero allocations.
+// Pooled pages stay allocated in their buddy allocator, are marked PageZeroPool and linked
+// through Page::next, Page::owner points to the BuddyAllocator.
+// The thread runs just above the idle threads, it refills the pool once it drops below
+// ZeroPoolLow pages and stops at ZeroPoolPages. When memory runs out it backs off for
+// ZeroPoolBackoffTicks, so that it does not take back the pages the pool gave up.
+constexpr u64 ZeroPoolPages = 512;
+constexpr u64 ZeroPoolLow = ZeroPoolPages / 2;
+constexpr u64 ZeroPoolBackoffTicks = 500;
+constexpr u32 PageZeroPriority = SchedPriorities - 2;
+
+struct ZeroPool {
+  Page *head;
+  u64 count;
+  // PageAllocZero allocations served from the pool, and the ones zeroed synchronously
+  u64 hits;
+  u64 misses;
+  // timer tick before which the pool is not refilled
+  u64 refill_tick;
 };
 
-static char buddy_allocator_mem[sizeof(BuddyAllocator)];
+// protects zero_pool, never held together with page_lock
+static kspinlock zero_pool_lock;
+static ZeroPool zero_pool;
+// the page zeroing thread sleeps here while the pool is full enough or backing off
+static WaitQueue zero_wq(&zero_pool_lock);
 
-BuddyAllocator *buddy_allocator;
+// zero_pool_lock must be held
+static bool zero_pool_refill_due(u64 below) {
+  return zero_pool.count < below && timer_ticks >= zero_pool.refill_tick;
+}
 
-void buddy_allocator_init(u64 max_pages_addr, u64 log2size) {
-  // test buddy allocator
-  buddy_allocator = new(buddy_allocator_mem) BuddyAllocator(max_pages_addr, log2size, preallocated_blocks, MaxBlocks);
-  buddy_allocator->print();
+// Zeroes a page with non-temporal stores, pages zeroed ahead of time are not used soon
+// and should not evict the caches.
+static void zero_page_nt(void *page) {
+  auto p = (u64*)page;
+  for (u64 i = 0; i < PAGE_SIZE / sizeof(u64); i += 4) {
+    asm volatile("movnti %1, (%0)\n\t"
+                 "movnti %1, 8(%0)\n\t"
+                 "movnti %1, 16(%0)\n\t"
+                 "movnti %1, 24(%0)"
+                 : : "r"(p + i), "r"(0UL) : "memory");
+  }
+  // the stores are weakly ordered, make them visible before the page is handed out
+  asm volatile("sfence" : : : "memory");
+}
 
-  auto addr1 = buddy_allocator->allocate_pages(24);
-  Kernel::sp() << "allocated page phy addr 0x" << SerialPort::IntRadix::Hex << addr1 << "\n";
+// returns 0 if the pool is empty
+static u64 zero_pool_alloc() {
+  auto flags = zero_pool_lock.lock_irqsave();
+  auto block = zero_pool.head;
+  if (block) {
+    zero_pool.head = block->next;
+    zero_pool.count--;
+    zero_pool.hits++;
+  } else {
+    zero_pool.misses++;
+  }
+  if (zero_pool_refill_due(ZeroPoolLow)) {
+    zero_wq.wake_one_locked();
+  }
+  zero_pool_lock.unlock_irqrestore(flags);
 
-  auto addr2 = buddy_allocator->allocate_pages(16);
-  Kernel::sp() << "allocated page phy addr 0x" << SerialPort::IntRadix::Hex << addr2 << "\n";
+  if (!block) {
+    return 0;
+  }
+  auto region = (BuddyAllocator*)block->owner;
+  block->next = nullptr;
+  block->owner = nullptr;
+  block->flags = PageAllocated;
+  return region->page_to_pfn(block) * PAGE_SIZE;
+}
+
+// returns the pooled pages to the buddy allocators when memory runs out, false if the pool was empty
+static bool zero_pool_release() {
+  auto flags = zero_pool_lock.lock_irqsave();
+  auto head = zero_pool.head;
+  zero_pool.head = nullptr;
+  zero_pool.count = 0;
+  zero_pool.refill_tick = timer_ticks + ZeroPoolBackoffTicks;
+  zero_pool_lock.unlock_irqrestore(flags);
+  if (!head) {
+    return false;
+  }
 
-  buddy_allocator->free_pages(addr1);
-  buddy_allocator->free_pages(addr2);
+  flags = page_lock.lock_irqsave();
+  while (head) {
+    auto block = head;
+    head = block->next;
+    auto region = (BuddyAllocator*)block->owner;
+    block->next = nullptr;
+    block->flags = PageAllocated;
+    region->free_block(block);
+  }
+  page_lock.unlock_irqrestore(flags);
+  return true;
+}
 
-  bool passed = true;
-  for (int i = 0; i < sizeof(buddy_allocator->buckets) / sizeof(buddy_allocator->buckets[0]); i++) {
-    if (i + Log2MinSize == buddy_allocator->root_log2size) {
-      if (buddy_allocator->buckets[i].first_block == nullptr) {
-        passed = false;
-      } else if (buddy_allocator->buckets[i].first_block->next != buddy_allocator->buckets[i].first_block) {
-        passed = false;
+static void page_zero_main(void *) {
+  while (true) {
+    zero_wq.wait_event([]() { return zero_pool_refill_due(ZeroPoolLow); });
+    while (true) {
+      auto flags = zero_pool_lock.lock_irqsave();
+      bool refill = zero_pool_refill_due(ZeroPoolPages);
+      zero_pool_lock.unlock_irqrestore(flags);
+      if (!refill) {
+        break;
       }
-    } else {
-      if (buddy_allocator->buckets[i].first_block != nullptr) {
-        passed = false;
+      // cold pages from the buddy allocators, the magazines keep the hot ones
+      flags = page_lock.lock_irqsave();
+      auto paddr = zone_allocate_pages_locked(Log2MinSize, 0);
+      page_lock.unlock_irqrestore(flags);
+      if (paddr == 0) {
+        flags = zero_pool_lock.lock_irqsave();
+        zero_pool.refill_tick = timer_ticks + ZeroPoolBackoffTicks;
+        zero_pool_lock.unlock_irqrestore(flags);
+        break;
       }
+
+      zero_page_nt(phy2virt(paddr));
+      auto region = find_region(paddr / PAGE_SIZE);
+      auto block = region->pfn_to_page(paddr / PAGE_SIZE);
+      flags = zero_pool_lock.lock_irqsave();
+      block->flags = PageAllocated | PageZeroPool;
+      block->owner = region;
+      block->next = zero_pool.head;
+      zero_pool.head = block;
+      zero_pool.count++;
+      zero_pool_lock.unlock_irqrestore(flags);
     }
   }
+}
 
-  assert(passed, "Buddy allocator test failed");
-  Kernel::sp() << "Buddy allocator test passed\n";
+void page_zero_init() {
+  auto t = knew<Thread>(alloc_thread_id(), "pagezero", nullptr, KTHREAD_STACK_SIZE);
+  assert(t != nullptr, "Out of memory for the page zeroing thread");
+  t->tmp_start = page_zero_main;
+  t->priority = PageZeroPriority;
+  start_thread(t);
 }
 
-class PageAllocator {
+// the magazines, then the buddy allocators
+static u64 zone_allocate_block(u64 i, u32 flags) {
+  if (i >= Log2MinSize && i - Log2MinSize < MagazineOrders) {
+    auto irq_flags = irq_save();
+    auto addr = magazine_alloc(i - Log2MinSize, flags);
+    irq_restore(irq_flags);
+    if (addr) {
+      return addr;
+    }
+  }
+  auto irq_flags = page_lock.lock_irqsave();
+  auto addr = zone_allocate_pages_locked(i, flags);
+  page_lock.unlock_irqrestore(irq_flags);
+  if (addr == 0 && i > Log2MinSize && !(flags & PageAllocNoReclaim)) {
+    // blocks cached by any cpu may keep their buddies from merging
+    page_magazines_drain();
+    irq_flags = page_lock.lock_irqsave();
+    addr = zone_allocate_pages_locked(i, flags);
+    page_lock.unlock_irqrestore(irq_flags);
+  }
+  return addr;
+}
+
+// Compaction builds a free block of a failed order by migrating the movable pages out of a window of
+// that size, the window is the first one holding nothing but free blocks and movable pages.
+// A few windows are tried per failed allocation, the scan starts at the beginning of the zone.
+constexpr u64 CompactMaxWindows = 8;
 
-  // assume size = 512
-  PageDirectoryEntry *pdt;
-  // assume size = 512 * 512
-  PageTableEntry *pt;
+struct CompactStats {
+  // failed allocations compaction made succeed, and the ones it did not
+  u64 success;
+  u64 fail;
+  u64 migrated;
 };
 
-void page_allocator_init(SmallVec<PageRegion, 1024> &regions) {
-  // TODO: improve allocator to support non 2^n regions
-  // find the largest region that is below 4G
-  u64 max_pages = 0;
-  u64 max_pages_addr = 0;
-  for (u64 i = 0; i < regions.size(); i++) {
-    u64 n_pages = regions[i].size / PAGE_SIZE;
-    if (n_pages > max_pages && regions[i].phy_start < 0x100000000UL) {
-      max_pages = n_pages;
-      max_pages_addr = regions[i].phy_start;
+static CompactStats compact_stats;
+
+// returns false if the window has a block that cannot move, *movable is the number of movable pages
+static bool window_movable_locked(BuddyAllocator &region, u64 pfn, u64 order, u64 *movable) {
+  *movable = 0;
+  for (u64 p = pfn; p < pfn + (1UL << order); ) {
+    auto page = region.pfn_to_page(p);
+    if (page->flags & PageFree) {
+      p += 1UL << page->order;
+    } else if ((page->flags & PageMovable) && page->order == 0) {
+      (*movable)++;
+      p++;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Migrates the movable pages of the window to pages outside of it and frees them to the buddy allocator,
+// returns false if a page could not be moved.
+static bool compact_window(BuddyAllocator &region, u64 pfn, u64 order) {
+  const auto window_end = pfn + (1UL << order);
+  // free pages of the window handed out as migration targets, they are freed at the end
+  Page *rejected = nullptr;
+  bool ok = true;
+  for (u64 p = pfn; ok && p < window_end; ) {
+    auto flags = page_lock.lock_irqsave();
+    auto page = region.pfn_to_page(p);
+    if (page->flags & PageFree) {
+      p += 1UL << page->order;
+      page_lock.unlock_irqrestore(flags);
+      continue;
+    }
+    if (!(page->flags & PageMovable)) {
+      page_lock.unlock_irqrestore(flags);
+      ok = false;
+      break;
+    }
+    u64 target;
+    while ((target = zone_allocate_pages_locked(Log2MinSize, 0))) {
+      auto target_pfn = target / PAGE_SIZE;
+      if (!region.contains(target_pfn) || target_pfn < pfn || target_pfn >= window_end) {
+        break;
+      }
+      auto target_page = region.pfn_to_page(target_pfn);
+      target_page->next = rejected;
+      rejected = target_page;
+    }
+    page_lock.unlock_irqrestore(flags);
+    if (!target) {
+      ok = false;
+      break;
     }
+
+    ok = migrate_page(p * PAGE_SIZE, target);
+    auto source = ok ? page : phy_to_page(target);
+    auto source_region = ok ? &region : find_region(target / PAGE_SIZE);
+    flags = page_lock.lock_irqsave();
+    source_region->free_block(source);
+    page_lock.unlock_irqrestore(flags);
+    if (ok) {
+      __atomic_add_fetch(&compact_stats.migrated, 1, __ATOMIC_RELAXED);
+      p++;
+    }
+  }
+
+  auto flags = page_lock.lock_irqsave();
+  while (rejected) {
+    auto page = rejected;
+    rejected = page->next;
+    page->next = nullptr;
+    region.free_block(page);
   }
+  page_lock.unlock_irqrestore(flags);
+  return ok;
+}
 
-  if (max_pages_addr < IDENTITY_MAP_PHY_START) {
-    auto unusable = IDENTITY_MAP_PHY_START - max_pages_addr;
-    max_pages_addr = IDENTITY_MAP_PHY_START;
-    max_pages -= unusable/PAGE_SIZE;
+static bool compact_zone(Zone &zone, u64 order) {
+  if (zone.free_pages() < 1UL << order) {
+    return false;
   }
-  // TODO: use the rest of the memory space
-  // we can only use 1G for buddy allocator because we need identity mapping
-  // but we only map the first 4G
-  // some iomem is at 0x7xxxxxxx and 0xcxxxxxxx so we only have about 1G continuous identity mapped memory
-  // 1. We need a iomem manager
-  // 2. We need
-  if (max_pages > (1UL*1024UL*1024UL*1024UL)/PAGE_SIZE) {
-    max_pages = (1UL*1024UL*1024UL*1024UL)/PAGE_SIZE;
+  u64 windows = 0;
+  for (size_t i = 0; i < zone.regions.size(); i++) {
+    auto &region = zone.regions[i];
+    auto size = 1UL << order;
+    for (u64 pfn = (region.start_pfn + size - 1) & ~(size - 1); pfn + size <= region.end_pfn; pfn += size) {
+      u64 movable;
+      auto flags = page_lock.lock_irqsave();
+      bool usable = window_movable_locked(region, pfn, order, &movable);
+      page_lock.unlock_irqrestore(flags);
+      if (!usable || movable == 0) {
+        continue;
+      }
+      if (compact_window(region, pfn, order)) {
+        return true;
+      }
+      if (++windows == CompactMaxWindows) {
+        return false;
+      }
+    }
   }
-  auto log2size = log2(max_pages*PAGE_SIZE);
+  return false;
+}
 
-  Kernel::sp() << IntRadix::Hex << "max_pages_addr: " << max_pages_addr  << ", max_pages " << max_pages << "\n";
+// Compaction waits for TLB shootdowns, it cannot run with interrupts disabled
+// or in an interrupt handler or syscall.
+static bool can_compact() {
+  return irqs_enabled() && this_cpu()->irq_depth == 0;
+}
 
-  assert(max_pages_addr >= IDENTITY_MAP_PHY_START, "region out of identity map region");
-  assert(max_pages_addr+(1UL<<log2size) <= IDENTITY_MAP_PHY_END, "region out of identity map region");
-  buddy_allocator_init(max_pages_addr, log2size);
+// returns true if a free block of order was built in a zone allowed by flags
+static bool compact(u64 order, u32 flags) {
+  bool ok = (!(flags & PageAllocDMA32) && compact_zone(zones[ZoneNormal], order))
+      || compact_zone(zones[ZoneDMA32], order);
+  __atomic_add_fetch(ok ? &compact_stats.success : &compact_stats.fail, 1, __ATOMIC_RELAXED);
+  return ok;
 }
 
-void *kernel_page_alloc(u64 i) {
-  auto phy_addr = buddy_allocator->allocate_pages(i);
-  return (void*)(KERNEL_START + phy_addr);
+static u64 zone_allocate_pages(u64 i, u32 flags) {
+  if ((flags & PageAllocZero) && i == Log2MinSize && !(flags & PageAllocDMA32)) {
+    if (auto addr = zero_pool_alloc()) {
+      return addr;
+    }
+  }
+  auto addr = zone_allocate_block(i, flags);
+  if (addr == 0 && !(flags & PageAllocNoReclaim) && zero_pool_release()) {
+    addr = zone_allocate_block(i, flags);
+  }
+  if (addr == 0 && i > Log2MinSize && !(flags & PageAllocNoReclaim) && can_compact()
+      && compact(i - Log2MinSize, flags)) {
+    addr = zone_allocate_block(i, flags);
+  }
+  if (addr && (flags & PageAllocZero)) {
+    memset(phy2virt(addr), 0, 1UL << i);
+  }
+  return addr;
+}
+
+void *kernel_page_alloc(u64 i, u32 flags) {
+  auto phy_addr = zone_allocate_pages(i, flags);
+  if (phy_addr == 0) {
+    return nullptr;
+  }
+  return phy2virt(phy_addr);
 }
 
 void kernel_page_free(void *vaddr) {
-  buddy_allocator->free_pages((u64)vaddr - KERNEL_START);
+  physical_page_release(kernel2phy((u64)vaddr));
 }
 
-u64 physical_page_alloc(u64 i) {
-  return buddy_allocator->allocate_pages(i);
+u64 physical_page_alloc(u64 i, u32 flags) {
+  return zone_allocate_pages(i, flags);
 }
 
 void physical_page_release(u64 paddr) {
-  buddy_allocator->free_pages(paddr);
+  assert(paddr % PAGE_SIZE == 0, "Failed to free pages, addr is not aligned");
+  auto region = find_region(paddr / PAGE_SIZE);
+  assert(region != nullptr, "Failed to free pages, addr not managed by the page allocator");
+  auto block = region->pfn_to_page(paddr / PAGE_SIZE);
+  assert((block->flags & PageAllocated) && !(block->flags & (PageMagazine | PageZeroPool)), "Cannot free pages that are not allocated");
+  assert(!(block->flags & PageMovable), "Cannot free pages that are still mapped");
+
+  if (block->order < MagazineOrders) {
+    auto flags = irq_save();
+    auto &cpu_mags = magazines[this_cpu()->id];
+    auto &m = cpu_mags.mags[zone_of(paddr)][block->order];
+    cpu_mags.lock.lock();
+    block->refcount = 0;
+    magazine_push(m, block, region);
+    auto batch = magazine_batch(block->order);
+    if (m.count > batch * MagazineHighBatches) {
+      page_lock.lock();
+      magazine_drain_locked(m, batch);
+      page_lock.unlock();
+    }
+    cpu_mags.lock.unlock();
+    irq_restore(flags);
+    return;
+  }
+
+  auto flags = page_lock.lock_irqsave();
+  region->free_block(block);
+  page_lock.unlock_irqrestore(flags);
+}
+
+Page *phy_to_page(u64 paddr) {
+  auto pfn = paddr / PAGE_SIZE;
+  auto region = find_region(pfn);
+  if (!region) {
+    return nullptr;
+  }
+  return region->pfn_to_page(pfn);
+}
+
+u64 page_to_phy(const Page *page) {
+  for (auto &zone : zones) {
+    for (size_t i = 0; i < zone.regions.size(); i++) {
+      auto &region = zone.regions[i];
+      if (page >= region.pages && page < region.pages + (region.end_pfn - region.start_pfn)) {
+        return region.page_to_pfn(page) * PAGE_SIZE;
+      }
+    }
+  }
+  Kernel::k->panic("page_to_phy() on a page not managed by the page allocator");
+  return 0;
+}
+
+// returns nullptr for pages not managed by the page allocator
+static Page *allocated_page(u64 paddr) {
+  auto page = phy_to_page(paddr);
+  assert(page == nullptr || ((page->flags & PageAllocated) && !(page->flags & (PageMagazine | PageZeroPool))), "page is not allocated");
+  return page;
 }
-void kfree(void *p) {
-  kernel_page_free(p);
+
+// the refcount of an allocated block only changes through its users, no lock is needed
+void get_page(u64 paddr) {
+  if (auto page = allocated_page(paddr)) {
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+  }
 }
-void *kmalloc(size_t size) {
-  auto log2size = log2_ceil(size);
-  if (log2size < Log2MinSize) {
-    log2size = Log2MinSize;
+
+void put_page(u64 paddr) {
+  auto page = allocated_page(paddr);
+  if (page) {
+    auto refcount = __atomic_fetch_sub(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    assert(refcount > 0, "put_page() on a free page");
+    if (refcount == 1) {
+      physical_page_release(paddr);
+    }
   }
-  return kernel_page_alloc(log2size);
+}
+
+bool page_exclusive(u64 paddr) {
+  auto page = allocated_page(paddr);
+  return page && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1;
 }
 
 void buddy_allocator_usage() {
-  buddy_allocator->print_usage();
-}
\ No newline at end of file
+  auto flags = page_lock.lock_irqsave();
+  for (auto &zone : zones) {
+    zone.print();
+    for (size_t i = 0; i < zone.regions.size(); i++) {
+      zone.regions[i].print_usage();
+    }
+  }
+  // the counts of other cpus may be stale, their magazines are not locked
+  for (u64 cpu = 0; cpu < n_cpus; cpu++) {
+    Kernel::sp() << "  cpu " << IntRadix::Dec << cpu << " magazine blocks";
+    for (auto &zone_mags : magazines[cpu].mags) {
+      for (auto &m : zone_mags) {
+        Kernel::sp() << " " << m.count;
+      }
+    }
+    Kernel::sp() << "\n";
+  }
+  page_lock.unlock_irqrestore(flags);
+  Kernel::sp() << "  zero pool pages " << IntRadix::Dec << zero_pool.count << " hits " << zero_pool.hits
+               << " misses " << zero_pool.misses << "\n";
+  Kernel::sp() << "  compaction success " << compact_stats.success << " fail " << compact_stats.fail
+               << " migrated pages " << compact_stats.migrated << "\n";
+  slab_allocator_usage();
+}
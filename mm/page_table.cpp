@@ -0,0 +1,323 @@
+#include <cpu_defs.h>
+#include <cpu_utils.h>
+#include <kernel.h>
+#include <lib/string.h>
+#include <mm/mm.h>
+#include <mm/page_alloc.h>
+#include <mm/page_table.h>
+#include <percpu.h>
+#include <smp.h>
+
+// PAT entries, indexed by CacheMode
+// PA0 WB, PA1 WC, PA2 UC-, PA3 UC, PA4 WB, PA5 WT, PA6 UC-, PA7 UC
+constexpr u8 PatWriteBack = 6;
+constexpr u8 PatWriteCombining = 1;
+constexpr u8 PatUncachedMinus = 7;
+constexpr u8 PatUncached = 0;
+constexpr u8 PatWriteThrough = 4;
+constexpr u8 PatEntries[8] = {
+    PatWriteBack, PatWriteCombining, PatUncachedMinus, PatUncached,
+    PatWriteBack, PatWriteThrough, PatUncachedMinus, PatUncached,
+};
+
+static const char *mtrr_type_name(u64 type) {
+  switch (type) {
+    case 0: return "UC";
+    case 1: return "WC";
+    case 4: return "WT";
+    case 5: return "WP";
+    case 6: return "WB";
+    default: return "??";
+  }
+}
+
+static void mtrr_dump() {
+  auto cap = get_msr(MTRR_CAP_MSR);
+  auto def_type = get_msr(MTRR_DEF_TYPE_MSR);
+  auto n_variable = cap & 0xff;
+  Kernel::sp() << "MTRR: " << IntRadix::Dec << n_variable << " variable ranges"
+               << ((cap & (1 << 10)) ? ", WC supported" : "")
+               << ", enabled " << ((def_type >> 11) & 1)
+               << ", default type " << mtrr_type_name(def_type & 0xff) << "\n";
+  for (u64 i = 0; i < n_variable; i++) {
+    auto base = get_msr(MTRR_PHYS_BASE_MSR(i));
+    auto mask = get_msr(MTRR_PHYS_MASK_MSR(i));
+    if (!(mask & (1 << 11))) {
+      continue;
+    }
+    Kernel::sp() << "  MTRR" << IntRadix::Dec << i << " base 0x" << IntRadix::Hex << (base & ~0xfffUL)
+                 << " mask 0x" << (mask & ~0xfffUL) << " " << mtrr_type_name(base & 0xff) << "\n";
+  }
+}
+
+bool mtrr_range_uniform(u64 start, u64 size) {
+  auto def_type = get_msr(MTRR_DEF_TYPE_MSR);
+  if (!(def_type & (1 << 11))) {
+    // MTRRs disabled, all memory is UC
+    return true;
+  }
+  if (start < 0x100000 && (def_type & (1 << 10))) {
+    // the fixed range MTRRs split the first 1M
+    return false;
+  }
+  auto n_variable = get_msr(MTRR_CAP_MSR) & 0xff;
+  for (u64 i = 0; i < n_variable; i++) {
+    auto base = get_msr(MTRR_PHYS_BASE_MSR(i)) & ~0xfffUL;
+    auto mask = get_msr(MTRR_PHYS_MASK_MSR(i));
+    if (!(mask & (1 << 11))) {
+      continue;
+    }
+    mask &= ~0xfffUL;
+    // the range matches none of [start, start+size) or all of it unless its mask has bits inside
+    auto high = mask & ~(size - 1);
+    if ((start & high) == (base & high) && (mask & (size - 1))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void pat_cpu_init() {
+  u64 pat = 0;
+  for (u64 i = 0; i < 8; i++) {
+    pat |= (u64)PatEntries[i] << (i * 8);
+  }
+  // no mapping uses PA1 or PA4 ~ PA7 yet, so it is safe to change them
+  asm volatile("wbinvd" ::: "memory");
+  set_msr(PAT_MSR, pat);
+  flush_tlb();
+}
+
+void pat_init() {
+  pat_cpu_init();
+  Kernel::sp() << "PAT = 0x" << IntRadix::Hex << get_msr(PAT_MSR) << "\n";
+
+  mtrr_dump();
+}
+
+bool pcid_enabled = false;
+
+constexpr u64 Cr3NoFlush = 1UL << 63;
+constexpr u64 MaxPcid = 4096;
+// owner of the TLB entries tagged with each PCID on a cpu, PCID 0 is left to the kernel page table
+static PER_CPU const void *pcid_owner[MaxPcid];
+
+static u64 asid_to_pcid(u64 asid) {
+  return asid % (MaxPcid - 1) + 1;
+}
+
+u64 address_space_cr3(u64 pml4t_paddr, u64 asid, const void *owner, bool migrated) {
+  if (!pcid_enabled) {
+    return pml4t_paddr;
+  }
+  auto pcid = asid_to_pcid(asid);
+  auto &pcid_owners = per_cpu(pcid_owner);
+  if (pcid_owners[pcid] == owner && !migrated) {
+    return pml4t_paddr | pcid | Cr3NoFlush;
+  }
+  pcid_owners[pcid] = owner;
+  return pml4t_paddr | pcid;
+}
+
+void address_space_release(u64 asid, const void *owner) {
+  auto pcid = asid_to_pcid(asid);
+  for (u64 i = 0; i < n_cpus; i++) {
+    auto &pcid_owners = per_cpu(pcid_owner, cpus[i]);
+    if (pcid_owners[pcid] == owner) {
+      pcid_owners[pcid] = nullptr;
+    }
+  }
+}
+
+// returns the next level table of entry, allocates it when alloc is true
+template <typename Entry, typename Table>
+static Table *next_table(Entry &entry, bool alloc, bool user) {
+  if (!entry.p) {
+    if (!alloc) {
+      return nullptr;
+    }
+    auto table = kernel_page_alloc(Log2MinSize, PageAllocZero);
+    if (!table) {
+      Kernel::k->panic("Out of memory for page tables");
+    }
+    entry.p = 1;
+    entry.rw = 1;
+    entry.base_addr = kernel2phy((u64)table) >> 12;
+  }
+  if (user) {
+    entry.us = 1;
+  }
+  assert(!((HugePageEntry&)entry).ps, "page table walk hits a huge page");
+  return (Table*)phy2virt(entry.base_addr << 12);
+}
+
+static u64 table_index(u64 vaddr, u64 level) {
+  return (vaddr >> (12 + 9 * level)) & (PAGES_PER_TABLE - 1);
+}
+
+HugePageEntry *page_table_walk_pde(PageMappingL4Entry *pml4t, u64 vaddr, bool alloc, bool user) {
+  auto pdpt = next_table<PageMappingL4Entry, PageDirectoryPointerEntry>(pml4t[table_index(vaddr, 3)], alloc, user);
+  if (!pdpt) {
+    return nullptr;
+  }
+  auto pdt = next_table<PageDirectoryPointerEntry, PageDirectoryEntry>(pdpt[table_index(vaddr, 2)], alloc, user);
+  if (!pdt) {
+    return nullptr;
+  }
+  return (HugePageEntry*)&pdt[table_index(vaddr, 1)];
+}
+
+PageTableEntry *page_table_walk(PageMappingL4Entry *pml4t, u64 vaddr, bool alloc, bool user) {
+  auto pde = (PageDirectoryEntry*)page_table_walk_pde(pml4t, vaddr, alloc, user);
+  if (!pde) {
+    return nullptr;
+  }
+  auto pt = next_table<PageDirectoryEntry, PageTableEntry>(*pde, alloc, user);
+  if (!pt) {
+    return nullptr;
+  }
+  return &pt[table_index(vaddr, 0)];
+}
+
+u64 page_table_translate(const PageMappingL4Entry *pml4t, u64 vaddr) {
+  auto table = (const u64*)pml4t;
+  for (int level = 3; level >= 0; level--) {
+    auto entry = table[table_index(vaddr, level)];
+    if (!(entry & 1)) {
+      return 0;
+    }
+    auto addr = entry & 0x000ffffffffff000UL;
+    if (level == 0 || ((entry & 0x80) && level <= 2)) {
+      // 4K page, or 2M / 1G page whose PAT bit is bit 12
+      auto page_mask = (1UL << (12 + 9 * level)) - 1;
+      return (addr & ~page_mask) | (vaddr & page_mask);
+    }
+    table = (const u64*)phy2virt(addr);
+  }
+  return 0;
+}
+
+void copy_kernel_page_table(PageMappingL4Entry *pml4t) {
+  auto kernel = kernel_pml4t();
+  for (u64 i = PAGES_PER_TABLE / 2; i < PAGES_PER_TABLE; i++) {
+    pml4t[i] = kernel[i];
+  }
+}
+
+// frees table and all the tables below it, level 0 is a page table
+static void free_table(u64 table_phy, int level) {
+  auto table = (u64*)phy2virt(table_phy);
+  if (level > 0) {
+    for (u64 i = 0; i < PAGES_PER_TABLE; i++) {
+      // huge pages are not used in user space
+      if (table[i] & 1) {
+        free_table(table[i] & 0x000ffffffffff000UL, level - 1);
+      }
+    }
+  }
+  kernel_page_free(table);
+}
+
+void free_user_page_tables(PageMappingL4Entry *pml4t) {
+  for (u64 i = 0; i < PAGES_PER_TABLE / 2; i++) {
+    if (pml4t[i].p) {
+      free_table(pml4t[i].base_addr << 12, 2);
+    }
+  }
+  memset(pml4t, 0, PAGES_PER_TABLE / 2 * sizeof(pml4t[0]));
+}
+
+void kernel_map_pages(u64 vaddr, u64 paddr, u64 size, CacheMode mode) {
+  assert(vaddr % PAGE_SIZE == 0 && paddr % PAGE_SIZE == 0 && size % PAGE_SIZE == 0, "kernel_map_pages() not page aligned");
+  auto pml4t = kernel_pml4t();
+  u64 offset = 0;
+  while (offset < size) {
+    auto v = vaddr + offset;
+    auto p = paddr + offset;
+    if (v % PageSize2M == 0 && p % PageSize2M == 0 && size - offset >= PageSize2M) {
+      auto pde = page_table_walk_pde(pml4t, v, true, false);
+      assert(!pde->p, "kernel_map_pages() remaps a page");
+      pde->base_addr = p >> 12;
+      pde->p = 1;
+      pde->rw = 1;
+      pde->ps = 1;
+      pde->nx = nx_enabled;
+      set_cache_mode(*pde, mode);
+      offset += PageSize2M;
+    } else {
+      auto pte = page_table_walk(pml4t, v, true, false);
+      assert(!pte->p, "kernel_map_pages() remaps a page");
+      pte->base_addr = p >> 12;
+      pte->p = 1;
+      pte->rw = 1;
+      pte->nx = nx_enabled;
+      set_cache_mode(*pte, mode);
+      offset += PAGE_SIZE;
+    }
+  }
+}
+
+// clears the entries mapping [vaddr, vaddr+size) and flushes them from the TLB of the current cpu
+static void clear_kernel_pages(u64 vaddr, u64 size) {
+  auto pml4t = kernel_pml4t();
+  u64 offset = 0;
+  while (offset < size) {
+    auto v = vaddr + offset;
+    auto pde = page_table_walk_pde(pml4t, v, false, false);
+    assert(pde != nullptr && pde->p, "kernel_unmap_pages() on unmapped address");
+    if (pde->ps) {
+      assert(v % PageSize2M == 0 && size - offset >= PageSize2M, "kernel_unmap_pages() splits a 2M page");
+      memset(pde, 0, sizeof(*pde));
+      offset += PageSize2M;
+    } else {
+      auto pte = page_table_walk(pml4t, v, false, false);
+      memset(pte, 0, sizeof(*pte));
+      offset += PAGE_SIZE;
+    }
+    invlpg(v);
+  }
+  // invlpg only flushes the current PCID, other address spaces flush on their next switch
+  for (u64 i = 0; i < n_cpus; i++) {
+    memset(per_cpu(pcid_owner, cpus[i]), 0, sizeof(pcid_owner));
+  }
+}
+
+void kernel_unmap_pages(u64 vaddr, u64 size) {
+  clear_kernel_pages(vaddr, size);
+  tlb_shootdown();
+}
+
+u64 kernel_clear_pages(u64 vaddr, u64 size) {
+  clear_kernel_pages(vaddr, size);
+  auto pml4t = kernel_pml4t();
+  u64 tables = 0;
+  for (u64 v = vaddr & ~(PageSize2M - 1); v < vaddr + size; v += PageSize2M) {
+    auto pde = page_table_walk_pde(pml4t, v, false, false);
+    if (!pde || !pde->p || pde->ps) {
+      continue;
+    }
+    auto table = (u64*)phy2virt(pde->base_addr << 12);
+    u64 i = 0;
+    while (i < PAGES_PER_TABLE && table[i] == 0) {
+      i++;
+    }
+    if (i < PAGES_PER_TABLE) {
+      continue;
+    }
+    // the link has bit 0 clear, walks through a stale cached PDE still see a not present entry
+    table[0] = tables;
+    tables = pde->base_addr << 12;
+    memset(pde, 0, sizeof(*pde));
+    invlpg(v);
+  }
+  return tables;
+}
+
+void free_page_tables(u64 tables) {
+  while (tables) {
+    auto table = (u64*)phy2virt(tables);
+    tables = table[0];
+    table[0] = 0;
+    kernel_page_free(table);
+  }
+}
@@ -0,0 +1,267 @@
+#include <cpu_defs.h>
+#include <kernel.h>
+#include <lib/file_size.h>
+#include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/mm.h>
+#include <mm/page_alloc.h>
+#include <mm/slab.h>
+
+// Every slab is one page allocator block, the Slab header lives at the start of the block.
+// All pages of the block are marked PageSlab with Page::owner pointing to the header,
+// which is how kfree() finds the cache of an object.
+// A slab is sized to hold about SlabTargetObjects objects, at least one page.
+constexpr u64 SlabTargetObjects = 8;
+constexpr u64 SlabMagic = 0x51ab51ab51ab51abUL;
+
+struct Slab {
+  u64 magic;
+  KmemCache *cache;
+  Slab *prev;
+  Slab *next;
+  // singly linked list threaded through the free objects
+  void *free_list;
+  size_t in_use;
+};
+
+static void list_add(SlabList &list, Slab *slab) {
+  slab->prev = nullptr;
+  slab->next = list.head;
+  if (list.head) {
+    list.head->prev = slab;
+  }
+  list.head = slab;
+  list.count++;
+}
+
+static void list_remove(SlabList &list, Slab *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    list.head = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->prev = nullptr;
+  slab->next = nullptr;
+  list.count--;
+}
+
+KmemCache::KmemCache(const char *name, size_t object_size) :name_(name), object_size_(object_size) {
+  assert(object_size >= sizeof(void*), "slab object too small to hold the free list pointer");
+
+  // objects are naturally aligned up to a page, callers used to get page aligned memory from kmalloc
+  auto align = object_size < PAGE_SIZE ? (1UL << log2_ceil(object_size)) : PAGE_SIZE;
+  first_object_offset_ = (sizeof(Slab) + align - 1) / align * align;
+  slab_log2size_ = log2_ceil(object_size * SlabTargetObjects);
+  if (slab_log2size_ < Log2MinSize) {
+    slab_log2size_ = Log2MinSize;
+  }
+  objects_per_slab_ = ((1UL << slab_log2size_) - first_object_offset_) / object_size;
+  assert(objects_per_slab_ > 0, "slab object too big");
+}
+
+Slab *KmemCache::slab_of(void *p) {
+  auto page = phy_to_page(kernel2phy((u64)p));
+  assert(page && (page->flags & PageSlab), "pointer does not belong to a slab");
+  auto slab = (Slab*)page->owner;
+  assert(slab->magic == SlabMagic, "corrupted slab header");
+  return slab;
+}
+
+Slab *KmemCache::create_slab() {
+  auto mem = (char*)kernel_page_alloc(slab_log2size_);
+  if (!mem) {
+    return nullptr;
+  }
+
+  auto slab = (Slab*)mem;
+  auto page = phy_to_page(kernel2phy((u64)mem));
+  for (u64 i = 0; i < (1UL << (slab_log2size_ - Log2MinSize)); i++) {
+    page[i].flags |= PageSlab;
+    page[i].owner = slab;
+  }
+
+  slab->magic = SlabMagic;
+  slab->cache = this;
+  slab->prev = nullptr;
+  slab->next = nullptr;
+  slab->in_use = 0;
+  slab->free_list = nullptr;
+
+  // build the free list backwards so that objects are handed out in address order
+  for (size_t i = objects_per_slab_; i > 0; i--) {
+    auto obj = mem + first_object_offset_ + (i - 1) * object_size_;
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+  }
+
+  slabs_created++;
+  return slab;
+}
+
+void KmemCache::destroy_slab(Slab *slab) {
+  assert(slab->in_use == 0, "destroying a slab in use");
+  slab->magic = 0;
+  auto page = phy_to_page(kernel2phy((u64)slab));
+  for (u64 i = 0; i < (1UL << (slab_log2size_ - Log2MinSize)); i++) {
+    page[i].flags &= ~PageSlab;
+    page[i].owner = nullptr;
+  }
+  kernel_page_free(slab);
+  slabs_destroyed++;
+}
+
+void *KmemCache::alloc() {
+  auto flags = lock_.lock_irqsave();
+  auto obj = alloc_locked();
+  lock_.unlock_irqrestore(flags);
+  return obj;
+}
+
+void KmemCache::free(void *p) {
+  auto flags = lock_.lock_irqsave();
+  free_locked(p);
+  lock_.unlock_irqrestore(flags);
+}
+
+void *KmemCache::alloc_locked() {
+  Slab *slab = partial_.head;
+  if (!slab) {
+    if (empty_) {
+      slab = empty_;
+      empty_ = nullptr;
+    } else {
+      slab = create_slab();
+      if (!slab) {
+        return nullptr;
+      }
+    }
+    list_add(partial_, slab);
+  }
+
+  auto obj = slab->free_list;
+  slab->free_list = *(void**)obj;
+  slab->in_use++;
+  if (slab->in_use == objects_per_slab_) {
+    list_remove(partial_, slab);
+    list_add(full_, slab);
+  }
+
+  allocated_objects++;
+  total_allocs++;
+  return obj;
+}
+
+void KmemCache::free_locked(void *p) {
+  auto slab = slab_of(p);
+  assert(slab->cache == this, "object freed to the wrong cache");
+  assert(slab->in_use > 0, "double free on slab");
+
+  if (slab->in_use == objects_per_slab_) {
+    list_remove(full_, slab);
+    list_add(partial_, slab);
+  }
+
+  *(void**)p = slab->free_list;
+  slab->free_list = p;
+  slab->in_use--;
+
+  if (slab->in_use == 0) {
+    list_remove(partial_, slab);
+    if (!empty_) {
+      empty_ = slab;
+    } else {
+      destroy_slab(slab);
+    }
+  }
+
+  allocated_objects--;
+  total_frees++;
+}
+
+void KmemCache::print_usage() const {
+  auto slabs = partial_.count + full_.count + (empty_ ? 1 : 0);
+  Kernel::sp() << "  " << name_ << " slabs " << IntRadix::Dec << slabs
+               << " (partial " << partial_.count << " full " << full_.count << ")"
+               << " objects " << allocated_objects << "/" << slabs * objects_per_slab_ << " ";
+  print_file_size(allocated_objects * object_size_);
+  Kernel::sp() << " allocs " << total_allocs << " frees " << total_frees
+               << " slabs created " << slabs_created << " destroyed " << slabs_destroyed << "\n";
+}
+
+static const char *kmalloc_cache_names[SlabSizeClasses] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512",
+    "kmalloc-1k", "kmalloc-2k", "kmalloc-4k", "kmalloc-8k", "kmalloc-16k", "kmalloc-32k",
+};
+
+static KmemCache kmalloc_caches[SlabSizeClasses];
+static bool slab_initialized = false;
+
+// large allocations bypass the slabs, the counters are updated atomically without a lock
+static size_t large_allocs = 0;
+static size_t large_frees = 0;
+
+void slab_init() {
+  for (u64 i = 0; i < SlabSizeClasses; i++) {
+    new(&kmalloc_caches[i]) KmemCache(kmalloc_cache_names[i], 1UL << (Log2MinSlabObjectSize + i));
+  }
+  slab_initialized = true;
+
+  // test slab allocator
+  auto p1 = kmalloc(24);
+  auto p2 = kmalloc(24);
+  auto p3 = kmalloc(100 * 1024);
+  assert(p1 && p2 && p3, "Slab allocator test failed, out of memory");
+  assert(KmemCache::slab_of(p1) == KmemCache::slab_of(p2), "Slab allocator test failed, objects in different slabs");
+  assert(((u64)p3 & (PAGE_SIZE - 1)) == 0, "Slab allocator test failed, large allocation not aligned");
+  assert(!(phy_to_page(kernel2phy((u64)p3))->flags & PageSlab), "Slab allocator test failed, large allocation in slab");
+  kfree(p1);
+  kfree(p2);
+  kfree(p3);
+  assert(kmalloc_caches[log2_ceil(24) - Log2MinSlabObjectSize].allocated_objects == 0, "Slab allocator test failed, leaking objects");
+  Kernel::sp() << "Slab allocator test passed\n";
+}
+
+void slab_allocator_usage() {
+  Kernel::sp() << "Slab allocator usage:\n";
+  for (auto &cache : kmalloc_caches) {
+    cache.print_usage();
+  }
+  Kernel::sp() << "  large allocations " << IntRadix::Dec << (large_allocs - large_frees)
+               << " allocs " << large_allocs << " frees " << large_frees << "\n";
+}
+
+void *kmalloc(size_t size) {
+  assert(slab_initialized, "kmalloc() called before slab_init()");
+
+  auto log2size = log2_ceil(size == 0 ? 1 : size);
+  if (log2size > Log2MaxSlabObjectSize) {
+    auto ret = kernel_page_alloc(log2size);
+    if (ret) {
+      __atomic_add_fetch(&large_allocs, 1, __ATOMIC_RELAXED);
+    }
+    return ret;
+  }
+
+  if (log2size < Log2MinSlabObjectSize) {
+    log2size = Log2MinSlabObjectSize;
+  }
+  return kmalloc_caches[log2size - Log2MinSlabObjectSize].alloc();
+}
+
+void kfree(void *p) {
+  if (!p) {
+    return;
+  }
+
+  auto page = phy_to_page(kernel2phy((u64)p));
+  assert(page != nullptr, "kfree() on memory not managed by the page allocator");
+  if (page->flags & PageSlab) {
+    ((Slab*)page->owner)->cache->free(p);
+  } else {
+    __atomic_add_fetch(&large_frees, 1, __ATOMIC_RELAXED);
+    kernel_page_free(p);
+  }
+}
@@ -0,0 +1,199 @@
+#include <cpu_defs.h>
+#include <kernel.h>
+#include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/page_alloc.h>
+#include <mm/page_table.h>
+#include <mm/vmalloc.h>
+#include <smp.h>
+#include <common/kmemory.hpp>
+#include <common/kspinlock.hpp>
+
+// A vmalloc buffer, the areas are sorted by address and each one is followed by an unmapped guard page.
+struct VmArea {
+  u64 start;
+  u64 size;
+  VmArea *next;
+};
+
+static VmArea *areas;
+// protects areas and the kernel page tables of the region
+static kspinlock vmalloc_lock;
+
+// First fit, buffers of 2M or more start 2M aligned so that they can use 2M pages.
+// Returns 0 if the region is full, *link is where the area goes in the list.
+static u64 find_space_locked(u64 size, VmArea **&link) {
+  auto align = size >= PageSize2M ? PageSize2M : PAGE_SIZE;
+  u64 start = KMALLOC_START;
+  link = &areas;
+  for (auto a = areas; a; a = a->next) {
+    start = (start + align - 1) & ~(align - 1);
+    if (start + size + PAGE_SIZE <= a->start) {
+      return start;
+    }
+    start = a->start + a->size + PAGE_SIZE;
+    link = &a->next;
+  }
+  start = (start + align - 1) & ~(align - 1);
+  if (start + size + PAGE_SIZE > KMALLOC_START + KMALLOC_SIZE) {
+    return 0;
+  }
+  return start;
+}
+
+// Unmaps [start, start+size) and frees its physical blocks, the first page of each block tells its order.
+static void unmap_area(u64 start, u64 size) {
+  // the blocks are linked through Page::next until they are unmapped
+  Page *blocks = nullptr;
+  for (u64 offset = 0; offset < size; ) {
+    auto page = phy_to_page(page_table_translate(kernel_pml4t(), start + offset));
+    assert(page != nullptr && (page->flags & PageAllocated), "vmalloc area maps a page that is not allocated");
+    page->next = blocks;
+    blocks = page;
+    offset += PAGE_SIZE << page->order;
+  }
+
+  if (size > 0) {
+    // tlb_shootdown() waits for other cpus with interrupts disabled, they may be spinning on vmalloc_lock
+    auto flags = vmalloc_lock.lock_irqsave();
+    auto tables = kernel_clear_pages(start, size);
+    vmalloc_lock.unlock_irqrestore(flags);
+    tlb_shootdown();
+    free_page_tables(tables);
+  }
+
+  while (blocks) {
+    auto page = blocks;
+    blocks = page->next;
+    page->next = nullptr;
+    physical_page_release(page_to_phy(page));
+  }
+}
+
+// Maps blocks as large as the alignment of the address, the remaining size and the buddy allocators allow.
+// Returns the number of bytes mapped, less than size if memory ran out.
+static u64 map_area(u64 start, u64 size) {
+  u64 offset = 0;
+  while (offset < size) {
+    auto vaddr = start + offset;
+    auto log2size = min(min(log2(size - offset), (u64)__builtin_ctzl(vaddr)), log2(PageSize2M));
+    // smaller blocks are the fallback, only single pages may reclaim cached ones
+    auto paddr = physical_page_alloc(log2size, log2size > Log2MinSize ? PageAllocNoReclaim : 0);
+    while (!paddr && log2size > Log2MinSize) {
+      log2size--;
+      paddr = physical_page_alloc(log2size, log2size > Log2MinSize ? PageAllocNoReclaim : 0);
+    }
+    if (!paddr) {
+      break;
+    }
+
+    auto flags = vmalloc_lock.lock_irqsave();
+    kernel_map_pages(vaddr, paddr, 1UL << log2size, CacheWriteBack);
+    vmalloc_lock.unlock_irqrestore(flags);
+    offset += 1UL << log2size;
+  }
+  return offset;
+}
+
+static void remove_area(VmArea *area) {
+  auto flags = vmalloc_lock.lock_irqsave();
+  auto link = &areas;
+  while (*link != area) {
+    link = &(*link)->next;
+  }
+  *link = area->next;
+  vmalloc_lock.unlock_irqrestore(flags);
+  kfree(area);
+}
+
+void *vmalloc(u64 size) {
+  size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  if (size == 0 || size > KMALLOC_SIZE) {
+    return nullptr;
+  }
+  auto area = knew<VmArea>();
+  if (!area) {
+    return nullptr;
+  }
+
+  // the area is reserved before it is mapped, so that the lock is not held while allocating pages
+  auto flags = vmalloc_lock.lock_irqsave();
+  VmArea **link;
+  auto start = find_space_locked(size, link);
+  if (start) {
+    area->start = start;
+    area->size = size;
+    area->next = *link;
+    *link = area;
+  }
+  vmalloc_lock.unlock_irqrestore(flags);
+  if (!start) {
+    kfree(area);
+    return nullptr;
+  }
+
+  auto mapped = map_area(start, size);
+  if (mapped < size) {
+    unmap_area(start, mapped);
+    remove_area(area);
+    return nullptr;
+  }
+  return (void*)start;
+}
+
+void vfree(void *addr) {
+  if (!addr) {
+    return;
+  }
+  auto flags = vmalloc_lock.lock_irqsave();
+  auto area = areas;
+  while (area && area->start != (u64)addr) {
+    area = area->next;
+  }
+  vmalloc_lock.unlock_irqrestore(flags);
+  assert(area != nullptr, "vfree() on an address not returned by vmalloc()");
+
+  // the area keeps its range reserved until it is unmapped
+  unmap_area(area->start, area->size);
+  remove_area(area);
+}
+
+// a 4K mapped buffer is freed and its range reused by 2M pages, which needs its page table gone
+static void vmalloc_test() {
+  auto small = (u8*)vmalloc(PAGE_SIZE);
+  bool passed = small != nullptr && (u64)small % PageSize2M == 0;
+  if (small) {
+    small[0] = 1;
+  }
+  vfree(small);
+  auto pde = page_table_walk_pde(kernel_pml4t(), (u64)small, false, false);
+  passed = passed && (!pde || !pde->p);
+
+  auto big = (u8*)vmalloc(PageSize2M);
+  passed = passed && big == small;
+  if (big) {
+    big[0] = 1;
+    big[PageSize2M - 1] = 1;
+  }
+  vfree(big);
+  passed = passed && page_table_translate(kernel_pml4t(), (u64)big) == 0;
+
+  assert(passed, "vmalloc test failed");
+  Kernel::sp() << "vmalloc test passed\n";
+}
+
+void vmalloc_init() {
+  vmalloc_test();
+}
+
+u64 vmalloc_to_phy(const void *vaddr, u64 size, u64 *contiguous) {
+  auto pml4t = kernel_pml4t();
+  auto v = (u64)vaddr;
+  auto paddr = page_table_translate(pml4t, v);
+  u64 n = min(size, PAGE_SIZE - (v & (PAGE_SIZE - 1)));
+  while (n < size && page_table_translate(pml4t, v + n) == paddr + n) {
+    n += min(size - n, PAGE_SIZE);
+  }
+  *contiguous = n;
+  return paddr;
+}
@@ -1,8 +1,13 @@
 #include <net/arp.hpp>
 #include <net/ethernet.hpp>
-#include <process.h>
+#include <workqueue.h>
 #include <common/endian.hpp>
 
+// the gateway address is requested about every 10s, unanswered requests are retried after 1s
+constexpr u64 ArpRequestIntervalTicks = 1000;
+constexpr u64 ArpRetryTicks = 100;
+constexpr int ArpMaxRetries = 3;
+
 void ArpDriver::HandleRx(EthernetAddress dst, EthernetAddress src, u16 protocol, kvector<u8> data) {
   auto packet = reinterpret_cast<ArpPacket*>(data.data());
   // TODO: support other hardware address and protocol address
@@ -24,27 +29,25 @@ void ArpDriver::HandleRx(EthernetAddress dst, EthernetAddress src, u16 protocol,
     return;
   }
 }
-ArpDriver::ArpDriver(EthernetDriver *driver) : eth_driver_(driver) {
-  arp_kthread_id = create_kthread("arp", ArpDriver::ArpThreadStart, this);
+ArpDriver::ArpDriver(EthernetDriver *driver) : eth_driver_(driver) { }
+
+void ArpDriver::RxWork(void *cookie) {
+  ((ArpDriver*)cookie)->handle_rx_queue();
 }
 
-// ARP thread
-//   - consumer of rx_queue and send packet to L2 driver
-//   - request gateway MAC periodically
-void ArpDriver::ArpThreadStart(void *cookie) {
-  auto that = (ArpDriver *)cookie;
-  auto packet = knew<ArpPacket>();
-  size_t i = 0;
+Task<> ArpDriver::gateway_loop() {
   while (true) {
-    // pktqueue consumer
-    that->arp_thread_poll_rx(packet);
-    kyield();
-
-    // TODO: use timer
-    if (i % 10000 == 0) {
-      that->request_gateway_ethernet_address();
+    bool replied = false;
+    for (int i = 0; i <= ArpMaxRetries && !replied; i++) {
+      request_gateway_ethernet_address();
+      replied = co_await gateway_reply_.wait_for(ArpRetryTicks);
+    }
+    if (!replied) {
+      Kernel::sp() << "ARP: no reply from the gateway\n";
     }
-    i++;
+    co_await async_sleep(ArpRequestIntervalTicks);
+    // late replies to the retried requests
+    gateway_reply_.reset();
   }
 }
 
@@ -55,6 +58,7 @@ void ArpDriver::queue_up_mapping(ArpPacket *packet) {
   if (!success) {
     Kernel::sp() << "Warning, ARP rx queue full, dropping new pkt\n";
   }
+  system_wq->queue_work(&rx_work_);
 }
 
 void ArpDriver::handle_request(ArpPacket *packet) {
@@ -76,20 +80,22 @@ void ArpDriver::handle_request(ArpPacket *packet) {
   }
 
 }
-void ArpDriver::arp_thread_poll_rx(ArpPacket *&packet) {
-  // pop to packet with swap and consume the packet
-  auto success = rx_queue_.deq(packet);
-  if (!success) {
-    return;
-  }
+// consumer of rx_queue_, learns the sender mappings and answers requests
+void ArpDriver::handle_rx_queue() {
+  // pop to rx_pkt_ with swap and consume the packet
+  while (rx_queue_.deq(rx_pkt_)) {
+    auto packet = rx_pkt_;
 
 //    Kernel::sp() << "Got ARP!!!!!!!!!!!!!!!!!!!!!!!!!\n";
 //    hexdump((u8*)packet, sizeof(ArpPacket), false, 4);
 
-  put(packet->ethipv4.hw_sender, IPv4Address(packet->ethipv4.proto_sender));
+    put(packet->ethipv4.hw_sender, IPv4Address(packet->ethipv4.proto_sender));
 
-  if (be2cpu(packet->opcode) == ArpOpcodeRequest) {
-    handle_request(packet);
+    if (be2cpu(packet->opcode) == ArpOpcodeRequest) {
+      handle_request(packet);
+    } else if (ip_driver_ && IPv4Address(packet->ethipv4.proto_sender).to_u32() == ip_driver_->gateway_address().to_u32()) {
+      gateway_reply_.signal();
+    }
   }
 }
 void ArpDriver::request_gateway_ethernet_address() {
@@ -0,0 +1,65 @@
+#include <percpu.h>
+#include <cpu_utils.h>
+#include <kernel.h>
+#include <common/kmemory.hpp>
+#include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/page_alloc.h>
+#include <irq.hpp>
+
+extern "C" u8 _PER_CPU_START_[]; // NOLINT(bugprone-reserved-identifier)
+extern "C" u8 _PER_CPU_END_[]; // NOLINT(bugprone-reserved-identifier)
+
+extern SegmentDescriptor kernel_gdt[];
+extern TaskStateSegment tss;
+
+PerCpu *cpus[MaxCpus];
+u64 n_cpus = 0;
+
+static PerCpu boot_cpu;
+
+static u32 cpuid_apic_id() {
+  auto [std_eax, std_ebx, std_ecx, std_edx] = cpuid(1);
+  return std_ebx >> 24;
+}
+
+void percpu_load(PerCpu *cpu) {
+  // gs stays a null selector, only its base is used
+  asm volatile("mov %0, %%gs" : : "r"(0));
+  set_msr(GS_BASE_MSR, (u64)cpu);
+  // the user gs base swapped in by swapgs
+  set_msr(KERNEL_GS_BASE_MSR, 0);
+}
+
+void percpu_init() {
+  auto cpu = &boot_cpu;
+  cpu->self = cpu;
+  cpu->id = 0;
+  cpu->apic_id = cpuid_apic_id();
+  cpu->online = true;
+  cpu->per_cpu_offset = 0;
+  cpu->gdt = kernel_gdt;
+  cpu->tss = &tss;
+  cpu->interrupt_stack_top = interrupt_stack_bottom;
+  cpus[0] = cpu;
+  n_cpus = 1;
+  percpu_load(cpu);
+}
+
+PerCpu *percpu_alloc(u64 id, u32 apic_id) {
+  auto cpu = knew<PerCpu>();
+  assert(cpu != nullptr, "Out of memory for PerCpu");
+  cpu->self = cpu;
+  cpu->id = id;
+  cpu->apic_id = apic_id;
+
+  // a copy of the boot cpu area, so that pointers set up at boot (e.g. the InterruptProcessor) are shared
+  auto size = (u64)(_PER_CPU_END_ - _PER_CPU_START_);
+  if (size > 0) {
+    auto area = (u8*)kernel_page_alloc(log2_ceil(max(size, PAGE_SIZE)));
+    assert(area != nullptr, "Out of memory for per-cpu variables");
+    memcpy(area, _PER_CPU_START_, size);
+    cpu->per_cpu_offset = area - _PER_CPU_START_;
+  }
+  return cpu;
+}
@@ -4,50 +4,71 @@
 #include <lib/utils.h>
 #include <mm/mm.h>
 #include <mm/page_alloc.h>
+#include <mm/page_table.h>
 #include <process.h>
 #include <syscall.h>
 #include <irq.hpp>
 #include <elf.h>
 #include <kernel-abi/syscall_nr.h>
+#include <run_queue.h>
+#include <smp.h>
+#include <wait.h>
+#include <common/kspinlock.hpp>
+
+// Protects the reverse mappings of movable pages and the user page table entries mapping them:
+// page faults, fork and exit hold it while they change mappings, migrate_page() while it moves a page.
+static kspinlock rmap_lock;
+
+// One page is migrated at a time. While migrate_page() waits for other cpus to drop the translation
+// of the page, its entry is not present and marked PteAvlMigrating. A page fault, fork or exit
+// needing the entry meanwhile maps the page again and cancels the migration.
+static bool migration_busy;
+static bool migration_cancelled;
+
+static void cancel_migration(PageTableEntry *pte) {
+  pte->avl &= ~PteAvlMigrating;
+  pte->p = 1;
+  migration_cancelled = true;
+}
 
-u64 current_pid = 0;
-
-u64 next_pid = 1;
-Process *processes[MAX_PROCESS];
+// the page at paddr is only mapped at vaddr of process, compaction may move it
+static void set_movable(u64 paddr, Process *process, u64 vaddr) {
+  auto page = phy_to_page(paddr);
+  page->flags |= PageMovable;
+  page->owner = process;
+  page->index = vaddr;
+}
 
-u64 create_process() {
-  auto pid = next_pid++;
-  // TODO: optimize with low memory consumption
-  auto log2size = log2(sizeof(Process)) + 1;
-  if (log2size < Log2MinSize) {
-    log2size = Log2MinSize;
+// the page at paddr gets another user, or loses its only one
+static void clear_movable(u64 paddr) {
+  auto page = phy_to_page(paddr);
+  if (page && (page->flags & PageMovable)) {
+    page->flags &= ~PageMovable;
+    page->owner = nullptr;
   }
-  auto process_mem = kernel_page_alloc(log2size);
-  auto phy_start = kernel2phy((u64)process_mem);
-  auto process = new(process_mem) Process(pid, phy_start);
-  assert(processes[pid] == nullptr, "Process already created");
-  processes[pid] = process;
-  return pid;
+}
+
+Process *create_process(const kstring &name) {
+  auto process = knew<Process>(alloc_thread_id(), name);
+  start_thread(process);
+  return process;
 }
 
 void test_apic();
 
 void rtl8139_test();
 
-void buddy_allocator_usage();
 void thread2_start(void *) {
   Kernel::sp() << "thread2 started\n";
 
   u64 i = 0;
   while (true) {
-    kyield();
+    sleep_ticks(100);
 //    Kernel::sp() << SerialPort::IntRadix::Hex << "thread2 run " << i << " " << reg_new << "\n";
     i++;
-    if (i % 3000 == 0) {
-      rtl8139_test();
-    }
-    if (i % 5000 == 0) {
-      // TODO: we need lock
+    rtl8139_test();
+    if (i % 2 == 0) {
+      // too verbose to print on every iteration
 //      buddy_allocator_usage();
     }
   }
@@ -59,22 +80,21 @@ extern "C" char _binary_user_init_end[];
 extern "C" char _binary_busybox_start[];
 extern "C" char _binary_busybox_end[];
 
-Process *current() {
-  return processes[current_pid];
-}
+// kernel.ld puts every bundled program on its own pages
+FileImage user_init_image = {
+    "init", (const u8*)_binary_user_init_start, (u64)(_binary_user_init_end - _binary_user_init_start)};
+FileImage busybox_image = {
+    "busybox", (const u8*)_binary_busybox_start, (u64)(_binary_busybox_end - _binary_busybox_start)};
 
 void exec_main() {
-  u64 size = _binary_user_init_end - _binary_user_init_start;
-  char *start = _binary_user_init_start;
-  Kernel::sp() << "init elf size = " << SerialPort::IntRadix::Hex << size << ", start bytes 0x" << (u64)start[0] << " 0x" << (u64)start[1] << "\n";
-
-  u64 busybox_size = _binary_busybox_end - _binary_busybox_start;
-  char *busybox_start = _binary_busybox_start;
-  Kernel::sp() << "busybox elf size = " << SerialPort::IntRadix::Hex << busybox_size << ", start bytes 0x" << (u64)busybox_start[0] << " 0x" << (u64)busybox_start[1] << "\n";
+  for (auto image : {&user_init_image, &busybox_image}) {
+    Kernel::sp() << image->name << " elf size = " << SerialPort::IntRadix::Hex << image->size
+                 << ", start bytes 0x" << (u64)image->data[0] << " 0x" << (u64)image->data[1] << "\n";
+  }
 
-  auto proc = current();
-//  auto start_addr = proc->load_elf_from_buffer(busybox_start, busybox_size);
-  auto start_addr = proc->load_elf_from_buffer(start, size);
+  auto proc = Process::current();
+//  auto start_addr = proc->load_elf(&busybox_image);
+  auto start_addr = proc->load_elf(&user_init_image);
 
   Kernel::sp() << "ELF file loaded\n";
 
@@ -98,27 +118,14 @@ void exec_main() {
   }
 }
 
-u64 create_kthread(const kstring &name, void (*start)(void*), void *cookie) {
-  auto pid = create_process();
-  auto p = processes[pid];
-  p->tmp_start = start;
-  p->name = name;
-  p->cookie = cookie;
-  return pid;
-}
-
 void main_start(void *) {
   cli();
 
   Kernel::sp() << "main process started\n";
 
-  Kernel::sp() << "main process creating process 2\n";
+  Kernel::sp() << "main process creating thread 2\n";
 
-  // maybe user better mechanism to synchronize
-  create_process();
-  auto new_proc = processes[next_pid-1];
-  new_proc->tmp_start = thread2_start;
-  new_proc->name[0] = '2';
+  create_kthread("2", thread2_start, nullptr);
 
   Kernel::sp() << "main process loading\n";
 
@@ -138,159 +145,347 @@ void main_start(void *) {
 }
 
 void process_init() {
-  memset(processes, 0, sizeof(processes));
-  next_pid = 1;
-  current_pid = 1;
-  create_process();
+  Kernel::k->irq_->Register(IRQ_PAGE_FAULT, [](IrqHandlerInfo *info) {
+    auto vaddr = get_cr2();
+    auto process = threads[info->tid]->process;
+    if (vaddr < USER_SPACE_END && process && process->handle_page_fault(vaddr, info->error_code)) {
+      return;
+    }
+    Kernel::sp() << "page fault cr2 = 0x" << IntRadix::Hex << vaddr << " error = 0x" << info->error_code
+                 << " rip = 0x" << info->context->rip << " tid = " << IntRadix::Dec << info->tid << "\n";
+    if (process && (info->error_code & PageFaultUser)) {
+      process->print();
+      Kernel::k->panic("Segmentation fault in user space");
+    }
+    Kernel::k->stack_dump(info->context->rbp);
+    Kernel::k->panic("Page fault in kernel");
+  });
 
-  auto main_process = processes[1];
+  // the kernel returns to the main process without schedule()
+  auto main_process = create_process("main");
   main_process->tmp_start = main_start;
+  set_first_thread(main_process);
 }
 
-void schedule() {
-  processes[current_pid]->state = ProcessState::Wait;
-
-  while (true) {
-    if (current_pid == next_pid) {
-      current_pid = 1;
-    } else {
-      current_pid++;
+void Process::map_user_addr(u64 vaddr, u64 paddr, u64 n_pages) {
+  assert(vaddr + n_pages * PAGE_SIZE <= USER_SPACE_END, "user address out of range");
+  for (u64 i = 0; i < n_pages; i++) {
+    auto pte = page_table_walk(pml4t, vaddr + i * PAGE_SIZE, true, true);
+    pte->p = 1;
+    pte->rw = 1;
+    pte->us = 1;
+    pte->base_addr = (paddr >> 12) + i;
+  }
+}
+VirtualMemoryArea *Process::add_vma(u64 start, u64 end, u32 flags, const char *name) {
+  assert(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0 && end <= USER_SPACE_END, "invalid vma");
+  if (vmas.size() == MaxVmas) {
+    Kernel::k->panic("Too many vmas");
+  }
+  for (auto &vma : vmas) {
+    if (start < vma.end && vma.start < end) {
+      Kernel::k->panic("Overlapping vmas");
     }
+  }
+  return &vmas.emplace_back(VirtualMemoryArea{start, end, flags, start, name});
+}
 
-    auto process = processes[current_pid];
-    if (process && process->id && process->state == ProcessState::Wait) {
-      process->state = ProcessState::Running;
-      break;
+VirtualMemoryArea *Process::find_vma(u64 vaddr) {
+  for (auto &vma : vmas) {
+    if (vma.contains(vaddr)) {
+      return &vma;
     }
   }
+  for (auto &vma : vmas) {
+    if ((vma.flags & VmaGrowsDown) && vaddr < vma.start && vaddr >= vma.limit) {
+      vma.start = vaddr & ~(PAGE_SIZE - 1);
+      return &vma;
+    }
+  }
+  return nullptr;
 }
 
-void store_current_thread_context(Context *context) {
-  memcpy(
-      &processes[current_pid]->context,
-      context,
-      sizeof(Context)
-  );
+bool Process::handle_page_fault(u64 vaddr, u64 error_code) {
+  auto flags = rmap_lock.lock_irqsave();
+  auto ret = handle_page_fault_locked(vaddr, error_code);
+  rmap_lock.unlock_irqrestore(flags);
+  return ret;
 }
-Context *current_context() {
-  return &processes[current_pid]->context;
+
+bool Process::handle_page_fault_locked(u64 vaddr, u64 error_code) {
+  auto vma = find_vma(vaddr);
+  if (!vma) {
+    return false;
+  }
+  if ((error_code & PageFaultWrite) && !(vma->flags & VmaWrite)) {
+    return false;
+  }
+  if ((error_code & PageFaultFetch) && !(vma->flags & VmaExec)) {
+    return false;
+  }
+  if (error_code & PageFaultPresent) {
+    auto pte = page_table_walk(pml4t, vaddr, false, false);
+    if ((error_code & PageFaultWrite) && pte && pte->p && (pte->avl & PteAvlCow)) {
+      return break_cow(vaddr, pte);
+    }
+    // the page is present and the access is allowed by the area, nothing to fix
+    return false;
+  }
+
+  auto page = vaddr & ~(PAGE_SIZE - 1);
+  // bytes of the page backed by the file
+  u64 file_bytes = 0;
+  u64 file_offset = 0;
+  if (vma->file && page < vma->file_end) {
+    file_offset = vma->file_offset + (page - vma->start);
+    file_bytes = min<u64>(PAGE_SIZE, vma->file_end - page);
+  }
+
+  auto pte = page_table_walk(pml4t, page, true, true);
+  if (pte->avl & PteAvlMigrating) {
+    // the page is still in place, the access can be retried
+    cancel_migration(pte);
+    return true;
+  }
+  if (pte->p) {
+    // another thread of the process mapped the page, the access can be retried
+    return true;
+  }
+  if (file_bytes == PAGE_SIZE && !(error_code & PageFaultWrite)) {
+    // map the page of the file itself, it is shared by every process running the file
+    pte->base_addr = page_table_translate(kernel_pml4t(), (u64)vma->file->data + file_offset) >> 12;
+    pte->rw = 0;
+    pte->avl = (vma->flags & VmaWrite) ? PteAvlCow : 0;
+  } else {
+    // anonymous memory, a write to file data, or the page where file data ends and bss starts
+    auto paddr = physical_page_alloc(Log2MinSize, file_bytes ? 0 : PageAllocZero);
+    if (paddr == 0) {
+      Kernel::sp() << "Out of memory for page fault at 0x" << IntRadix::Hex << vaddr << "\n";
+      return false;
+    }
+    if (file_bytes) {
+      auto mem = (u8*)phy2virt(paddr);
+      memcpy(mem, vma->file->data + file_offset, file_bytes);
+      memset(mem + file_bytes, 0, PAGE_SIZE - file_bytes);
+    }
+    pte->base_addr = paddr >> 12;
+    pte->rw = (vma->flags & VmaWrite) != 0;
+    pte->avl = 0;
+    set_movable(paddr, this, page);
+  }
+  pte->p = 1;
+  pte->us = 1;
+  pte->nx = nx_enabled && !(vma->flags & VmaExec);
+  resident_pages++;
+  return true;
 }
 
-void kyield() {
-  asm volatile(
-  "movq $0x2, %%rax\t\n"
-  "int $42"
-  :
-  :
-  :"%rax"
-  );
+bool Process::break_cow(u64 vaddr, PageTableEntry *pte) {
+  auto old_paddr = pte->base_addr << 12;
+  if (!page_exclusive(old_paddr)) {
+    auto paddr = physical_page_alloc(Log2MinSize);
+    if (paddr == 0) {
+      Kernel::sp() << "Out of memory for copy-on-write at 0x" << IntRadix::Hex << vaddr << "\n";
+      return false;
+    }
+    memcpy(phy2virt(paddr), phy2virt(old_paddr), PAGE_SIZE);
+    pte->base_addr = paddr >> 12;
+    put_page(old_paddr);
+    cow_copies++;
+  }
+  // the last user of a shared page takes it over without copying
+  if (phy_to_page(pte->base_addr << 12)) {
+    set_movable(pte->base_addr << 12, this, vaddr & ~(PAGE_SIZE - 1));
+  }
+  pte->rw = 1;
+  pte->avl &= ~PteAvlCow;
+  invlpg(vaddr & ~(PAGE_SIZE - 1));
+  return true;
 }
-void Process::map_user_addr(u64 vaddr, u64 paddr, u64 n_pages) {
-  for (u64 i = 0; i < n_pages; i++) {
-    auto vpage = (vaddr >> 12) + i;
-    auto ppage = (paddr >> 12) + i;
-    pts->pt[vpage].p = 1;
-    pts->pt[vpage].rw = 1;
-    pts->pt[vpage].us = 1;
-    pts->pt[vpage].base_addr = ppage;
+
+void Process::copy_address_space(Process *parent) {
+  vmas.resize(0);
+  for (auto &vma : parent->vmas) {
+    auto &copy = vmas.push_back(vma);
+    if (&vma == parent->heap) {
+      heap = &copy;
+    }
   }
+  brk_start = parent->brk_start;
+  brk_end = parent->brk_end;
+
+  // share every resident page, writable ones are mapped read-only in both processes
+  // and copied by the first write fault
+  auto flags = rmap_lock.lock_irqsave();
+  for (auto &vma : parent->vmas) {
+    for (u64 vaddr = vma.start; vaddr < vma.end; vaddr += PAGE_SIZE) {
+      auto pte = page_table_walk(parent->pml4t, vaddr, false, false);
+      if (pte && (pte->avl & PteAvlMigrating)) {
+        cancel_migration(pte);
+      }
+      if (!pte || !pte->p) {
+        continue;
+      }
+      if (pte->rw) {
+        pte->rw = 0;
+        pte->avl |= PteAvlCow;
+      }
+      auto child_pte = page_table_walk(pml4t, vaddr, true, true);
+      *child_pte = *pte;
+      // shared pages stay put, the reverse mapping only knows one address space
+      clear_movable(pte->base_addr << 12);
+      get_page(pte->base_addr << 12);
+      resident_pages++;
+    }
+  }
+  rmap_lock.unlock_irqrestore(flags);
+  // the parent keeps running on this cpu, drop its stale writable translations
+  flush_tlb();
 }
-void *Process::load_elf_from_buffer(char *buffer, unsigned long size) {
-  Elf64_Ehdr *ehdr = (Elf64_Ehdr*)buffer;
+
+void *Process::load_elf(const FileImage *file) {
+  auto buffer = file->data;
+  auto ehdr = (const Elf64_Ehdr*)buffer;
   const char *ElfMagic = "\x7f" "ELF";
   for (int i = 0; i < 4; i++) {
     if (ElfMagic[i] != buffer[i]) {
       Kernel::k->panic("Corrupted ELF file, invalid header magic");
     }
   }
+  assert(((u64)buffer & (PAGE_SIZE - 1)) == 0, "ELF image not page aligned");
 
   assert(ehdr->e_phoff, "program header table not found\n");
   Kernel::sp() << "elf has " << SerialPort::IntRadix::Dec << ehdr->e_phnum << " sections at 0x" << SerialPort::IntRadix::Hex << ehdr->e_phoff << "\n";
-  Kernel::sp() << "  p_offset p_filesz p_vaddr p_memsz\n";
+  Kernel::sp() << "  p_offset p_filesz p_vaddr p_memsz p_flags\n";
   for (int i = 0; i < ehdr->e_phnum; i++) {
-    auto phdr = (Elf64_Phdr*)(buffer + ehdr->e_phoff + ehdr->e_phentsize * i);
-    if (phdr->p_type == PT_LOAD && phdr->p_memsz > 0) {
-      Kernel::sp() << SerialPort::IntRadix::Hex << "  0x" << phdr->p_offset << " 0x" << phdr->p_filesz << " 0x" << phdr->p_vaddr << " 0x" << phdr->p_memsz << "\n";
-      assert(phdr->p_vaddr >= 0x100000, "Segment is at wrong location");
-      assert(phdr->p_vaddr+phdr->p_memsz <= USER_IMAGE_START + USER_IMAGE_SIZE, "Segment too big");
-      if (phdr->p_filesz <= phdr->p_memsz) {
-        memcpy((void*)phdr->p_vaddr, buffer + phdr->p_offset, phdr->p_filesz);
-      } else {
-        Kernel::k->panic("\nDon't know how to load sections that has filesize > memsize");
-      }
+    auto phdr = (const Elf64_Phdr*)(buffer + ehdr->e_phoff + ehdr->e_phentsize * i);
+    if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
+      continue;
+    }
+    Kernel::sp() << SerialPort::IntRadix::Hex << "  0x" << phdr->p_offset << " 0x" << phdr->p_filesz << " 0x" << phdr->p_vaddr
+                 << " 0x" << phdr->p_memsz << " 0x" << phdr->p_flags << "\n";
+    assert(phdr->p_vaddr >= 0x100000, "Segment is at wrong location");
+    assert(phdr->p_vaddr+phdr->p_memsz <= USER_IMAGE_START + USER_IMAGE_SIZE, "Segment too big");
+    assert(phdr->p_offset + phdr->p_filesz <= file->size, "Segment out of file");
+    if (phdr->p_filesz > phdr->p_memsz) {
+      Kernel::k->panic("\nSegment file size > memory size");
+    }
+    if ((phdr->p_offset - phdr->p_vaddr) % PAGE_SIZE != 0) {
+      Kernel::k->panic("\nSegment offset and address are not congruent modulo the page size");
     }
+
+    u32 flags = 0;
+    flags |= (phdr->p_flags & PF_R) ? VmaRead : 0;
+    flags |= (phdr->p_flags & PF_W) ? VmaWrite : 0;
+    flags |= (phdr->p_flags & PF_X) ? VmaExec : 0;
+    auto start = phdr->p_vaddr & ~(PAGE_SIZE - 1);
+    auto end = (phdr->p_vaddr + phdr->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    auto vma = add_vma(start, end, flags, (flags & VmaExec) ? "text" : (flags & VmaWrite) ? "data" : "rodata");
+    vma->file = file;
+    vma->file_offset = phdr->p_offset & ~(PAGE_SIZE - 1);
+    vma->file_end = phdr->p_vaddr + phdr->p_filesz;
   }
   Kernel::sp() << "entrypoint at " << SerialPort::IntRadix::Hex << ehdr->e_entry << "\n";
   return (void*)ehdr->e_entry;
 }
-void Process::kernel_entrypoint() {
-  Kernel::sp() << "starting process pid = "<< current_pid << " '" << name.c_str() << "'\n";
-  if (tmp_start) {
-//    Kernel::sp() << "has tmp_start, going for it" << "\n";
-    tmp_start(cookie);
-  }
-  Kernel::sp() << "process quit '" << name.c_str() << "'\n";
-  Kernel::k->panic("thread quit");
-}
-Process::Process(unsigned long id, unsigned long start_phy)
-    :id(id), start_phy(start_phy), syscall_(make_kup<Syscall>(Kernel::k, this)) {
+Process::Process(u64 id, const kstring &name)
+    :Thread(id, name, this, THREAD_KERNEL_STACK_SIZE), syscall_(make_kup<Syscall>(Kernel::k, this)) {
 
-  auto pts_log2size = log2(sizeof(PageTabletSructures)) + 1;
-  pts = (PageTabletSructures*)kernel_page_alloc(pts_log2size);
-  pts_paddr = kernel2phy((u64)pts);
-  memset(pts, 0, sizeof(PageTabletSructures));
+  pml4t = (PageMappingL4Entry*)kernel_page_alloc(Log2MinSize, PageAllocZero);
+  assert(pml4t != nullptr, "Out of memory for page table");
+  pml4t_paddr = kernel2phy((u64)pml4t);
 
   // reuse kernel space map
-  pts->pml4t[256].p = 1;
-  pts->pml4t[256].rw = 1;
-  pts->pml4t[256].base_addr = get_kernel_pdpt_phy_addr() >> 12;
-
-  // create a new user space map
-  pts->pml4t[0].p = 1;
-  pts->pml4t[0].rw = 1;
-  pts->pml4t[0].us = 1;
-  pts->pml4t[0].base_addr = (pts_paddr + ((u64)&pts->pdpt[0] - (u64)pts)) >> 12;
-
-  // only the first pdpt is used
-  pts->pdpt[0].p = 1;
-  pts->pdpt[0].rw = 1;
-  pts->pdpt[0].us = 1; // allow userspace
-  pts->pdpt[0].base_addr = (pts_paddr + ((u64)&pts->pdt[0] - (u64)pts)) >> 12;
-
-  for (u64 i = 0; i < sizeof(pts->pdt) / sizeof(pts->pdt[0]); i++) {
-    pts->pdt[i].p = 1;
-    pts->pdt[i].rw = 1;
-    pts->pdt[i].us = 1;
-    pts->pdt[i].base_addr = (pts_paddr + ((u64)&pts->pt[i * PAGES_PER_TABLE] - (u64)pts)) >> 12;
-  }
+  copy_kernel_page_table(pml4t);
+
+  // all user memory is populated by page faults
 
-  // 1MiB ~ 9MiB are for exec image
+  // 1MiB ~ 9MiB are for exec image, load_elf() adds an area per segment
   user_image = (u8*)USER_IMAGE_START;
-  user_image_phy_addr = physical_page_alloc(log2(USER_IMAGE_SIZE));
-  map_user_addr((u64)user_image, user_image_phy_addr, user_image_size / PAGE_SIZE);
 
-  // 16MiB ~ 32MiB for user brk
+  // 16MiB ~ 32MiB for user brk, the heap area is extended by sys_anon_allocate()
   brk_start = USER_BRK_START;
   brk_end = USER_BRK_START + USER_BRK_SIZE;
+  heap = add_vma(brk_start, brk_start, VmaRead | VmaWrite, "heap");
 
-  // 32MiB ~ 33MiB are for user stack
+  // 33MiB ~ 34MiB are for user stack, it starts with one page and grows on faults
   user_stack = (u8*)(33UL*1024UL*1024UL);
-  user_stack_phy_addr = physical_page_alloc(log2(USER_STACK_SIZE));
-  map_user_addr((u64)user_stack, user_stack_phy_addr, user_stack_size / PAGE_SIZE);
-
-  context.cr3 = pts_paddr;
-  context.cs = KERNEL_CODE_SELECTOR;
-  context.ds = KERNEL_DATA_SELECTOR;
-  context.ss = KERNEL_DATA_SELECTOR;
-  context.es = KERNEL_DATA_SELECTOR;
-  context.fs = KERNEL_DATA_SELECTOR;
-  context.gs = KERNEL_DATA_SELECTOR;
-  context.rsp = (u64)kernel_stack_bottom;
-  context.rip = (u64)&process_entrypoint;
-  // NOTE: enable interrupt in the process
-  context.rflags = 0x200;
-  // first parameter for process_entry_point(p)
-  context.rdi = (u64)this;
+  auto stack_top = (u64)user_stack + user_stack_size;
+  auto stack = add_vma(stack_top - PAGE_SIZE, stack_top, VmaRead | VmaWrite | VmaGrowsDown, "stack");
+  stack->limit = (u64)user_stack;
+
+  context.cr3 = pml4t_paddr;
 
   print();
 }
+
+Process::~Process() {
+  // Kernel threads on any cpu may still run on this page table, and TLBs hold entries tagged with
+  // the PCID of the process. Both are gone before the pages and page tables are freed.
+  address_space_release(id, this);
+  tlb_shootdown_leave(pml4t_paddr);
+  auto flags = rmap_lock.lock_irqsave();
+  for (auto &vma : vmas) {
+    for (u64 vaddr = vma.start; vaddr < vma.end; vaddr += PAGE_SIZE) {
+      auto pte = page_table_walk(pml4t, vaddr, false, false);
+      if (pte && (pte->avl & PteAvlMigrating)) {
+        cancel_migration(pte);
+      }
+      if (pte && pte->p) {
+        clear_movable(pte->base_addr << 12);
+        put_page(pte->base_addr << 12);
+      }
+    }
+  }
+  rmap_lock.unlock_irqrestore(flags);
+  free_user_page_tables(pml4t);
+  kernel_page_free(pml4t);
+}
+
+bool migrate_page(u64 paddr, u64 new_paddr) {
+  auto flags = rmap_lock.lock_irqsave();
+  auto page = phy_to_page(paddr);
+  if (migration_busy || !(page->flags & PageMovable) || page->refcount != 1) {
+    rmap_lock.unlock_irqrestore(flags);
+    return false;
+  }
+  auto process = (Process*)page->owner;
+  auto vaddr = page->index;
+  auto pml4t_paddr = process->pml4t_paddr;
+  auto pte = page_table_walk(process->pml4t, vaddr, false, false);
+  assert(pte && pte->p && pte->base_addr == paddr >> 12, "stale reverse mapping of a movable page");
+
+  // Unmap the page while it is copied, other cpus forget the PCID of the process.
+  pte->p = 0;
+  pte->avl |= PteAvlMigrating;
+  migration_busy = true;
+  migration_cancelled = false;
+  address_space_release(process->id, process);
+  rmap_lock.unlock_irqrestore(flags);
+
+  // tlb_shootdown() waits for all cpus with interrupts disabled, it must not hold rmap_lock
+  // other cpus may be spinning on. Interrupts stay disabled from the local flush on,
+  // so the thread cannot move to another cpu before the others are flushed.
+  auto irq_flags = irq_save();
+  if (get_pml4t_phy() == pml4t_paddr) {
+    invlpg(vaddr);
+  }
+  tlb_shootdown();
+  irq_restore(irq_flags);
+
+  // the process may have used or dropped the mapping meanwhile
+  flags = rmap_lock.lock_irqsave();
+  migration_busy = false;
+  if (migration_cancelled) {
+    rmap_lock.unlock_irqrestore(flags);
+    return false;
+  }
+  memcpy(phy2virt(new_paddr), phy2virt(paddr), PAGE_SIZE);
+  clear_movable(paddr);
+  set_movable(new_paddr, process, vaddr);
+  pte->base_addr = new_paddr >> 12;
+  pte->avl &= ~PteAvlMigrating;
+  pte->p = 1;
+  rmap_lock.unlock_irqrestore(flags);
+  return true;
+}
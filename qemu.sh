@@ -7,6 +7,7 @@ sudo $QEMU \
   -machine q35 \
   -no-reboot \
   -m 5G \
+  -smp 4 \
   -vga std \
   -net nic,model=rtl8139,macaddr=0a:01:0e:0a:01:0e \
   -net bridge,br=br0 \
@@ -0,0 +1,65 @@
+#include <run_queue.h>
+#include <kernel.h>
+#include <thread.h>
+
+static_assert(SchedPriorities <= 32, "the run queue bitmap is 32 bits");
+
+void RunQueue::enqueue(Thread *p) {
+  assert(!p->on_run_queue, "thread already on the run queue");
+  assert(p->priority < SchedPriorities, "invalid priority");
+  auto &level = levels_[p->priority];
+  p->rq_prev = level.tail;
+  p->rq_next = nullptr;
+  if (level.tail) {
+    level.tail->rq_next = p;
+  } else {
+    level.head = p;
+  }
+  level.tail = p;
+  p->on_run_queue = true;
+  bitmap_ |= 1u << p->priority;
+  size_++;
+}
+
+void RunQueue::dequeue(Thread *p) {
+  assert(p->on_run_queue, "thread not on the run queue");
+  auto &level = levels_[p->priority];
+  if (p->rq_prev) {
+    p->rq_prev->rq_next = p->rq_next;
+  } else {
+    level.head = p->rq_next;
+  }
+  if (p->rq_next) {
+    p->rq_next->rq_prev = p->rq_prev;
+  } else {
+    level.tail = p->rq_prev;
+  }
+  p->rq_prev = nullptr;
+  p->rq_next = nullptr;
+  p->on_run_queue = false;
+  if (!level.head) {
+    bitmap_ &= ~(1u << p->priority);
+  }
+  size_--;
+}
+
+Thread *RunQueue::pick_next() {
+  if (empty()) {
+    return nullptr;
+  }
+  auto p = levels_[highest_priority()].head;
+  dequeue(p);
+  return p;
+}
+
+Thread *RunQueue::steal() {
+  for (auto bitmap = bitmap_; bitmap; bitmap &= bitmap - 1) {
+    for (auto p = levels_[__builtin_ctz(bitmap)].head; p; p = p->rq_next) {
+      if (!p->on_cpu && !p->pinned) {
+        dequeue(p);
+        return p;
+      }
+    }
+  }
+  return nullptr;
+}
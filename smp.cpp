@@ -0,0 +1,255 @@
+#include <smp.h>
+#include <cpu_defs.h>
+#include <cpu_utils.h>
+#include <efi/efi.h>
+#include <efi/efidef.h>
+#include <kernel.h>
+#include <irq.hpp>
+#include <percpu.h>
+#include <async.h>
+#include <softirq.h>
+#include <syscall.h>
+#include <thread.h>
+#include <common/kmemory.hpp>
+#include <common/kspinlock.hpp>
+#include <device/apic.h>
+#include <lib/port_io.h>
+#include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/ioremap.h>
+#include <mm/mm.h>
+#include <mm/page_alloc.h>
+#include <mm/page_table.h>
+#include <atomic>
+
+extern "C" u8 ap_trampoline_start[];
+extern "C" u8 ap_trampoline_end[];
+extern "C" u8 ap_trampoline_cr0[];
+extern "C" u8 ap_trampoline_cr3[];
+extern "C" u8 ap_trampoline_cr4[];
+extern "C" u8 ap_trampoline_efer[];
+extern "C" u8 ap_trampoline_stack[];
+extern "C" u8 ap_trampoline_cpu[];
+extern "C" u8 ap_trampoline_entry[];
+
+// APIC IDs of the application processors
+static u32 ap_apic_ids[MaxCpus];
+static u64 n_ap_apic_ids = 0;
+
+// set by ap_start() once the starting cpu no longer uses the trampoline and its temporary page table
+static volatile bool ap_entered;
+
+// TLB shootdown requests, see tlb_shootdown()
+static PER_CPU volatile bool tlb_flush_requested;
+static std::atomic<u64> tlb_flush_pending;
+// page table that cpus switch away from when they flush, 0 for none, see tlb_shootdown_leave()
+static volatile u64 tlb_leave_pml4t;
+static kspinlock tlb_shootdown_lock;
+
+void smp_add_cpu(u32 apic_id) {
+  if (apic_id == cpus[0]->apic_id) {
+    return;
+  }
+  if (n_ap_apic_ids + 1 >= MaxCpus) {
+    Kernel::sp() << "too many cpus, ignoring APIC ID " << IntRadix::Dec << apic_id << "\n";
+    return;
+  }
+  ap_apic_ids[n_ap_apic_ids++] = apic_id;
+}
+
+// port 0x80 is unused, each access takes about 1us
+static void io_delay_us(u64 us) {
+  for (u64 i = 0; i < us; i++) {
+    outb(0x80, 0);
+  }
+}
+
+// a free page below 1M for the real mode entry of the application processors, 0 if there is none
+static u64 find_trampoline_page() {
+  auto &efi_info = Kernel::k->efi_info;
+  for (int i = 0; i < efi_info.descriptor_count; i++) {
+    auto md = (EFI_MEMORY_DESCRIPTOR*)(efi_info.memory_descriptors + i * efi_info.descriptor_size);
+    if (md->Type != EfiConventionalMemory) {
+      continue;
+    }
+    // page 0 holds the real mode IVT
+    auto start = max(md->PhysicalStart, (u64)PAGE_SIZE);
+    auto end = md->PhysicalStart + md->NumberOfPages * PAGE_SIZE;
+    if (start + PAGE_SIZE <= min(end, 0x100000UL)) {
+      return start;
+    }
+  }
+  return 0;
+}
+
+static void trampoline_set(u8 *trampoline, const u8 *field, u64 value) {
+  *(u64*)(trampoline + (field - ap_trampoline_start)) = value;
+}
+
+static void leave_pml4t(u64 pml4t_paddr) {
+  if (pml4t_paddr && get_pml4t_phy() == pml4t_paddr) {
+    set_cr3(page_table_translate(kernel_pml4t(), (u64)kernel_pml4t()));
+  }
+}
+
+static void tlb_flush_ack() {
+  auto &requested = per_cpu(tlb_flush_requested);
+  if (requested) {
+    requested = false;
+    leave_pml4t(tlb_leave_pml4t);
+    flush_tlb();
+    tlb_flush_pending--;
+  }
+}
+
+static void shootdown(u64 pml4t_paddr) {
+  auto flags = irq_save();
+  auto self = this_cpu();
+  // another cpu may be waiting for us with its interrupts disabled
+  while (!tlb_shootdown_lock.try_lock()) {
+    tlb_flush_ack();
+    __builtin_ia32_pause();
+  }
+  leave_pml4t(pml4t_paddr);
+  tlb_leave_pml4t = pml4t_paddr;
+  for (u64 i = 0; i < n_cpus; i++) {
+    auto cpu = cpus[i];
+    if (cpu == self || !cpu->online) {
+      continue;
+    }
+    tlb_flush_pending++;
+    per_cpu(tlb_flush_requested, cpu) = true;
+    lapic_send_ipi(cpu->apic_id, IRQ_IPI_TLB_SHOOTDOWN);
+  }
+  while (tlb_flush_pending > 0) {
+    __builtin_ia32_pause();
+  }
+  tlb_leave_pml4t = 0;
+  tlb_shootdown_lock.unlock();
+  irq_restore(flags);
+}
+
+void tlb_shootdown() {
+  shootdown(0);
+}
+
+void tlb_shootdown_leave(u64 pml4t_paddr) {
+  shootdown(pml4t_paddr);
+}
+
+// Entry of application processors in long mode, on their interrupt stack with the temporary page table.
+// Sets up the per-cpu state the boot cpu got from mm_init(), irq_init(), SetupSyscall() and lapic_init(),
+// creates the threads of the cpu, then runs the idle thread.
+extern "C" [[noreturn]] void ap_start(PerCpu *cpu) {
+  set_cr3(page_table_translate(kernel_pml4t(), (u64)kernel_pml4t()));
+  ap_entered = true;
+  load_cpu_gdt(cpu->gdt, cpu->tss, cpu->interrupt_stack_top);
+  percpu_load(cpu);
+  Kernel::k->irq_->load();
+  pat_cpu_init();
+  if (pcid_enabled) {
+    set_cr4(get_cr4() | CR4_PCIDE);
+  }
+  Syscall::InitCpu();
+  lapic_init_ap();
+
+  create_idle_thread(cpu);
+  softirq_init(cpu);
+  executor_init(cpu);
+  set_first_thread(cpu->idle);
+  Kernel::sp() << "cpu " << IntRadix::Dec << cpu->id << " online, APIC ID " << cpu->apic_id << "\n";
+  cpu->online = true;
+  return_from_syscall(current_context());
+  __builtin_unreachable();
+}
+
+// INIT-SIPI-SIPI, returns true if the cpu came up.
+// A cpu that did not get past the trampoline in time is parked with another INIT,
+// it would otherwise wake up later on the trampoline data of the next cpu.
+static bool start_cpu(PerCpu *cpu, u64 trampoline_phy) {
+  ap_entered = false;
+  lapic_send_init(cpu->apic_id);
+  io_delay_us(10000);
+  for (int i = 0; i < 2 && !ap_entered; i++) {
+    lapic_send_startup(cpu->apic_id, trampoline_phy >> 12);
+    io_delay_us(200);
+  }
+  for (int i = 0; i < 100000 && !ap_entered; i++) {
+    io_delay_us(1);
+  }
+  if (!ap_entered) {
+    lapic_send_init(cpu->apic_id);
+    return false;
+  }
+  // past the trampoline the cpu only runs kernel code on its own data
+  while (!cpu->online) {
+    __builtin_ia32_pause();
+  }
+  return true;
+}
+
+void smp_init() {
+  Kernel::k->irq_->Register(IRQ_IPI_TLB_SHOOTDOWN, [](IrqHandlerInfo *) {
+    tlb_flush_ack();
+    lapic_eoi();
+  });
+
+  if (n_ap_apic_ids == 0) {
+    Kernel::sp() << "SMP: no application processors\n";
+    return;
+  }
+  auto trampoline_phy = find_trampoline_page();
+  if (trampoline_phy == 0) {
+    Kernel::sp() << "SMP: no free memory below 1M for the AP trampoline\n";
+    return;
+  }
+  auto size = (u64)(ap_trampoline_end - ap_trampoline_start);
+  assert(size <= PAGE_SIZE, "AP trampoline is larger than a page");
+  auto trampoline = (u8*)ioremap(trampoline_phy, PAGE_SIZE, CacheWriteBack);
+  memcpy(trampoline, ap_trampoline_start, size);
+
+  // the trampoline enables paging while running at its physical address,
+  // cr3 is loaded in 32-bit mode so the PML4 has to be below 4G
+  auto pml4t = (PageMappingL4Entry*)kernel_page_alloc(Log2MinSize, PageAllocDMA32 | PageAllocZero);
+  assert(pml4t != nullptr, "Out of memory for the AP page table");
+  copy_kernel_page_table(pml4t);
+  auto pte = page_table_walk(pml4t, trampoline_phy, true, false);
+  pte->p = 1;
+  pte->rw = 1;
+  pte->base_addr = trampoline_phy >> 12;
+
+  trampoline_set(trampoline, ap_trampoline_cr0, get_cr0());
+  trampoline_set(trampoline, ap_trampoline_cr3, kernel2phy((u64)pml4t));
+  trampoline_set(trampoline, ap_trampoline_cr4, get_cr4() & ~CR4_PCIDE);
+  trampoline_set(trampoline, ap_trampoline_efer, get_msr(EFER_MSR) & ~EFER_LMA);
+  trampoline_set(trampoline, ap_trampoline_entry, (u64)&ap_start);
+
+  u64 online = 1;
+  for (u64 i = 0; i < n_ap_apic_ids; i++) {
+    auto cpu = percpu_alloc(n_cpus, ap_apic_ids[i]);
+    cpu->gdt = (SegmentDescriptor*)kmalloc(GdtEntries * sizeof(SegmentDescriptor));
+    cpu->tss = knew<TaskStateSegment>();
+    auto interrupt_stack = (u8*)kernel_page_alloc(log2_ceil(INTERRUPT_STACK_SIZE));
+    assert(cpu->gdt != nullptr && cpu->tss != nullptr && interrupt_stack != nullptr, "Out of memory for cpu");
+    cpu->interrupt_stack_top = interrupt_stack + INTERRUPT_STACK_SIZE - 128;
+    Kernel::k->stacks_.push_back(std::make_tuple((u64)interrupt_stack, (u64)cpu->interrupt_stack_top));
+
+    // ap_start() runs on the interrupt stack until it switches to the idle thread
+    trampoline_set(trampoline, ap_trampoline_stack, (u64)cpu->interrupt_stack_top);
+    trampoline_set(trampoline, ap_trampoline_cpu, (u64)cpu);
+    // a cpu that does not come up keeps its slot, ids are never reused
+    cpus[n_cpus++] = cpu;
+    if (!start_cpu(cpu, trampoline_phy)) {
+      // do not risk more cpus on a machine where one misbehaves
+      Kernel::sp() << "SMP: cpu with APIC ID " << IntRadix::Dec << cpu->apic_id
+                   << " did not come up, not starting the others\n";
+      break;
+    }
+    online++;
+  }
+  Kernel::sp() << "SMP: " << IntRadix::Dec << online << " cpus online\n";
+
+  free_user_page_tables(pml4t);
+  kernel_page_free(pml4t);
+  iounmap(trampoline, PAGE_SIZE);
+}
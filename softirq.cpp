@@ -0,0 +1,69 @@
+#include <softirq.h>
+#include <cpu_utils.h>
+#include <kernel.h>
+#include <percpu.h>
+#include <thread.h>
+#include <common/kmemory.hpp>
+
+// A running tasklet is queued again by the cpu running it, see SoftirqQueue::run().
+// Interrupts stay disabled so that the queue is the one of the cpu this runs on.
+void Tasklet::schedule() {
+  auto flags = irq_save();
+  if (!(state_.fetch_or(Scheduled) & (Scheduled | Running))) {
+    this_cpu()->softirq.enqueue(this);
+  }
+  irq_restore(flags);
+}
+
+void SoftirqQueue::enqueue(Tasklet *t) {
+  auto flags = irq_save();
+  t->next_ = nullptr;
+  if (tail_) {
+    tail_->next_ = t;
+  } else {
+    head_ = t;
+  }
+  tail_ = t;
+  irq_restore(flags);
+  wq.wake_one();
+}
+
+void SoftirqQueue::run() {
+  auto flags = irq_save();
+  auto list = head_;
+  head_ = nullptr;
+  tail_ = nullptr;
+  irq_restore(flags);
+
+  while (list) {
+    auto t = list;
+    list = t->next_;
+    // from now on schedule() only marks it, it is queued again below
+    t->state_.store(Tasklet::Running);
+    t->func_(t->data_);
+    u32 running = Tasklet::Running;
+    if (!t->state_.compare_exchange_strong(running, 0)) {
+      // scheduled while it ran
+      t->state_.store(Tasklet::Scheduled);
+      enqueue(t);
+    }
+  }
+}
+
+static void softirq_main(void *cookie) {
+  auto &queue = ((PerCpu*)cookie)->softirq;
+  while (true) {
+    queue.wq.wait_event([&]() { return !queue.empty(); });
+    queue.run();
+  }
+}
+
+void softirq_init(PerCpu *cpu) {
+  auto t = knew<Thread>(alloc_thread_id(), "softirq", nullptr, KTHREAD_STACK_SIZE);
+  assert(t != nullptr, "Out of memory for the softirq thread");
+  t->tmp_start = softirq_main;
+  t->cookie = cpu;
+  t->priority = SoftirqPriority;
+  t->pinned = true;
+  start_thread_on(t, cpu);
+}
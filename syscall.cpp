@@ -4,14 +4,46 @@
 #include <process.h>
 #include <kernel-abi/syscall_nr.h>
 #include <mm/mm.h>
+#include <lib/string.h>
 
 void handle_syscall(Process *p, Context *c);
 
+extern "C" void _syscall_entry();
+
+// RFLAGS bits cleared on syscall entry: TF, IF, DF, AC
+constexpr u64 SyscallFlagsMask = (1u << 8) | (1u << 9) | (1u << 10) | (1u << 18);
+
 void Syscall::SetupSyscall(Kernel *kernel) {
+  // int $42 is kept for kernel threads, they have no Syscall object and can only yield
   kernel->irq_->Register(IRQ_SYSCALL, [](IrqHandlerInfo *info) {
-    auto p = processes[info->pid];
+    auto p = threads[info->tid]->process;
+    if (!p) {
+      assert(info->context->rax == SYSCALL_NR_YIELD, "syscall other than yield from a kernel thread");
+      this_cpu()->need_resched = true;
+      return;
+    }
     handle_syscall(p, info->context);
   });
+
+  InitCpu();
+}
+
+void Syscall::InitCpu() {
+  // syscall loads cs = STAR[47:32], ss = cs + 8
+  // sysret loads ss = STAR[63:48] + 8, cs = STAR[63:48] + 16
+  u64 star = ((u64)(USER_DATA_SELECTOR - 8) << 48) | ((u64)KERNEL_CODE_SELECTOR << 32);
+  set_msr(STAR_MSR, star);
+  set_msr(LSTAR_MSR, (u64)&_syscall_entry);
+  set_msr(FMASK_MSR, SyscallFlagsMask);
+  set_msr(EFER_MSR, get_msr(EFER_MSR) | EFER_SCE);
+}
+
+// Called by _syscall_entry with the user registers saved in the context of the current thread.
+// Returns true if the thread has to go through schedule() and return with iretq instead of sysret.
+extern "C" bool syscall_handler(Context *c) {
+  handle_syscall(Process::current(), c);
+  // sysret with a non-canonical rip faults in kernel mode on the user stack
+  return this_cpu()->need_resched || c->rip >= USER_SPACE_END;
 }
 
 
@@ -32,6 +64,7 @@ SyscallFunc syscall_table[] = {
     [SYSCALL_NR_EXIT] = &Syscall::sys_exit,
     [SYSCALL_NR_YIELD] = &Syscall::sys_yield,
     [SYSCALL_NR_ANON_ALLOCATE] = &Syscall::sys_anon_allocate,
+    [SYSCALL_NR_FORK] = &Syscall::sys_fork,
 };
 
 }
@@ -85,11 +118,12 @@ int Syscall::sys_close() {
   return -1;
 }
 int Syscall::sys_exit() {
-  Kernel::sp() << "process " << SerialPort::IntRadix::Dec << current_pid << " successfully exit, not implemented so halt\n";
+  Kernel::sp() << "process " << SerialPort::IntRadix::Dec << process_->id << " successfully exit, not implemented so halt\n";
   halt();
   return -1;
 }
 int Syscall::sys_yield() {
+  this_cpu()->need_resched = true;
   return 0;
 }
 
@@ -98,21 +132,37 @@ int Syscall::sys_anon_allocate() {
   auto size = (size_t)c.rdi;
   auto ptr = (void**)c.rsi;
   auto &ret = c.rax;
-  Kernel::sp() << "process " << SerialPort::IntRadix::Dec << current_pid << " anon_allocate(0x" << IntRadix::Hex << size << ", 0x" << (u64)ptr << ")\n";
+  Kernel::sp() << "process " << SerialPort::IntRadix::Dec << process_->id << " anon_allocate(0x" << IntRadix::Hex << size << ", 0x" << (u64)ptr << ")\n";
 
   auto aligned_size = (size + (PAGE_SIZE-1)) / PAGE_SIZE * PAGE_SIZE;
 
-  auto buf = kmalloc(aligned_size);
-  auto buf_phy = kernel2phy((u64)buf);
+  // pages are allocated when they are touched
   auto brk_start = process_->brk_start;
-  process_->brk_start += aligned_size;
-  if (process_->brk_start > process_->brk_end) {
+  if (brk_start + aligned_size > process_->brk_end) {
     Kernel::sp() << "user brk overflow\n";
     return -1;
   }
-  process_->map_user_addr(brk_start, buf_phy, aligned_size / PAGE_SIZE);
+  process_->brk_start += aligned_size;
+  process_->heap->end = process_->brk_start;
 
   *ptr = (void*)brk_start;
 
   return 0;
-}
\ No newline at end of file
+}
+
+int Syscall::sys_fork() {
+  // the child is only started once it is a complete copy, another cpu may run it right away
+  auto child = knew<Process>(alloc_thread_id(), process_->name);
+  child->copy_address_space(process_);
+
+  // the child returns to user space from the same syscall, with return value 0
+  memcpy(&child->context, &process_->context, sizeof(Context));
+  child->context.cr3 = child->pml4t_paddr;
+  child->context.rax = 0;
+
+  Kernel::sp() << "process " << SerialPort::IntRadix::Dec << process_->id << " forked " << child->id
+               << ", sharing " << child->resident_pages << " pages\n";
+  auto id = child->id;
+  start_thread(child);
+  return (int)id;
+}
@@ -0,0 +1,301 @@
+#include <cpu_defs.h>
+#include <kernel.h>
+#include <lib/string.h>
+#include <lib/utils.h>
+#include <mm/mm.h>
+#include <mm/page_alloc.h>
+#include <mm/page_table.h>
+#include <thread.h>
+#include <process.h>
+#include <irq.hpp>
+#include <run_queue.h>
+#include <wait.h>
+#include <softirq.h>
+#include <kernel-abi/syscall_nr.h>
+#include <device/apic.h>
+#include <atomic>
+
+static std::atomic<u64> next_tid = 1;
+Thread *threads[MAX_THREADS];
+
+static bool mwait_supported = false;
+
+// An interrupt waking up a thread sets need_resched and schedules on its way out.
+// sti only takes effect after the next instruction, so no interrupt is missed before halting.
+// A remote wakeup writing need_resched also ends mwait, the IPI is needed for hlt.
+static void idle_main(void *) {
+  auto cpu = this_cpu();
+  while (true) {
+    if (mwait_supported) {
+      asm volatile("monitor" : : "a"(&cpu->need_resched), "c"(0), "d"(0));
+      if (!cpu->need_resched) {
+        asm volatile("sti\n\tmwait" : : "a"(0), "c"(0) : "memory");
+      }
+    } else {
+      asm volatile("sti\n\thlt" : : : "memory");
+    }
+  }
+}
+
+Thread::Thread(u64 id, const kstring &name, Process *process, u64 kernel_stack_size)
+    :id(id), name(name), process(process), kernel_stack_size(kernel_stack_size) {
+  kernel_stack = (u8*)kernel_page_alloc(log2_ceil(kernel_stack_size));
+  assert(kernel_stack != nullptr, "Out of memory for kernel stack");
+
+  memset(&context, 0, sizeof(context));
+  // cr3 = 0 keeps the page table of the previous thread, processes set their own
+  context.cs = KERNEL_CODE_SELECTOR;
+  context.ds = KERNEL_DATA_SELECTOR;
+  context.ss = KERNEL_DATA_SELECTOR;
+  context.es = KERNEL_DATA_SELECTOR;
+  // gs is never loaded, see percpu.h
+  context.fs = 0;
+  context.gs = 0;
+  context.rsp = (u64)kernel_stack_top();
+  context.rip = (u64)&entrypoint;
+  // NOTE: enable interrupt in the thread
+  context.rflags = 0x200;
+  // first parameter for entrypoint(t)
+  context.rdi = (u64)this;
+}
+
+Thread::~Thread() {
+  auto &rq = cpus[cpu]->run_queue;
+  auto flags = rq.lock.lock_irqsave();
+  if (on_run_queue) {
+    rq.dequeue(this);
+  }
+  rq.lock.unlock_irqrestore(flags);
+  if (threads[id] == this) {
+    threads[id] = nullptr;
+  }
+  kernel_page_free(kernel_stack);
+}
+
+void Thread::entrypoint(Thread *t) {
+  Kernel::sp() << "starting thread tid = " << t->id << " '" << t->name.c_str() << "' on cpu " << this_cpu()->id << "\n";
+  if (t->tmp_start) {
+    t->tmp_start(t->cookie);
+  }
+  Kernel::sp() << "thread quit '" << t->name.c_str() << "'\n";
+  kthread_exit();
+}
+
+u64 alloc_thread_id() {
+  auto id = next_tid++;
+  assert(id < MAX_THREADS, "Too many threads");
+  return id;
+}
+
+void start_thread(Thread *t) {
+  start_thread_on(t, this_cpu());
+}
+
+void start_thread_on(Thread *t, PerCpu *cpu) {
+  assert(threads[t->id] == nullptr, "Thread already created");
+  threads[t->id] = t;
+  t->cpu = cpu->id;
+  t->last_cpu = cpu->id;
+  auto flags = cpu->run_queue.lock.lock_irqsave();
+  cpu->run_queue.enqueue(t);
+  cpu->run_queue.lock.unlock_irqrestore(flags);
+}
+
+void set_first_thread(Thread *t) {
+  auto cpu = this_cpu();
+  auto &rq = cpus[t->cpu]->run_queue;
+  auto flags = rq.lock.lock_irqsave();
+  if (t->on_run_queue) {
+    rq.dequeue(t);
+  }
+  rq.lock.unlock_irqrestore(flags);
+  t->state = ThreadState::Running;
+  t->cpu = cpu->id;
+  t->last_cpu = cpu->id;
+  t->on_cpu = true;
+  cpu->current = t;
+  cpu->switch_in_tsc = rdtsc();
+  cpu->context_top = (u8*)(&t->context + 1);
+  cpu->kernel_stack_top = t->kernel_stack_top();
+}
+
+u64 create_kthread(const kstring &name, void (*start)(void*), void *cookie) {
+  auto t = knew<Thread>(alloc_thread_id(), name, nullptr, KTHREAD_STACK_SIZE);
+  t->tmp_start = start;
+  t->cookie = cookie;
+  start_thread(t);
+  return t->id;
+}
+
+Thread *create_idle_thread(PerCpu *cpu) {
+  auto t = knew<Thread>(alloc_thread_id(), "idle", nullptr, KTHREAD_STACK_SIZE);
+  t->tmp_start = idle_main;
+  // lowest priority, any wakeup preempts it
+  t->priority = SchedPriorities - 1;
+  t->cpu = cpu->id;
+  t->last_cpu = cpu->id;
+  threads[t->id] = t;
+  cpu->idle = t;
+  return t;
+}
+
+// the run queue of another cpu has threads waiting, the sizes are read without the locks as a hint
+static bool work_to_steal(const PerCpu *cpu) {
+  for (u64 i = 0; i < n_cpus; i++) {
+    if (cpus[i] != cpu && cpus[i]->online && !cpus[i]->run_queue.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void thread_init() {
+  Kernel::k->irq_->Register(IRQ_TIMER, [](IrqHandlerInfo *) {
+    auto cpu = this_cpu();
+    // the boot cpu keeps the time
+    if (cpu->id == 0) {
+      timer_tick();
+    }
+    auto t = cpu->current;
+    t->cpu_ticks++;
+    if (t == cpu->idle) {
+      if (work_to_steal(cpu)) {
+        cpu->need_resched = true;
+      }
+      return;
+    }
+    // round robin within a priority level, an idle run queue lets the slice run on
+    if (++t->jiffies >= t->max_jiffies) {
+      t->jiffies = 0;
+      if (cpu->run_queue.highest_priority() <= t->priority) {
+        cpu->need_resched = true;
+      }
+    }
+  });
+  // the waker has set need_resched, the interrupt only makes the cpu schedule on its way out
+  Kernel::k->irq_->Register(IRQ_IPI_RESCHEDULE, [](IrqHandlerInfo *) {
+    lapic_eoi();
+  });
+
+  memset(threads, 0, sizeof(threads));
+  next_tid = 1;
+
+  create_idle_thread(this_cpu());
+  softirq_init(this_cpu());
+  auto [std_eax, std_ebx, std_ecx, std_edx] = cpuid(1);
+  mwait_supported = std_ecx & CPUID_MONITOR;
+}
+
+void wake_up_thread(Thread *t) {
+  auto target = cpus[t->cpu];
+  auto flags = target->run_queue.lock.lock_irqsave();
+  bool kick = false;
+  if (t->state == ThreadState::Blocked) {
+    t->state = ThreadState::Wait;
+    target->run_queue.enqueue(t);
+    if (t->priority <= target->current->priority) {
+      target->need_resched = true;
+      kick = target != this_cpu();
+    }
+  }
+  target->run_queue.lock.unlock_irqrestore(flags);
+  if (kick) {
+    lapic_send_ipi(target->apic_id, IRQ_IPI_RESCHEDULE);
+  }
+}
+
+void kthread_exit() {
+  cli();
+  Thread::current()->state = ThreadState::Exited;
+  kyield();
+  Kernel::k->panic("exited thread scheduled");
+}
+
+// Takes a runnable thread queued on another cpu, starting from the next cpu so that idle cpus
+// do not all go for the same victim. The thread moves to the run queue of cpu from now on.
+static Thread *steal_thread(PerCpu *cpu) {
+  for (u64 i = 1; i < n_cpus; i++) {
+    auto victim = cpus[(cpu->id + i) % n_cpus];
+    if (!victim->online || victim->run_queue.empty()) {
+      continue;
+    }
+    victim->run_queue.lock.lock();
+    auto t = victim->run_queue.steal();
+    if (t) {
+      t->cpu = cpu->id;
+    }
+    victim->run_queue.lock.unlock();
+    if (t) {
+      return t;
+    }
+  }
+  return nullptr;
+}
+
+// Runs with interrupts disabled on the kernel stack of prev, which stays on_cpu until
+// return_from_syscall has left it.
+void schedule() {
+  auto cpu = this_cpu();
+  cpu->need_resched = false;
+  auto prev = cpu->current;
+  auto &rq = cpu->run_queue;
+
+  rq.lock.lock();
+  if (prev->state == ThreadState::Running) {
+    prev->state = ThreadState::Wait;
+    if (prev != cpu->idle) {
+      rq.enqueue(prev);
+    }
+  }
+  auto next = rq.pick_next();
+  rq.lock.unlock();
+
+  if (!next) {
+    next = steal_thread(cpu);
+  }
+  if (!next) {
+    next = cpu->idle;
+  }
+  next->state = ThreadState::Running;
+  if (next != prev) {
+    auto now = rdtsc();
+    prev->cpu_cycles += now - cpu->switch_in_tsc;
+    cpu->switch_in_tsc = now;
+    prev->switches++;
+    next->jiffies = 0;
+    next->on_cpu = true;
+    cpu->prev_on_cpu = &prev->on_cpu;
+    // kernel threads run on whatever address space is loaded
+    if (next->process) {
+      next->context.cr3 = address_space_cr3(next->process->pml4t_paddr, next->process->id, next->process,
+                                            next->last_cpu != cpu->id);
+    }
+    next->last_cpu = cpu->id;
+    cpu->current = next;
+  }
+  cpu->context_top = (u8*)(&next->context + 1);
+  cpu->kernel_stack_top = next->kernel_stack_top();
+}
+
+void store_current_thread_context(Context *context) {
+  auto &c = Thread::current()->context;
+  // the entry path does not read cr3, the thread's address space does not change
+  auto cr3 = c.cr3;
+  memcpy(&c, context, sizeof(Context));
+  c.cr3 = cr3;
+}
+
+Context *current_context() {
+  return &Thread::current()->context;
+}
+
+void Thread::print() const {
+  Kernel::sp() << "thread " << SerialPort::IntRadix::Dec << id << " '" << name.c_str() << "' cpu " << cpu << " priority " << priority
+               << " cpu ticks " << cpu_ticks << " cycles " << cpu_cycles << " switches " << switches << "\n";
+}
+
+// int $42 from a kernel thread only yields, the context switch happens on the way out of the interrupt
+void kyield() {
+  u64 nr = SYSCALL_NR_YIELD;
+  asm volatile("int $42" : "+a"(nr) : : "memory");
+}
@@ -2,10 +2,10 @@ void print(const char *str) {
   asm volatile(
   "movq $3, %%rax\t\n"
   "movq %0, %%rdi\t\n"
-  "int $42"
+  "syscall"
   :
   :"r"(str)
-  :"%rax"
+  :"%rax", "%rdi", "%rcx", "%r11", "memory"
   );
 }
 
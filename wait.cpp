@@ -0,0 +1,208 @@
+#include <wait.h>
+#include <kernel.h>
+#include <irq.hpp>
+#include <thread.h>
+
+volatile u64 timer_ticks = 0;
+
+// Threads in a timed wait sorted by deadline, linked through Thread::sleep_prev/sleep_next,
+// so that a tick only looks at the head. Thread::wait_deadline is 0 for a thread off the list.
+// The lock nests inside the wait queue locks, timer_tick() wakes sleepers without taking those:
+// a thread woken by its deadline takes itself off its wait queue.
+static Thread *sleepers = nullptr;
+static kspinlock sleepers_lock;
+
+static void sleepers_add(Thread *p, u64 deadline) {
+  sleepers_lock.lock();
+  p->wait_deadline = deadline;
+  Thread *prev = nullptr;
+  auto next = sleepers;
+  while (next && next->wait_deadline <= deadline) {
+    prev = next;
+    next = next->sleep_next;
+  }
+  p->sleep_prev = prev;
+  p->sleep_next = next;
+  if (prev) {
+    prev->sleep_next = p;
+  } else {
+    sleepers = p;
+  }
+  if (next) {
+    next->sleep_prev = p;
+  }
+  sleepers_lock.unlock();
+}
+
+static void sleepers_remove_locked(Thread *p) {
+  if (p->sleep_prev) {
+    p->sleep_prev->sleep_next = p->sleep_next;
+  } else {
+    sleepers = p->sleep_next;
+  }
+  if (p->sleep_next) {
+    p->sleep_next->sleep_prev = p->sleep_prev;
+  }
+  p->sleep_prev = nullptr;
+  p->sleep_next = nullptr;
+  p->wait_deadline = 0;
+}
+
+void WaitQueue::sleep(u64 deadline) {
+  assert(this_cpu()->irq_depth == 0, "sleeping in an interrupt handler or syscall");
+  auto p = Thread::current();
+
+  p->wait_prev = tail_;
+  p->wait_next = nullptr;
+  if (tail_) {
+    tail_->wait_next = p;
+  } else {
+    head_ = p;
+  }
+  tail_ = p;
+  p->wait_queue = this;
+
+  // schedule() leaves blocked threads off the run queue, this returns after wake_up_thread()
+  auto &rq = cpus[p->cpu]->run_queue;
+  rq.lock.lock();
+  p->state = ThreadState::Blocked;
+  rq.lock.unlock();
+  // a wakeup from now on puts p back on the run queue, schedule() keeps it there
+  if (deadline) {
+    sleepers_add(p, deadline);
+  }
+  lock_->unlock();
+  kyield();
+  lock_->lock();
+
+  // woken up by the deadline, or by a wakeup before the deadline
+  if (p->wait_queue == this) {
+    remove(p);
+  }
+  if (deadline) {
+    sleepers_lock.lock();
+    if (p->wait_deadline) {
+      sleepers_remove_locked(p);
+    }
+    sleepers_lock.unlock();
+  }
+}
+
+void WaitQueue::remove(Thread *p) {
+  assert(p->wait_queue == this, "thread is not waiting on this queue");
+  if (p->wait_prev) {
+    p->wait_prev->wait_next = p->wait_next;
+  } else {
+    head_ = p->wait_next;
+  }
+  if (p->wait_next) {
+    p->wait_next->wait_prev = p->wait_prev;
+  } else {
+    tail_ = p->wait_prev;
+  }
+  p->wait_prev = nullptr;
+  p->wait_next = nullptr;
+  p->wait_queue = nullptr;
+}
+
+bool WaitQueue::wake_one_locked() {
+  auto p = head_;
+  if (p) {
+    remove(p);
+    wake_up_thread(p);
+  }
+  return p != nullptr;
+}
+
+bool WaitQueue::wake_one() {
+  auto flags = lock_->lock_irqsave();
+  auto ret = wake_one_locked();
+  lock_->unlock_irqrestore(flags);
+  return ret;
+}
+
+void WaitQueue::wake_all_locked() {
+  while (auto p = head_) {
+    remove(p);
+    wake_up_thread(p);
+  }
+}
+
+void WaitQueue::wake_all() {
+  auto flags = lock_->lock_irqsave();
+  wake_all_locked();
+  lock_->unlock_irqrestore(flags);
+}
+
+void timer_tick() {
+  auto now = timer_ticks + 1;
+  timer_ticks = now;
+  sleepers_lock.lock();
+  while (sleepers && sleepers->wait_deadline <= now) {
+    auto p = sleepers;
+    sleepers_remove_locked(p);
+    wake_up_thread(p);
+  }
+  sleepers_lock.unlock();
+}
+
+void sleep_ticks(u64 ticks) {
+  WaitQueue wq;
+  wq.wait_event_timeout([]() { return false; }, ticks);
+}
+
+void Completion::complete() {
+  auto flags = wq_.lock().lock_irqsave();
+  done_++;
+  wq_.wake_one_locked();
+  wq_.lock().unlock_irqrestore(flags);
+}
+
+void Completion::wait() {
+  auto flags = wq_.lock().lock_irqsave();
+  while (done_ == 0) {
+    wq_.sleep(0);
+  }
+  done_--;
+  wq_.lock().unlock_irqrestore(flags);
+}
+
+bool Completion::wait_timeout(u64 timeout_ticks) {
+  auto flags = wq_.lock().lock_irqsave();
+  auto deadline = timer_ticks + timeout_ticks;
+  while (done_ == 0 && timer_ticks < deadline) {
+    wq_.sleep(deadline);
+  }
+  bool ret = done_ > 0;
+  if (ret) {
+    done_--;
+  }
+  wq_.lock().unlock_irqrestore(flags);
+  return ret;
+}
+
+void Semaphore::down() {
+  auto flags = wq_.lock().lock_irqsave();
+  while (count_ <= 0) {
+    wq_.sleep(0);
+  }
+  count_--;
+  wq_.lock().unlock_irqrestore(flags);
+}
+
+bool Semaphore::try_down() {
+  auto flags = wq_.lock().lock_irqsave();
+  bool ret = count_ > 0;
+  if (ret) {
+    count_--;
+  }
+  wq_.lock().unlock_irqrestore(flags);
+  return ret;
+}
+
+void Semaphore::up() {
+  auto flags = wq_.lock().lock_irqsave();
+  count_++;
+  wq_.wake_one_locked();
+  wq_.lock().unlock_irqrestore(flags);
+}
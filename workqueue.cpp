@@ -0,0 +1,176 @@
+#include <workqueue.h>
+#include <cpu_utils.h>
+#include <kernel.h>
+#include <percpu.h>
+#include <thread.h>
+#include <common/kmemory.hpp>
+
+WorkQueue *system_wq;
+
+WorkQueue::WorkQueue(const kstring &name) :name_(name) { }
+
+void WorkQueue::grow(u64 n_workers) {
+  while (n_workers_ < n_workers) {
+    n_workers_++;
+    create_kthread(name_, WorkQueue::worker_main, this);
+  }
+}
+
+void WorkQueue::enqueue_locked(Work *work) {
+  work->deadline_ = 0;
+  // the worker running it queues it again when it is done
+  if (work->running_) {
+    return;
+  }
+  work->next_ = nullptr;
+  if (tail_) {
+    tail_->next_ = work;
+  } else {
+    head_ = work;
+  }
+  tail_ = work;
+  work->queued_tsc_ = rdtsc();
+  stats_.queued++;
+  if (++stats_.depth > stats_.max_depth) {
+    stats_.max_depth = stats_.depth;
+  }
+  worker_wq_.wake_one_locked();
+}
+
+bool WorkQueue::queue_work(Work *work) {
+  auto flags = lock_.lock_irqsave();
+  bool ret = !work->pending_;
+  if (ret) {
+    work->pending_ = true;
+    enqueue_locked(work);
+  }
+  lock_.unlock_irqrestore(flags);
+  return ret;
+}
+
+bool WorkQueue::queue_delayed_work(Work *work, u64 delay_ticks) {
+  if (delay_ticks == 0) {
+    return queue_work(work);
+  }
+  auto flags = lock_.lock_irqsave();
+  bool ret = !work->pending_;
+  if (ret) {
+    work->pending_ = true;
+    work->deadline_ = timer_ticks + delay_ticks;
+    work->next_ = delayed_;
+    delayed_ = work;
+    stats_.delayed++;
+    // an idle worker sleeps again with the new deadline
+    worker_wq_.wake_one_locked();
+  }
+  lock_.unlock_irqrestore(flags);
+  return ret;
+}
+
+Work *WorkQueue::take_locked() {
+  for (auto p = &delayed_; *p; ) {
+    auto work = *p;
+    if (work->deadline_ <= timer_ticks) {
+      *p = work->next_;
+      stats_.delayed--;
+      enqueue_locked(work);
+    } else {
+      p = &work->next_;
+    }
+  }
+
+  auto work = head_;
+  if (work) {
+    head_ = work->next_;
+    if (!head_) {
+      tail_ = nullptr;
+    }
+    work->next_ = nullptr;
+    stats_.depth--;
+  }
+  return work;
+}
+
+u64 WorkQueue::next_deadline_locked() const {
+  u64 deadline = 0;
+  for (auto work = delayed_; work; work = work->next_) {
+    if (deadline == 0 || work->deadline_ < deadline) {
+      deadline = work->deadline_;
+    }
+  }
+  return deadline;
+}
+
+void WorkQueue::worker_main(void *cookie) {
+  auto wq = (WorkQueue*)cookie;
+  auto flags = wq->lock_.lock_irqsave();
+  while (true) {
+    auto work = wq->take_locked();
+    if (!work) {
+      wq->worker_wq_.sleep(wq->next_deadline_locked());
+      continue;
+    }
+    work->pending_ = false;
+    work->running_ = true;
+    wq->busy_++;
+    auto start = rdtsc();
+    wq->stats_.wait_cycles += start - work->queued_tsc_;
+    wq->lock_.unlock_irqrestore(flags);
+
+    work->func_(work->data_);
+
+    auto cycles = rdtsc() - start;
+    flags = wq->lock_.lock_irqsave();
+    work->running_ = false;
+    wq->busy_--;
+    wq->stats_.executed++;
+    wq->stats_.exec_cycles += cycles;
+    if (cycles > wq->stats_.max_exec_cycles) {
+      wq->stats_.max_exec_cycles = cycles;
+    }
+    // queued again while it ran
+    if (work->pending_ && work->deadline_ == 0) {
+      wq->enqueue_locked(work);
+    }
+    wq->flush_wq_.wake_all_locked();
+  }
+}
+
+void WorkQueue::flush_work(Work *work) {
+  flush_wq_.wait_event([work]() { return !work->pending_ && !work->running_; });
+}
+
+void WorkQueue::flush() {
+  flush_wq_.wait_event([this]() { return head_ == nullptr && busy_ == 0; });
+}
+
+WorkQueueStats WorkQueue::stats() const {
+  auto flags = lock_.lock_irqsave();
+  auto ret = stats_;
+  lock_.unlock_irqrestore(flags);
+  return ret;
+}
+
+void WorkQueue::print() const {
+  auto s = stats();
+  Kernel::sp() << "workqueue '" << name_.c_str() << "' workers " << SerialPort::IntRadix::Dec << n_workers_
+               << " queued " << s.queued << " executed " << s.executed << " depth " << s.depth
+               << " max depth " << s.max_depth << " delayed " << s.delayed << " cycles " << s.exec_cycles
+               << " max cycles " << s.max_exec_cycles << " wait cycles " << s.wait_cycles << "\n";
+}
+
+void workqueue_init() {
+  system_wq = knew<WorkQueue>("kworker");
+  assert(system_wq != nullptr, "Out of memory for system_wq");
+  system_wq->grow(1);
+}
+
+void workqueue_smp_init() {
+  u64 online = 0;
+  for (u64 i = 0; i < n_cpus; i++) {
+    if (cpus[i]->online) {
+      online++;
+    }
+  }
+  system_wq->grow(online);
+}